@@ -0,0 +1,160 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "sonixflasher.h"
+#include "checksum.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_X86
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN)
+#define CHECKSUM_NEON
+#include <arm_neon.h>
+#endif
+
+// The vector kernels add 16-bit lanes, which wrap modulo 2^16 just like the
+// scalar sum, and fold the lanes together at the end. Loads are little-endian on
+// every target they are built for, so lane i holds word i of the block.
+
+static bool scalar_supported(void) {
+    return true;
+}
+
+static uint16_t scalar_sum(const unsigned char *data, size_t size) {
+    uint16_t sum = 0;
+    size_t   i;
+
+    for (i = 0; i + 1 < size; i += 2) {
+        uint16_t value = data[i] | (data[i + 1] << 8);
+        sum += value;
+    }
+
+    if (i < size) {
+        sum += data[i];
+    }
+
+    return sum;
+}
+
+static void scalar_reports(const unsigned char *data, size_t reports, uint16_t *sums) {
+    for (size_t i = 0; i < reports; i++)
+        sums[i] = scalar_sum(data + i * REPORT_SIZE, REPORT_SIZE);
+}
+
+#ifdef CHECKSUM_X86
+static bool sse2_supported(void) {
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2"))) static uint16_t sse2_fold(__m128i v) {
+    v = _mm_add_epi16(v, _mm_srli_si128(v, 8));
+    v = _mm_add_epi16(v, _mm_srli_si128(v, 4));
+    v = _mm_add_epi16(v, _mm_srli_si128(v, 2));
+    return (uint16_t)_mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse2"))) static uint16_t sse2_sum(const unsigned char *data, size_t size) {
+    __m128i acc = _mm_setzero_si128();
+    size_t  i   = 0;
+
+    for (; i + 16 <= size; i += 16)
+        acc = _mm_add_epi16(acc, _mm_loadu_si128((const __m128i *)(data + i)));
+    return sse2_fold(acc) + scalar_sum(data + i, size - i);
+}
+
+__attribute__((target("sse2"))) static void sse2_reports(const unsigned char *data, size_t reports, uint16_t *sums) {
+    for (size_t i = 0; i < reports; i++, data += REPORT_SIZE) {
+        __m128i a = _mm_add_epi16(_mm_loadu_si128((const __m128i *)data), _mm_loadu_si128((const __m128i *)(data + 16)));
+        __m128i b = _mm_add_epi16(_mm_loadu_si128((const __m128i *)(data + 32)), _mm_loadu_si128((const __m128i *)(data + 48)));
+        sums[i]   = sse2_fold(_mm_add_epi16(a, b));
+    }
+}
+
+static bool avx2_supported(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2"))) static uint16_t avx2_fold(__m256i v) {
+    __m128i x = _mm_add_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    x         = _mm_add_epi16(x, _mm_srli_si128(x, 8));
+    x         = _mm_add_epi16(x, _mm_srli_si128(x, 4));
+    x         = _mm_add_epi16(x, _mm_srli_si128(x, 2));
+    return (uint16_t)_mm_cvtsi128_si32(x);
+}
+
+__attribute__((target("avx2"))) static uint16_t avx2_sum(const unsigned char *data, size_t size) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t  i   = 0;
+
+    for (; i + 32 <= size; i += 32)
+        acc = _mm256_add_epi16(acc, _mm256_loadu_si256((const __m256i *)(data + i)));
+    return avx2_fold(acc) + scalar_sum(data + i, size - i);
+}
+
+__attribute__((target("avx2"))) static void avx2_reports(const unsigned char *data, size_t reports, uint16_t *sums) {
+    for (size_t i = 0; i < reports; i++, data += REPORT_SIZE)
+        sums[i] = avx2_fold(_mm256_add_epi16(_mm256_loadu_si256((const __m256i *)data), _mm256_loadu_si256((const __m256i *)(data + 32))));
+}
+#endif
+
+#ifdef CHECKSUM_NEON
+static bool neon_supported(void) {
+    return true; // Part of the AArch64 base architecture
+}
+
+static uint16_t neon_sum(const unsigned char *data, size_t size) {
+    uint16x8_t acc = vdupq_n_u16(0);
+    size_t     i   = 0;
+
+    for (; i + 16 <= size; i += 16)
+        acc = vaddq_u16(acc, vreinterpretq_u16_u8(vld1q_u8(data + i)));
+    return (uint16_t)(vaddvq_u16(acc) + scalar_sum(data + i, size - i));
+}
+
+static void neon_reports(const unsigned char *data, size_t reports, uint16_t *sums) {
+    for (size_t i = 0; i < reports; i++, data += REPORT_SIZE) {
+        uint16x8_t a = vaddq_u16(vreinterpretq_u16_u8(vld1q_u8(data)), vreinterpretq_u16_u8(vld1q_u8(data + 16)));
+        uint16x8_t b = vaddq_u16(vreinterpretq_u16_u8(vld1q_u8(data + 32)), vreinterpretq_u16_u8(vld1q_u8(data + 48)));
+        sums[i]      = vaddvq_u16(vaddq_u16(a, b));
+    }
+}
+#endif
+
+// In order of preference, the last supported one is used
+const checksum16_kernel_t checksum16_kernels[] = {
+    {"scalar", scalar_supported, scalar_sum, scalar_reports},
+#ifdef CHECKSUM_X86
+    {"sse2", sse2_supported, sse2_sum, sse2_reports},
+    {"avx2", avx2_supported, avx2_sum, avx2_reports},
+#endif
+#ifdef CHECKSUM_NEON
+    {"neon", neon_supported, neon_sum, neon_reports},
+#endif
+};
+const int checksum16_kernel_count = sizeof(checksum16_kernels) / sizeof(checksum16_kernels[0]);
+
+static const checksum16_kernel_t *selected_kernel;
+static pthread_once_t             selected_once = PTHREAD_ONCE_INIT;
+
+static void select_kernel(void) {
+    selected_kernel = &checksum16_kernels[0];
+    for (int i = 1; i < checksum16_kernel_count; i++) {
+        if (checksum16_kernels[i].supported()) selected_kernel = &checksum16_kernels[i];
+    }
+}
+
+const checksum16_kernel_t *checksum16_kernel(void) {
+    pthread_once(&selected_once, select_kernel);
+    return selected_kernel;
+}
+
+uint16_t checksum16(const unsigned char *data, size_t size) {
+    return checksum16_kernel()->sum(data, size);
+}
+
+void checksum16_reports(const unsigned char *data, size_t reports, uint16_t *sums) {
+    checksum16_kernel()->reports(data, reports, sums);
+}
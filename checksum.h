@@ -0,0 +1,34 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// checksum16, the bootloader's checksum: the sum of the little-endian 16-bit
+// words of a range, modulo 2^16, with a trailing odd byte added as is. Image
+// preparation checksums every report, so besides the portable version there are
+// SSE2, AVX2 and NEON kernels, chosen at run time by what the CPU supports.
+// All of them give bit-identical results.
+
+typedef struct {
+    const char *name;
+    bool (*supported)(void);
+    uint16_t (*sum)(const unsigned char *data, size_t size);
+    // checksum16 of each of the reports REPORT_SIZE blocks at data into sums
+    void (*reports)(const unsigned char *data, size_t reports, uint16_t *sums);
+} checksum16_kernel_t;
+
+// Every kernel built in, the portable one first. Some may not run on this CPU.
+extern const checksum16_kernel_t checksum16_kernels[];
+extern const int                 checksum16_kernel_count;
+
+// The fastest kernel this CPU supports.
+const checksum16_kernel_t *checksum16_kernel(void);
+
+uint16_t checksum16(const unsigned char *data, size_t size);
+
+// checksum16 of every REPORT_SIZE block, see checksum16_kernel_t.reports.
+void checksum16_reports(const unsigned char *data, size_t reports, uint16_t *sums);
+
+#endif // CHECKSUM_H
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sonixflasher.h"
+#include "checksum.h"
+
+// Microbenchmark for the checksum16 kernels, run by make bench-checksum. Every
+// kernel this CPU supports is checked against the scalar one, on odd sizes and
+// offsets as well as whole reports, then timed on images the size of the
+// SN32F290's flash.
+
+#define BENCH_IMAGE_SIZE USER_ROM_SIZE_KB(USER_ROM_SIZE_SN32F290)
+#define BENCH_ROUNDS 2000
+
+static uint64_t bench_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool check_kernel(const checksum16_kernel_t *k, const unsigned char *data) {
+    const checksum16_kernel_t *scalar = &checksum16_kernels[0];
+    static uint16_t            expected[BENCH_IMAGE_SIZE / REPORT_SIZE];
+    static uint16_t            sums[BENCH_IMAGE_SIZE / REPORT_SIZE];
+
+    scalar->reports(data, BENCH_IMAGE_SIZE / REPORT_SIZE, expected);
+    k->reports(data, BENCH_IMAGE_SIZE / REPORT_SIZE, sums);
+    if (memcmp(sums, expected, sizeof(sums)) != 0) return false;
+    if (k->sum(data, BENCH_IMAGE_SIZE) != scalar->sum(data, BENCH_IMAGE_SIZE)) return false;
+    for (size_t offset = 0; offset < 4; offset++) {
+        for (size_t size = 0; size <= 300; size++) {
+            if (k->sum(data + offset, size) != scalar->sum(data + offset, size)) return false;
+        }
+    }
+    return true;
+}
+
+int main(void) {
+    unsigned char *data      = malloc(BENCH_IMAGE_SIZE);
+    uint16_t      *sums      = malloc(BENCH_IMAGE_SIZE / REPORT_SIZE * sizeof(uint16_t));
+    bool           ok        = true;
+    double         scalar_ns = 0;
+
+    if (data == NULL || sums == NULL) {
+        fprintf(stderr, "ERROR: Could not allocate the benchmark image.\n");
+        return 1;
+    }
+    srand(0x5032);
+    for (long i = 0; i < BENCH_IMAGE_SIZE; i++)
+        data[i] = (unsigned char)rand();
+
+    printf("checksum16 of %d KB images, %d rounds, kernel in use: %s\n", BENCH_IMAGE_SIZE / 1024, BENCH_ROUNDS, checksum16_kernel()->name);
+    for (int i = 0; i < checksum16_kernel_count; i++) {
+        const checksum16_kernel_t *k = &checksum16_kernels[i];
+        if (!k->supported()) {
+            printf("  %-7s not supported by this CPU\n", k->name);
+            continue;
+        }
+        bool identical = check_kernel(k, data);
+        ok             = ok && identical;
+
+        uint64_t start = bench_ns();
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            // Vary the data a little so the rounds can't be folded together
+            data[round % BENCH_IMAGE_SIZE]++;
+            k->reports(data, BENCH_IMAGE_SIZE / REPORT_SIZE, sums);
+        }
+        double ns = (double)(bench_ns() - start) / BENCH_ROUNDS;
+        if (i == 0) scalar_ns = ns;
+        printf("  %-7s %8.1f us/image  %7.0f MB/s  %5.2fx  %s\n", k->name, ns / 1e3, BENCH_IMAGE_SIZE * 1e3 / ns, scalar_ns / ns, identical ? "identical" : "MISMATCH");
+    }
+
+    free(data);
+    free(sums);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,455 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+
+#define DAEMON_LINE_MAX 8192
+#define DAEMON_BACKLOG 16
+
+struct daemon_client {
+    int             fd;
+    pthread_mutex_t lock; // Serialises writes, one event per line
+};
+
+typedef struct {
+    daemon_client_t client;
+    daemon_job_fn   run_job;
+    daemon_key_fn   job_key;
+} daemon_connection_t;
+
+// Jobs holding a device key, so two clients never flash the same device at once.
+typedef struct daemon_key {
+    char               name[DAEMON_FIELD_SIZE];
+    bool               busy;
+    struct daemon_key *next;
+} daemon_key_t;
+
+static pthread_mutex_t       daemon_lock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t        daemon_cond    = PTHREAD_COND_INITIALIZER;
+static daemon_key_t         *daemon_keys    = NULL;
+static int                   daemon_running = 0; // Jobs in progress
+static volatile sig_atomic_t daemon_stop    = 0;
+
+static uint64_t daemon_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void daemon_signal(int signo) {
+    (void)signo;
+    daemon_stop = 1;
+}
+
+static bool send_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Append str to buf as a JSON string literal and terminate buf. Returns the
+// length the result needs, like snprintf.
+static size_t json_quote(char *buf, size_t pos, size_t size, const char *str) {
+    if (pos < size) buf[pos] = '"';
+    pos++;
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+        char esc[8] = "";
+        if (*c == '"' || *c == '\\')
+            snprintf(esc, sizeof(esc), "\\%c", *c);
+        else if (*c == '\n')
+            snprintf(esc, sizeof(esc), "\\n");
+        else if (*c < 0x20)
+            snprintf(esc, sizeof(esc), "\\u%04x", *c);
+        else
+            esc[0] = *c;
+        for (char *e = esc; *e; e++, pos++) {
+            if (pos < size) buf[pos] = *e;
+        }
+    }
+    if (pos < size) buf[pos] = '"';
+    pos++;
+    if (size > 0) buf[pos < size ? pos : size - 1] = '\0';
+    return pos;
+}
+
+// Send {"id":<id>,"event":<event><fields>} followed by a newline. fields is
+// either empty or starts with a comma.
+static void send_event(daemon_client_t *client, const char *id, const char *event, const char *fields) {
+    char   buf[DAEMON_LINE_MAX];
+    size_t pos = 0;
+
+    pos += snprintf(buf, sizeof(buf), "{\"id\":");
+    pos = json_quote(buf, pos, sizeof(buf), id);
+    pos += snprintf(buf + pos, pos < sizeof(buf) ? sizeof(buf) - pos : 0, ",\"event\":\"%s\"%s}\n", event, fields);
+    if (pos >= sizeof(buf)) {
+        // Truncated, drop the tail of the event and keep the line valid JSON
+        pos = snprintf(buf, sizeof(buf), "{\"id\":null,\"event\":\"%s\",\"truncated\":true}\n", event);
+    }
+
+    pthread_mutex_lock(&client->lock);
+    send_all(client->fd, buf, pos);
+    pthread_mutex_unlock(&client->lock);
+}
+
+void daemon_send_line(daemon_client_t *client, const char *id, int stream_no, const char *line) {
+    char fields[DAEMON_LINE_MAX / 2];
+    int  len = snprintf(fields, sizeof(fields), ",\"stream\":\"%s\",\"line\":", stream_no ? "stderr" : "stdout");
+    json_quote(fields, len, sizeof(fields), line);
+    send_event(client, id, "log", fields);
+}
+
+static void send_error(daemon_client_t *client, const char *id, const char *message) {
+    char fields[1024];
+    int  len = snprintf(fields, sizeof(fields), ",\"message\":");
+    json_quote(fields, len, sizeof(fields), message);
+    send_event(client, id, "error", fields);
+}
+
+static const char *skip_space(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+    return p;
+}
+
+// Parse a JSON string literal at p into out. Returns the position after the
+// closing quote, NULL when malformed or too long.
+static const char *parse_string(const char *p, char *out, size_t out_size) {
+    size_t len = 0;
+
+    if (*p++ != '"') return NULL;
+    while (*p != '"') {
+        char c = *p++;
+        if (c == '\0') return NULL;
+        if (c == '\\') {
+            switch (*p++) {
+                case '"':
+                    c = '"';
+                    break;
+                case '\\':
+                    c = '\\';
+                    break;
+                case '/':
+                    c = '/';
+                    break;
+                case 'n':
+                    c = '\n';
+                    break;
+                case 't':
+                    c = '\t';
+                    break;
+                case 'u': {
+                    // Paths and ids are expected to be ASCII
+                    unsigned int code;
+                    if (sscanf(p, "%4x", &code) != 1 || code > 0x7f) return NULL;
+                    c = (char)code;
+                    p += 4;
+                    break;
+                }
+                default:
+                    return NULL;
+            }
+        }
+        if (len + 1 >= out_size) return NULL;
+        out[len++] = c;
+    }
+    out[len] = '\0';
+    return p + 1;
+}
+
+static bool set_string(char *dst, size_t dst_size, const char *value, bool is_string) {
+    if (!is_string || strlen(value) >= dst_size) return false;
+    strcpy(dst, value);
+    return true;
+}
+
+static bool set_bool(bool *dst, const char *value, bool is_string) {
+    if (is_string) return false;
+    if (strcmp(value, "true") == 0)
+        *dst = true;
+    else if (strcmp(value, "false") == 0)
+        *dst = false;
+    else
+        return false;
+    return true;
+}
+
+static bool set_job_field(daemon_job_t *job, const char *key, const char *value, bool is_string) {
+    if (strcmp(key, "id") == 0) return set_string(job->id, sizeof(job->id), value, is_string);
+    if (strcmp(key, "path") == 0) return set_string(job->path, sizeof(job->path), value, is_string);
+    if (strcmp(key, "vidpid") == 0) return set_string(job->vidpid, sizeof(job->vidpid), value, is_string);
+    if (strcmp(key, "file") == 0) return set_string(job->file, sizeof(job->file), value, is_string);
+    if (strcmp(key, "reboot") == 0) return set_string(job->reboot, sizeof(job->reboot), value, is_string);
+    if (strcmp(key, "emulate") == 0) return set_string(job->emulate, sizeof(job->emulate), value, is_string);
+    if (strcmp(key, "jumploader") == 0) return set_bool(&job->jumploader, value, is_string);
+    if (strcmp(key, "nooffset") == 0) return set_bool(&job->no_offset_check, value, is_string);
+    if (strcmp(key, "diff") == 0) return set_bool(&job->differential, value, is_string);
+    if (strcmp(key, "trim") == 0) return set_bool(&job->trim, value, is_string);
+    if (strcmp(key, "verify_only") == 0) return set_bool(&job->verify_only, value, is_string);
+    if (strcmp(key, "offset") == 0) {
+        // Either a number or a string such as "0x200"
+        char *end;
+        errno       = 0;
+        job->offset = strtol(value, &end, 0);
+        if (errno == ERANGE || *end != '\0' || end == value || job->offset < 0) return false;
+        job->offset_given = true;
+        return true;
+    }
+    return false;
+}
+
+// Parse one request line: a flat JSON object with string, number and boolean
+// values. Unknown keys are rejected so typos don't silently change a flash.
+static bool parse_job(const char *line, daemon_job_t *job, char *error, size_t error_size) {
+    const char *p = skip_space(line);
+
+    memset(job, 0, sizeof(*job));
+    if (*p++ != '{') {
+        snprintf(error, error_size, "request is not a JSON object");
+        return false;
+    }
+    p = skip_space(p);
+    while (*p != '}') {
+        char key[32];
+        char value[DAEMON_FIELD_SIZE];
+        bool is_string;
+
+        p = parse_string(p, key, sizeof(key));
+        if (p == NULL || *(p = skip_space(p)) != ':') {
+            snprintf(error, error_size, "malformed key");
+            return false;
+        }
+        p         = skip_space(p + 1);
+        is_string = *p == '"';
+        if (is_string) {
+            p = parse_string(p, value, sizeof(value));
+        } else {
+            size_t len = strcspn(p, ",} \t\r\n");
+            if (len == 0 || len >= sizeof(value)) p = NULL;
+            if (p) {
+                memcpy(value, p, len);
+                value[len] = '\0';
+                p += len;
+            }
+        }
+        if (p == NULL) {
+            snprintf(error, error_size, "malformed value for '%s'", key);
+            return false;
+        }
+        if (!set_job_field(job, key, value, is_string)) {
+            snprintf(error, error_size, "invalid field '%s'", key);
+            return false;
+        }
+        p = skip_space(p);
+        if (*p == ',') {
+            p = skip_space(p + 1);
+        } else if (*p != '}') {
+            snprintf(error, error_size, "expected ',' or '}'");
+            return false;
+        }
+    }
+    if (*skip_space(p + 1) != '\0') {
+        snprintf(error, error_size, "trailing data after the object");
+        return false;
+    }
+    if (job->file[0] == '\0') {
+        snprintf(error, error_size, "'file' is required");
+        return false;
+    }
+    if ((job->path[0] != '\0') + (job->vidpid[0] != '\0') + (job->emulate[0] != '\0') != 1) {
+        snprintf(error, error_size, "exactly one of 'path', 'vidpid' or 'emulate' is required");
+        return false;
+    }
+    return true;
+}
+
+// Wait until no other job holds key and take it. An empty key isn't locked.
+static void key_acquire(const char *key) {
+    pthread_mutex_lock(&daemon_lock);
+    daemon_running++;
+    if (key[0] != '\0') {
+        daemon_key_t *k = daemon_keys;
+        while (k && strcmp(k->name, key) != 0)
+            k = k->next;
+        if (k == NULL && (k = calloc(1, sizeof(*k))) != NULL) {
+            snprintf(k->name, sizeof(k->name), "%s", key);
+            k->next     = daemon_keys;
+            daemon_keys = k;
+        }
+        while (k && k->busy)
+            pthread_cond_wait(&daemon_cond, &daemon_lock);
+        if (k) k->busy = true;
+    }
+    pthread_mutex_unlock(&daemon_lock);
+}
+
+static void key_release(const char *key) {
+    pthread_mutex_lock(&daemon_lock);
+    for (daemon_key_t *k = daemon_keys; k && key[0] != '\0'; k = k->next) {
+        if (strcmp(k->name, key) == 0) {
+            k->busy = false;
+            break;
+        }
+    }
+    daemon_running--;
+    pthread_cond_broadcast(&daemon_cond);
+    pthread_mutex_unlock(&daemon_lock);
+}
+
+static void handle_request(daemon_connection_t *conn, const char *line) {
+    daemon_job_t job;
+    char         error[256] = "";
+    char         key[DAEMON_FIELD_SIZE];
+
+    if (!parse_job(line, &job, error, sizeof(error))) {
+        send_error(&conn->client, job.id, error);
+        return;
+    }
+
+    conn->job_key(&job, key, sizeof(key));
+    key_acquire(key);
+    send_event(&conn->client, job.id, "started", "");
+    uint64_t start = daemon_now_ms();
+    bool     ok    = conn->run_job(&job, &conn->client, error, sizeof(error));
+    key_release(key);
+
+    char fields[128];
+    snprintf(fields, sizeof(fields), ",\"ok\":%s,\"duration_ms\":%llu", ok ? "true" : "false", (unsigned long long)(daemon_now_ms() - start));
+    if (!ok && error[0] != '\0') send_error(&conn->client, job.id, error);
+    send_event(&conn->client, job.id, "result", fields);
+}
+
+// Serve one client: every line is a job, run in the order received.
+static void *connection_thread(void *arg) {
+    daemon_connection_t *conn = arg;
+    char                *buf  = malloc(DAEMON_LINE_MAX);
+    size_t               len  = 0;
+
+    while (buf && !daemon_stop) {
+        ssize_t n = recv(conn->client.fd, buf + len, DAEMON_LINE_MAX - 1 - len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+
+        char *line = buf;
+        char *nl;
+        while ((nl = memchr(line, '\n', len - (line - buf))) != NULL) {
+            *nl = '\0';
+            if (*skip_space(line) != '\0') handle_request(conn, line);
+            line = nl + 1;
+        }
+        len -= line - buf;
+        memmove(buf, line, len);
+        if (len == DAEMON_LINE_MAX - 1) {
+            send_error(&conn->client, "", "request line too long");
+            break;
+        }
+    }
+
+    free(buf);
+    close(conn->client.fd);
+    pthread_mutex_destroy(&conn->client.lock);
+    free(conn);
+    return NULL;
+}
+
+// Bind the listening socket, replacing a socket file left behind by a daemon
+// that is no longer running.
+static int daemon_listen(const char *socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: socket path '%s' is too long.\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "ERROR: A daemon is already listening on '%s'.\n", socket_path);
+        close(fd);
+        return -1;
+    }
+    unlink(socket_path);
+    close(fd);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || chmod(socket_path, 0600) < 0 || listen(fd, DAEMON_BACKLOG) < 0) {
+        fprintf(stderr, "ERROR: Could not listen on '%s': %s\n", socket_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool daemon_run(const char *socket_path, daemon_job_fn run_job, daemon_key_fn job_key) {
+    struct sigaction sa = {.sa_handler = daemon_signal};
+
+    // A client hanging up mid-job must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+    // No SA_RESTART, so accept() returns when asked to stop
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int fd = daemon_listen(socket_path);
+    if (fd < 0) return false;
+    printf("Listening on %s\n", socket_path);
+    fflush(stdout);
+
+    while (!daemon_stop) {
+        int client_fd = accept(fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno != EINTR) fprintf(stderr, "ERROR: accept failed: %s\n", strerror(errno));
+            continue;
+        }
+
+        daemon_connection_t *conn = calloc(1, sizeof(*conn));
+        pthread_t            thread;
+        if (conn == NULL) {
+            close(client_fd);
+            continue;
+        }
+        conn->client.fd = client_fd;
+        conn->run_job   = run_job;
+        conn->job_key   = job_key;
+        pthread_mutex_init(&conn->client.lock, NULL);
+        if (pthread_create(&thread, NULL, connection_thread, conn) != 0) {
+            fprintf(stderr, "ERROR: Could not start a client thread.\n");
+            close(client_fd);
+            pthread_mutex_destroy(&conn->client.lock);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    // Let running jobs finish, a device must not be left half flashed
+    printf("Stopping, waiting for running jobs...\n");
+    close(fd);
+    unlink(socket_path);
+    pthread_mutex_lock(&daemon_lock);
+    while (daemon_running > 0)
+        pthread_cond_wait(&daemon_cond, &daemon_lock);
+    pthread_mutex_unlock(&daemon_lock);
+    return true;
+}
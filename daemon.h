@@ -0,0 +1,51 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DAEMON_FIELD_SIZE 1024
+
+// One flash job as received over the socket. Every request is a single line
+// holding a JSON object, for example:
+//   {"id": "unit-42", "path": "1-2.3:1.0", "file": "/fw/kb.bin", "offset": 512,
+//    "jumploader": false, "reboot": "sonix"}
+// Only "file" and one of "path", "vidpid" or "emulate" are required. The
+// daemon answers with JSON lines carrying the job id: "started", one "log" per
+// output line, an optional "error" and finally "result" with "ok".
+typedef struct {
+    char id[64];
+    char path[DAEMON_FIELD_SIZE];  // Device path as enumerated by the backend
+    char vidpid[16];               // Alternative to path: first device matching "vvvv/pppp"
+    char file[DAEMON_FIELD_SIZE];
+    char reboot[16];               // OEM reboot option, empty for none
+    char emulate[16];              // Run against the emulated bootloader of this chip instead
+    long offset;
+    bool offset_given;
+    bool jumploader;
+    bool no_offset_check;
+    bool differential;
+    bool trim;
+    bool verify_only;
+} daemon_job_t;
+
+typedef struct daemon_client daemon_client_t;
+
+// Send one output line of the running job to its client as a "log" event.
+void daemon_send_line(daemon_client_t *client, const char *id, int stream_no, const char *line);
+
+// Run a job to completion. Output is streamed with daemon_send_line; on failure
+// error describes the reason when it wasn't reported as output already.
+typedef bool (*daemon_job_fn)(const daemon_job_t *job, daemon_client_t *client, char *error, size_t error_size);
+
+// Key jobs are serialised on: jobs for the same key never run concurrently.
+typedef void (*daemon_key_fn)(const daemon_job_t *job, char *key, size_t key_size);
+
+// Listen on the Unix socket socket_path and serve clients until the process is
+// stopped. Each client connection gets its own thread and runs its jobs in
+// order; jobs from different connections run in parallel unless their keys
+// match. SIGINT or SIGTERM stop the daemon once running jobs are done.
+// Returns false when the socket can't be set up.
+bool daemon_run(const char *socket_path, daemon_job_fn run_job, daemon_key_fn job_key);
+
+#endif // DAEMON_H
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hidapi.h>
+
+#include "sonixflasher.h"
+#include "image_cache.h"
+#include "discovery.h"
+
+#define DISCOVERY_PATH_SIZE 1024
+#define DISCOVERY_CACHE_ENTRIES 64
+
+typedef struct {
+    uint16_t vid;
+    uint16_t pid;
+    char     reboot[16];
+    char     topology[TOPOLOGY_SIZE];
+} discovery_entry_t;
+
+static const char *isp_chip_name(uint16_t pid) {
+    switch (pid) {
+        case SN229_PID:
+            return "SN32F22x/23x/24x";
+        case SN248B_PID:
+            return "SN32F24xB";
+        case SN248C_PID:
+            return "SN32F24xC";
+        case SN268_PID:
+            return "SN32F26x";
+        case SN289_PID:
+            return "SN32F28x";
+        case SN299_PID:
+            return "SN32F29x";
+    }
+    return "SN32";
+}
+
+char *discovery_default_file(void) {
+    char *cache = image_cache_default_dir();
+    if (cache == NULL) return NULL;
+
+    size_t size = strlen(cache) + sizeof("/discovery");
+    char  *file = malloc(size);
+    if (file) snprintf(file, size, "%s/discovery", cache);
+    free(cache);
+    return file;
+}
+
+// Lines are "vid pid reboot topology", reboot "-" when none, the topology last.
+static int discovery_cache_load(const char *cache_file, discovery_entry_t *entries, int max) {
+    char line[TOPOLOGY_SIZE + 64];
+    int  count = 0;
+
+    FILE *fp = cache_file ? fopen(cache_file, "r") : NULL;
+    if (fp == NULL) return 0;
+    while (count < max && fgets(line, sizeof(line), fp)) {
+        discovery_entry_t *e       = &entries[count];
+        unsigned int       vid     = 0, pid = 0;
+        int                name_at = 0;
+        if (sscanf(line, "%4x %4x %15s %n", &vid, &pid, e->reboot, &name_at) != 3 || name_at == 0) continue;
+        line[strcspn(line, "\n")] = '\0';
+        if (line[name_at] == '\0' || strlen(line + name_at) >= sizeof(e->topology)) continue;
+        strcpy(e->topology, line + name_at);
+        if (strcmp(e->reboot, "-") == 0) e->reboot[0] = '\0';
+        e->vid = (uint16_t)vid;
+        e->pid = (uint16_t)pid;
+        count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+static void discovery_add(const discovery_candidate_t *c, discovery_candidate_t *out, int *count, int max) {
+    for (int i = 0; i < *count; i++) {
+        // Interfaces of one device share its port, keep the first
+        if (strcmp(out[i].topology, c->topology) == 0) return;
+    }
+    if (*count < max) out[(*count)++] = *c;
+}
+
+static int compare_candidates(const void *a, const void *b) {
+    const discovery_candidate_t *ca = a, *cb = b;
+    if (ca->rank != cb->rank) return (int)ca->rank - (int)cb->rank;
+    return strcmp(ca->topology, cb->topology);
+}
+
+int discovery_scan(const sn32_transport_t *transport, const char *cache_file, discovery_candidate_t *out, int max) {
+    discovery_entry_t entries[DISCOVERY_CACHE_ENTRIES];
+    int               entry_count = discovery_cache_load(cache_file, entries, DISCOVERY_CACHE_ENTRIES);
+    int               count       = 0;
+
+    if (transport->enumerate == NULL) return 0;
+    struct hid_device_info *devs = transport->enumerate(0, 0);
+    for (struct hid_device_info *cur = devs; cur != NULL; cur = cur->next) {
+        discovery_candidate_t c = {.vid = cur->vendor_id, .pid = cur->product_id};
+        bool                  isp = c.vid == SONIX_VID && is_known_isp_pid(c.pid);
+        if (!isp && c.vid != SONIX_VID && c.vid != EVISION_VID && c.vid != APPLE_VID) continue;
+        if (strlen(cur->path) >= sizeof(c.path)) continue;
+        strcpy(c.path, cur->path);
+        device_topology(cur->path, c.topology, sizeof(c.topology));
+
+        if (isp) {
+            c.rank = DISCOVERY_ISP;
+        } else {
+            // Apple's VID is used by several OEMs, the reboot option has to be given
+            c.rank = DISCOVERY_OEM;
+            if (c.vid == SONIX_VID) strcpy(c.reboot, "sonix");
+            if (c.vid == EVISION_VID) strcpy(c.reboot, "evision");
+            for (int i = 0; i < entry_count; i++) {
+                if (entries[i].vid == c.vid && entries[i].pid == c.pid && strcmp(entries[i].topology, c.topology) == 0) {
+                    c.rank = DISCOVERY_CACHED;
+                    strcpy(c.reboot, entries[i].reboot);
+                }
+            }
+        }
+        discovery_add(&c, out, &count, max);
+    }
+    transport->free_enumeration(devs);
+
+    qsort(out, count, sizeof(out[0]), compare_candidates);
+    return count;
+}
+
+int discovery_pick(const discovery_candidate_t *candidates, int count) {
+    if (count == 0 || (count > 1 && candidates[1].rank == candidates[0].rank)) return -1;
+    return 0;
+}
+
+void discovery_print(FILE *f, const discovery_candidate_t *candidates, int count) {
+    for (int i = 0; i < count; i++) {
+        const discovery_candidate_t *c = &candidates[i];
+        fprintf(f, "  0x%04x/0x%04x  %-8s  ", c->vid, c->pid, c->topology);
+        if (c->rank == DISCOVERY_ISP)
+            fprintf(f, "%s ISP bootloader\n", isp_chip_name(c->pid));
+        else if (c->reboot[0])
+            fprintf(f, "OEM firmware, reboot option %s%s\n", c->reboot, c->rank == DISCOVERY_CACHED ? " (flashed on this port before)" : "");
+        else
+            fprintf(f, "OEM firmware, reboot option unknown\n");
+    }
+}
+
+bool discovery_remember(const char *cache_file, const discovery_candidate_t *device) {
+    discovery_entry_t entries[DISCOVERY_CACHE_ENTRIES];
+    char              dir[DISCOVERY_PATH_SIZE];
+    char              tmp_path[DISCOVERY_PATH_SIZE];
+    int               count = discovery_cache_load(cache_file, entries, DISCOVERY_CACHE_ENTRIES);
+
+    const char *slash = strrchr(cache_file, '/');
+    if (slash == NULL || snprintf(dir, sizeof(dir), "%.*s", (int)(slash - cache_file), cache_file) >= (int)sizeof(dir) || snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", cache_file, cache_pid()) >= (int)sizeof(tmp_path)) return false;
+    if (!cache_mkdirs(dir)) {
+        fprintf(stderr, "Warning: could not create cache directory %s.\n", dir);
+        return false;
+    }
+
+    // The device goes first, replacing its port's old entry; the oldest entries drop off
+    FILE *fp = fopen(tmp_path, "w");
+    bool  ok = fp != NULL;
+    ok       = ok && fprintf(fp, "%04x %04x %s %s\n", device->vid, device->pid, device->reboot[0] ? device->reboot : "-", device->topology) > 0;
+    for (int i = 0, written = 1; ok && i < count && written < DISCOVERY_CACHE_ENTRIES; i++) {
+        if (strcmp(entries[i].topology, device->topology) == 0) continue;
+        ok = fprintf(fp, "%04x %04x %s %s\n", entries[i].vid, entries[i].pid, entries[i].reboot[0] ? entries[i].reboot : "-", entries[i].topology) > 0;
+        written++;
+    }
+    if (fp) ok = fclose(fp) == 0 && ok;
+    if (ok) ok = cache_rename(tmp_path, cache_file);
+    if (!ok) {
+        remove(tmp_path);
+        fprintf(stderr, "Warning: could not write discovery cache %s.\n", cache_file);
+    }
+    return ok;
+}
@@ -0,0 +1,53 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sonixflasher.h"
+
+// Device discovery for runs without --vidpid. A single enumeration pass collects
+// every ISP bootloader and every keyboard with a known OEM VID, one candidate per
+// USB port, and ranks them by how ready they are to flash. Ports a discovered
+// flash succeeded on are remembered in a small text file in the cache directory
+// together with the reboot option that worked, so the same keyboard is picked
+// straight away on the next run.
+
+#define DISCOVERY_MAX_CANDIDATES 16
+
+// Best first
+typedef enum {
+    DISCOVERY_ISP,    // Sonix ISP bootloader, flashed as is
+    DISCOVERY_CACHED, // Flashed on this port before, reboot option remembered
+    DISCOVERY_OEM,    // OEM firmware with a known VID, reboot option guessed from it
+} discovery_rank_t;
+
+typedef struct {
+    char             path[TOPOLOGY_SIZE]; // First interface, as the backend names it
+    char             topology[TOPOLOGY_SIZE];
+    uint16_t         vid;
+    uint16_t         pid;
+    char             reboot[16]; // OEM reboot option, empty for a bootloader or when unknown
+    discovery_rank_t rank;
+} discovery_candidate_t;
+
+// Discovery cache: "discovery" in the image cache directory. Returns a malloc'd
+// string, or NULL when no location could be determined.
+char *discovery_default_file(void);
+
+// Enumerate once and fill out with up to max candidates, best first. cache_file
+// may be NULL. Returns the number of candidates.
+int discovery_scan(const sn32_transport_t *transport, const char *cache_file, discovery_candidate_t *out, int max);
+
+// Index of the candidate to flash, or -1 when there is none or the best rank is
+// shared by several devices.
+int discovery_pick(const discovery_candidate_t *candidates, int count);
+
+// Print one candidate per line.
+void discovery_print(FILE *f, const discovery_candidate_t *candidates, int count);
+
+// Remember the port, VID/PID and reboot option of a device flashed successfully.
+bool discovery_remember(const char *cache_file, const discovery_candidate_t *device);
+
+#endif // DISCOVERY_H
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+
+#include <hidapi.h>
+
+#include "sonixflasher.h"
+#include "hidraw_transport.h"
+
+#define HIDRAW_CLASS_DIR "/sys/class/hidraw"
+
+typedef struct {
+    int     fd;
+    wchar_t error[128];
+} hidraw_device_t;
+
+static int hidraw_fail(hidraw_device_t *dev, int err) {
+    swprintf(dev->error, sizeof(dev->error) / sizeof(dev->error[0]), L"%s", strerror(err));
+    return -1;
+}
+
+static int hidraw_send_feature_report(void *handle, const unsigned char *data, size_t length) {
+    hidraw_device_t *dev = handle;
+    int              res = ioctl(dev->fd, HIDIOCSFEATURE(length), data);
+    return res < 0 ? hidraw_fail(dev, errno) : res;
+}
+
+static int hidraw_get_feature_report(void *handle, unsigned char *data, size_t length) {
+    hidraw_device_t *dev = handle;
+    int              res = ioctl(dev->fd, HIDIOCGFEATURE(length), data);
+    return res < 0 ? hidraw_fail(dev, errno) : res;
+}
+
+static const wchar_t *hidraw_error(void *handle) {
+    hidraw_device_t *dev = handle;
+    if (dev == NULL) return L"Could not open hidraw device";
+    return dev->error;
+}
+
+static void hidraw_close(void *handle) {
+    hidraw_device_t *dev = handle;
+    if (dev == NULL) return;
+    close(dev->fd);
+    free(dev);
+}
+
+static void *hidraw_open_path(const char *path) {
+    hidraw_device_t *dev = calloc(1, sizeof(*dev));
+    if (dev == NULL) return NULL;
+    dev->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (dev->fd < 0) {
+        free(dev);
+        return NULL;
+    }
+    wcscpy(dev->error, L"Success");
+    return dev;
+}
+
+bool hidraw_usb_path(const char *path, char *out, size_t out_size) {
+    const char *name = strrchr(path, '/');
+    char        link[PATH_MAX];
+    char        real[PATH_MAX];
+
+    name = name ? name + 1 : path;
+    if (strncmp(name, "hidraw", 6) != 0) return false;
+    snprintf(link, sizeof(link), HIDRAW_CLASS_DIR "/%s/device", name);
+    if (realpath(link, real) == NULL) return false;
+
+    // .../usb1/1-2/1-2.3/1-2.3:1.0/0003:0C45:7040.0001, the interface is the parent
+    char *hid = strrchr(real, '/');
+    if (hid == NULL) return false;
+    *hid            = '\0';
+    const char *intf = strrchr(real, '/');
+    if (intf == NULL || strchr(++intf, ':') == NULL) return false;
+    return snprintf(out, out_size, "%s", intf) < (int)out_size;
+}
+
+static void hidraw_free_enumeration(struct hid_device_info *devs) {
+    while (devs) {
+        struct hid_device_info *next = devs->next;
+        free(devs->path);
+        free(devs);
+        devs = next;
+    }
+}
+
+// List the hidraw nodes of USB devices matching vid/pid (0 matches any), sorted
+// by USB interface so every interface of a device is listed in order, as
+// hidapi-libusb does.
+static struct hid_device_info *hidraw_enumerate(unsigned short vid, unsigned short pid) {
+    struct hid_device_info *head = NULL;
+    DIR                    *dir  = opendir(HIDRAW_CLASS_DIR);
+    struct dirent          *ent;
+
+    if (dir == NULL) return NULL;
+    while ((ent = readdir(dir)) != NULL) {
+        char         path[PATH_MAX];
+        char         line[256];
+        char         usb_path[PATH_MAX] = "";
+        unsigned int bus = 0, dev_vid = 0, dev_pid = 0;
+        bool         found = false;
+
+        if (strncmp(ent->d_name, "hidraw", 6) != 0) continue;
+        snprintf(path, sizeof(path), HIDRAW_CLASS_DIR "/%s/device/uevent", ent->d_name);
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL) continue;
+        while (!found && fgets(line, sizeof(line), fp))
+            found = sscanf(line, "HID_ID=%x:%x:%x", &bus, &dev_vid, &dev_pid) == 3;
+        fclose(fp);
+        if (!found || bus != BUS_USB) continue;
+        if ((vid && dev_vid != vid) || (pid && dev_pid != pid)) continue;
+
+        struct hid_device_info *info = calloc(1, sizeof(*info));
+        if (info == NULL) break;
+        snprintf(path, sizeof(path), "/dev/%s", ent->d_name);
+        info->path       = strdup(path);
+        info->vendor_id  = dev_vid;
+        info->product_id = dev_pid;
+        if (hidraw_usb_path(path, usb_path, sizeof(usb_path))) {
+            const char *dot        = strrchr(usb_path, '.');
+            info->interface_number = dot ? atoi(dot + 1) : -1;
+        }
+        if (info->path == NULL) {
+            free(info);
+            break;
+        }
+
+        // Insert sorted by USB interface path
+        struct hid_device_info **pos = &head;
+        while (*pos) {
+            char other[PATH_MAX] = "";
+            hidraw_usb_path((*pos)->path, other, sizeof(other));
+            if (strcmp(usb_path, other) < 0) break;
+            pos = &(*pos)->next;
+        }
+        info->next = *pos;
+        *pos       = info;
+    }
+    closedir(dir);
+    return head;
+}
+
+const sn32_transport_t hidraw_transport = {
+    .name                = "hidraw",
+    .send_feature_report = hidraw_send_feature_report,
+    .get_feature_report  = hidraw_get_feature_report,
+    .error               = hidraw_error,
+    .close               = hidraw_close,
+    .enumerate           = hidraw_enumerate,
+    .free_enumeration    = hidraw_free_enumeration,
+    .open_path           = hidraw_open_path,
+};
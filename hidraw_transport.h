@@ -0,0 +1,19 @@
+#ifndef HIDRAW_TRANSPORT_H
+#define HIDRAW_TRANSPORT_H
+
+#include <stdbool.h>
+
+#include "sonixflasher.h"
+
+// Native Linux transport talking to /dev/hidrawN through the HIDIOCSFEATURE and
+// HIDIOCGFEATURE ioctls, bypassing hidapi. Buffers keep the Report ID in the
+// first byte, the kernel drops it for devices without numbered reports just like
+// hidapi does.
+extern const sn32_transport_t hidraw_transport;
+
+// Name of the USB interface behind a /dev/hidrawN path in hidapi-libusb form,
+// "1-2.3:1.0" (bus-ports:config.interface). Returns false when path isn't a
+// hidraw node of a USB device.
+bool hidraw_usb_path(const char *path, char *out, size_t out_size);
+
+#endif // HIDRAW_TRANSPORT_H
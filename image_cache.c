@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "sonixflasher.h"
+#include "image_cache.h"
+
+#define IMAGE_CACHE_MAGIC 0x43465853 // "SXFC"
+#define IMAGE_CACHE_VERSION 2
+#define CACHE_PATH_SIZE 1024
+#define REF_KEY_LENGTH 40
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint8_t  digest[SHA256_DIGEST_SIZE]; // SHA-256 of the firmware file
+    uint32_t flags;                      // IMAGE_* flags of the prepared image
+    uint32_t file_size;
+    uint32_t image_size;
+    uint32_t last_chunk;
+    uint32_t load_address;
+    uint16_t checksum;
+    uint16_t reserved;
+    uint32_t reports;      // Entries in the report checksum table
+    uint32_t table_offset; // uint16_t checksum16 of every report
+    uint32_t data_offset;  // Padded image, IMAGE_ALIGNMENT aligned
+} image_cache_header_t;
+
+static bool cache_mkdir(const char *path) {
+#ifdef _WIN32
+    return _mkdir(path) == 0 || errno == EEXIST;
+#else
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+bool cache_mkdirs(const char *dir) {
+    char path[CACHE_PATH_SIZE];
+
+    if (snprintf(path, sizeof(path), "%s", dir) >= (int)sizeof(path)) return false;
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/' && *p != '\\') continue;
+        char c = *p;
+        *p     = '\0';
+        cache_mkdir(path);
+        *p = c;
+    }
+    return cache_mkdir(path);
+}
+
+bool cache_rename(const char *src, const char *dst) {
+#ifdef _WIN32
+    return MoveFileExA(src, dst, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(src, dst) == 0;
+#endif
+}
+
+long cache_pid(void) {
+#ifdef _WIN32
+    return (long)_getpid();
+#else
+    return (long)getpid();
+#endif
+}
+
+// Map a whole file read-only. Windows reads it into an aligned buffer instead.
+static bool cache_map(const char *path, void **map, size_t *map_size) {
+#ifdef _WIN32
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return false;
+    if (fseek(fp, 0, SEEK_END) != 0) {
+        fclose(fp);
+        return false;
+    }
+    long size = ftell(fp);
+    rewind(fp);
+    void *p = size > 0 ? image_alloc(size) : NULL;
+    if (p == NULL || fread(p, 1, size, fp) != (size_t)size) {
+        image_alloc_free(p);
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    off_t size = st.st_size;
+    void *p    = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return false;
+#endif
+    *map      = p;
+    *map_size = size;
+    return true;
+}
+
+static void cache_unmap(void *map, size_t map_size) {
+#ifdef _WIN32
+    (void)map_size;
+    image_alloc_free(map);
+#else
+    munmap(map, map_size);
+#endif
+}
+
+char *image_cache_default_dir(void) {
+    char        path[CACHE_PATH_SIZE];
+    const char *dir = getenv("SONIXFLASHER_CACHE_DIR");
+
+    if (dir && *dir) return strdup(dir);
+#ifdef _WIN32
+    dir = getenv("LOCALAPPDATA");
+    if (dir == NULL || *dir == '\0') return NULL;
+    snprintf(path, sizeof(path), "%s\\sonixflasher", dir);
+#else
+    dir = getenv("XDG_CACHE_HOME");
+    if (dir && *dir) {
+        snprintf(path, sizeof(path), "%s/sonixflasher", dir);
+    } else {
+        dir = getenv("HOME");
+        if (dir == NULL || *dir == '\0') return NULL;
+        snprintf(path, sizeof(path), "%s/.cache/sonixflasher", dir);
+    }
+#endif
+    return strdup(path);
+}
+
+// Path of the reference for file_name in its current state. Rewriting the file
+// changes its size or modification time and with them the reference name.
+static bool cache_ref_path(const char *dir, const char *file_name, uint32_t flags, char *out, size_t out_size) {
+    struct stat st;
+    long long   mtime_ns = 0;
+
+    if (stat(file_name, &st) != 0) return false;
+#if defined(__APPLE__)
+    mtime_ns = st.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+    mtime_ns = st.st_mtim.tv_nsec;
+#endif
+
+    char key[CACHE_PATH_SIZE + 128];
+    int  len = snprintf(key, sizeof(key), "%s\n%lld\n%lld.%09lld\n%llu:%llu\n%u", file_name, (long long)st.st_size, (long long)st.st_mtime, mtime_ns, (unsigned long long)st.st_dev, (unsigned long long)st.st_ino, flags);
+    if (len < 0 || len >= (int)sizeof(key)) return false;
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char    hex[SHA256_DIGEST_SIZE * 2 + 1];
+    sha256(key, len, digest);
+    sha256_hex(digest, hex);
+    return snprintf(out, out_size, "%s/%.*s.ref", dir, REF_KEY_LENGTH, hex) < (int)out_size;
+}
+
+static bool cache_entry_path(const char *dir, const char *hex, uint32_t flags, char *out, size_t out_size) {
+    return snprintf(out, out_size, "%s/%s-%u.img", dir, hex, flags) < (int)out_size;
+}
+
+static bool cache_entry_valid(const unsigned char *map, size_t map_size, const char *hex, uint32_t flags) {
+    image_cache_header_t h;
+    char                 digest_hex[SHA256_DIGEST_SIZE * 2 + 1];
+
+    if (map_size < sizeof(h)) return false;
+    memcpy(&h, map, sizeof(h));
+    if (h.magic != IMAGE_CACHE_MAGIC || h.version != IMAGE_CACHE_VERSION || h.header_size != sizeof(h)) return false;
+    if ((h.flags & IMAGE_JUMPLOADER) != flags) return false;
+    if (h.image_size == 0 || h.image_size % REPORT_SIZE != 0 || h.reports != h.image_size / REPORT_SIZE) return false;
+    if (h.table_offset < sizeof(h) || h.table_offset % sizeof(uint16_t) != 0) return false;
+    if ((uint64_t)h.table_offset + (uint64_t)h.reports * sizeof(uint16_t) > h.data_offset) return false;
+    if (h.data_offset % IMAGE_ALIGNMENT != 0 || (uint64_t)h.data_offset + h.image_size != map_size) return false;
+    sha256_hex(h.digest, digest_hex);
+    if (strcmp(digest_hex, hex) != 0) return false;
+
+    // The report checksums add up to the image checksum, catches a torn table
+    const uint16_t *table = (const uint16_t *)(map + h.table_offset);
+    uint16_t        sum   = 0;
+    for (uint32_t i = 0; i < h.reports; i++)
+        sum += table[i];
+    return sum == h.checksum;
+}
+
+bool image_cache_load(const char *dir, const char *file_name, uint32_t flags, fw_image_t *image) {
+    char ref_path[CACHE_PATH_SIZE];
+    char entry_path[CACHE_PATH_SIZE];
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+
+    if (!cache_ref_path(dir, file_name, flags, ref_path, sizeof(ref_path))) return false;
+    FILE *fp = fopen(ref_path, "rb");
+    if (fp == NULL) return false;
+    size_t n = fread(hex, 1, SHA256_DIGEST_SIZE * 2, fp);
+    fclose(fp);
+    if (n != SHA256_DIGEST_SIZE * 2) return false;
+    hex[n] = '\0';
+    if (!cache_entry_path(dir, hex, flags, entry_path, sizeof(entry_path))) return false;
+
+    void  *map      = NULL;
+    size_t map_size = 0;
+    if (!cache_map(entry_path, &map, &map_size)) return false;
+    if (!cache_entry_valid(map, map_size, hex, flags)) {
+        image_err("Warning: ignoring invalid cache entry %s.\n", entry_path);
+        cache_unmap(map, map_size);
+        return false;
+    }
+
+    image_cache_header_t h;
+    memcpy(&h, map, sizeof(h));
+    image->data             = (unsigned char *)map + h.data_offset;
+    image->size             = h.image_size;
+    image->file_size        = h.file_size;
+    image->checksum         = h.checksum;
+    image->last_chunk       = h.last_chunk;
+    image->load_address     = h.load_address;
+    image->report_checksums = (uint16_t *)((unsigned char *)map + h.table_offset);
+    image->flags            = h.flags;
+    image->mapping          = map;
+    image->mapping_size     = map_size;
+    memcpy(image->digest, h.digest, SHA256_DIGEST_SIZE);
+    return true;
+}
+
+static bool cache_write_entry(const char *path, const fw_image_t *image) {
+    static const unsigned char zero[IMAGE_ALIGNMENT] = {0};
+    image_cache_header_t       h                     = {0};
+    char                       tmp_path[CACHE_PATH_SIZE];
+
+    h.magic        = IMAGE_CACHE_MAGIC;
+    h.version      = IMAGE_CACHE_VERSION;
+    h.header_size  = sizeof(h);
+    h.flags        = image->flags;
+    h.file_size    = (uint32_t)image->file_size;
+    h.image_size   = (uint32_t)image->size;
+    h.last_chunk   = image->last_chunk;
+    h.load_address = image->load_address;
+    h.checksum     = image->checksum;
+    h.reports      = (uint32_t)(image->size / REPORT_SIZE);
+    h.table_offset = sizeof(h);
+    h.data_offset  = (h.table_offset + h.reports * sizeof(uint16_t) + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+    memcpy(h.digest, image->digest, SHA256_DIGEST_SIZE);
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, cache_pid()) >= (int)sizeof(tmp_path)) return false;
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) return false;
+
+    size_t pad = h.data_offset - h.table_offset - h.reports * sizeof(uint16_t);
+    bool   ok  = fwrite(&h, sizeof(h), 1, fp) == 1;
+    ok         = ok && fwrite(image->report_checksums, sizeof(uint16_t), h.reports, fp) == h.reports;
+    ok         = ok && fwrite(zero, 1, pad, fp) == pad;
+    ok         = ok && fwrite(image->data, 1, image->size, fp) == (size_t)image->size;
+    ok         = fclose(fp) == 0 && ok;
+    if (ok) ok = cache_rename(tmp_path, path);
+    if (!ok) remove(tmp_path);
+    return ok;
+}
+
+static bool cache_write_ref(const char *path, const char *hex) {
+    char tmp_path[CACHE_PATH_SIZE];
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, cache_pid()) >= (int)sizeof(tmp_path)) return false;
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) return false;
+    bool ok = fprintf(fp, "%s\n", hex) > 0;
+    ok      = fclose(fp) == 0 && ok;
+    if (ok) ok = cache_rename(tmp_path, path);
+    if (!ok) remove(tmp_path);
+    return ok;
+}
+
+bool image_cache_store(const char *dir, const char *file_name, const fw_image_t *image) {
+    uint32_t flags = image->flags & IMAGE_JUMPLOADER;
+    char     ref_path[CACHE_PATH_SIZE];
+    char     entry_path[CACHE_PATH_SIZE];
+    char     hex[SHA256_DIGEST_SIZE * 2 + 1];
+
+    if (!cache_mkdirs(dir)) {
+        image_err("Warning: could not create cache directory %s.\n", dir);
+        return false;
+    }
+    sha256_hex(image->digest, hex);
+    if (!cache_ref_path(dir, file_name, flags, ref_path, sizeof(ref_path)) || !cache_entry_path(dir, hex, flags, entry_path, sizeof(entry_path))) {
+        image_err("Warning: cache path too long, image not cached.\n");
+        return false;
+    }
+
+    if (!cache_write_entry(entry_path, image)) {
+        image_err("Warning: could not write cache entry %s.\n", entry_path);
+        return false;
+    }
+    if (!cache_write_ref(ref_path, hex)) {
+        image_err("Warning: could not write cache reference %s.\n", ref_path);
+        return false;
+    }
+    return true;
+}
+
+void image_cache_release(fw_image_t *image) {
+    cache_unmap(image->mapping, image->mapping_size);
+    image->mapping          = NULL;
+    image->mapping_size     = 0;
+    image->data             = NULL;
+    image->report_checksums = NULL;
+    image->size             = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <stdbool.h>
+
+#include "sonixflasher.h"
+
+// On-disk cache of prepared firmware images, keyed by the SHA-256 of the file
+// contents. Each entry is a single file laid out to be mapped as is: a header,
+// the per-report checksum table and the padded image at an IMAGE_ALIGNMENT
+// aligned offset. Entries are written to a temporary file and renamed into
+// place, so concurrent processes only ever see complete entries.
+
+// Cache directory: $SONIXFLASHER_CACHE_DIR, else $XDG_CACHE_HOME/sonixflasher
+// or ~/.cache/sonixflasher (%LOCALAPPDATA%\sonixflasher on Windows).
+// Returns a malloc'd string, or NULL when no location could be determined.
+char *image_cache_default_dir(void);
+
+// Look up the image prepared from file_name with the given IMAGE_JUMPLOADER
+// flag. The lookup goes through a reference keyed by the file's path, size and
+// modification time, so a hit doesn't read the firmware file at all. On a hit
+// image points into the mapped entry and is released by image_cache_release.
+bool image_cache_load(const char *dir, const char *file_name, uint32_t flags, fw_image_t *image);
+
+// Add a prepared image to the cache and reference it from file_name. Failures
+// are reported but leave the image untouched.
+bool image_cache_store(const char *dir, const char *file_name, const fw_image_t *image);
+
+// Unmap an image returned by image_cache_load.
+void image_cache_release(fw_image_t *image);
+
+// Helpers for other files kept in the cache directory.
+
+// Create dir along with any missing parents.
+bool cache_mkdirs(const char *dir);
+
+// Atomically replace dst with src.
+bool cache_rename(const char *src, const char *dst);
+
+// Process id, to name temporary files.
+long cache_pid(void);
+
+#endif // IMAGE_CACHE_H
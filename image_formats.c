@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "sonixflasher.h"
+#include "image_formats.h"
+
+#define UF2_MAGIC_START0 0x0A324655
+#define UF2_MAGIC_START1 0x9E5D5157
+#define UF2_MAGIC_END 0x0AB16F30
+#define UF2_FLAG_NOT_MAIN_FLASH 0x00000001
+#define UF2_BLOCK_SIZE 512
+#define UF2_PAYLOAD_MAX 476
+
+#define ELF_CLASS_32 1
+#define ELF_DATA_LSB 1
+#define ELF32_HEADER_SIZE 52
+#define ELF32_PHDR_SIZE 32
+#define ELF_PT_LOAD 1
+
+#define IHEX_DATA 0x00
+#define IHEX_EOF 0x01
+#define IHEX_EXT_SEGMENT 0x02
+#define IHEX_START_SEGMENT 0x03
+#define IHEX_EXT_LINEAR 0x04
+#define IHEX_START_LINEAR 0x05
+
+// Destination of the records, tracking the address range they cover.
+typedef struct {
+    unsigned char *flash;
+    size_t         flash_size;
+    uint32_t       start;
+    uint32_t       end;
+    bool           written;
+} flash_writer_t;
+
+static bool flash_write(flash_writer_t *w, uint64_t addr, const unsigned char *data, size_t size) {
+    if (size == 0) return true;
+    if (addr + size > w->flash_size) {
+        image_err("ERROR: Data at 0x%08llx-0x%08llx is outside of the flash (0x%05zx bytes).\n", (unsigned long long)addr, (unsigned long long)(addr + size), w->flash_size);
+        return false;
+    }
+    memcpy(w->flash + addr, data, size);
+    if (!w->written || addr < w->start) w->start = (uint32_t)addr;
+    if (!w->written || addr + size > w->end) w->end = (uint32_t)(addr + size);
+    w->written = true;
+    return true;
+}
+
+static uint16_t read_le16(const unsigned char *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t read_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int hex_nibble(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int hex_byte(const unsigned char *p) {
+    int hi = hex_nibble(p[0]);
+    int lo = hex_nibble(p[1]);
+    return hi < 0 || lo < 0 ? -1 : hi << 4 | lo;
+}
+
+static bool load_ihex(flash_writer_t *w, const unsigned char *data, size_t size) {
+    unsigned char record[5 + 255]; // count, address, type, data, checksum
+    uint32_t      base = 0;
+    size_t        pos  = 0;
+    long          n    = 0;
+
+    while (pos < size) {
+        if (data[pos] == '\r' || data[pos] == '\n' || data[pos] == ' ' || data[pos] == '\t') {
+            pos++;
+            continue;
+        }
+        n++;
+        if (data[pos] != ':' || size - pos < 11) {
+            image_err("ERROR: Intel HEX record %ld is malformed.\n", n);
+            return false;
+        }
+        pos++;
+
+        int count = hex_byte(data + pos);
+        if (count < 0 || size - pos < (size_t)(count + 5) * 2) {
+            image_err("ERROR: Intel HEX record %ld is truncated.\n", n);
+            return false;
+        }
+        uint8_t sum = 0;
+        for (int i = 0; i < count + 5; i++) {
+            int byte = hex_byte(data + pos + i * 2);
+            if (byte < 0) {
+                image_err("ERROR: Intel HEX record %ld has an invalid hex digit.\n", n);
+                return false;
+            }
+            record[i] = (unsigned char)byte;
+            sum += record[i];
+        }
+        pos += (count + 5) * 2;
+        if (sum != 0) {
+            image_err("ERROR: Intel HEX record %ld has a bad checksum.\n", n);
+            return false;
+        }
+
+        uint16_t addr = (uint16_t)(record[1] << 8 | record[2]);
+        switch (record[3]) {
+            case IHEX_DATA:
+                if (!flash_write(w, (uint64_t)base + addr, record + 4, count)) return false;
+                break;
+            case IHEX_EOF:
+                return true;
+            case IHEX_EXT_SEGMENT:
+            case IHEX_EXT_LINEAR:
+                if (count != 2) {
+                    image_err("ERROR: Intel HEX record %ld has a bad address length.\n", n);
+                    return false;
+                }
+                base = (uint32_t)(record[4] << 8 | record[5]) << (record[3] == IHEX_EXT_LINEAR ? 16 : 4);
+                break;
+            case IHEX_START_SEGMENT:
+            case IHEX_START_LINEAR:
+                break;
+            default:
+                image_err("ERROR: Intel HEX record %ld has unsupported type 0x%02x.\n", n, record[3]);
+                return false;
+        }
+    }
+    image_err("ERROR: Intel HEX file has no end of file record.\n");
+    return false;
+}
+
+// Copy the file contents of every PT_LOAD segment to its physical (load) address.
+static bool load_elf(flash_writer_t *w, const unsigned char *data, size_t size) {
+    if (size < ELF32_HEADER_SIZE || data[4] != ELF_CLASS_32 || data[5] != ELF_DATA_LSB) {
+        image_err("ERROR: Only 32-bit little-endian ELF files are supported.\n");
+        return false;
+    }
+
+    uint32_t phoff     = read_le32(data + 28);
+    uint16_t phentsize = read_le16(data + 42);
+    uint16_t phnum     = read_le16(data + 44);
+    if (phentsize < ELF32_PHDR_SIZE || phoff > size || (uint64_t)phnum * phentsize > size - phoff) {
+        image_err("ERROR: ELF program headers are out of bounds.\n");
+        return false;
+    }
+
+    for (uint16_t i = 0; i < phnum; i++) {
+        const unsigned char *ph     = data + phoff + (size_t)i * phentsize;
+        uint32_t             offset = read_le32(ph + 4);
+        uint32_t             paddr  = read_le32(ph + 12);
+        uint32_t             filesz = read_le32(ph + 16);
+
+        if (read_le32(ph) != ELF_PT_LOAD || filesz == 0) continue;
+        if (offset > size || filesz > size - offset) {
+            image_err("ERROR: ELF segment %u is out of bounds.\n", i);
+            return false;
+        }
+        if (!flash_write(w, paddr, data + offset, filesz)) return false;
+    }
+    return true;
+}
+
+static bool load_uf2(flash_writer_t *w, const unsigned char *data, size_t size) {
+    if (size % UF2_BLOCK_SIZE != 0) {
+        image_err("ERROR: UF2 file size is not a multiple of %d bytes.\n", UF2_BLOCK_SIZE);
+        return false;
+    }
+
+    for (size_t pos = 0; pos < size; pos += UF2_BLOCK_SIZE) {
+        const unsigned char *block = data + pos;
+        if (read_le32(block) != UF2_MAGIC_START0 || read_le32(block + 4) != UF2_MAGIC_START1 || read_le32(block + UF2_BLOCK_SIZE - 4) != UF2_MAGIC_END) {
+            image_err("ERROR: UF2 block %zu has a bad magic number.\n", pos / UF2_BLOCK_SIZE);
+            return false;
+        }
+        if (read_le32(block + 8) & UF2_FLAG_NOT_MAIN_FLASH) continue;
+
+        uint32_t addr    = read_le32(block + 12);
+        uint32_t payload = read_le32(block + 16);
+        if (payload > UF2_PAYLOAD_MAX) {
+            image_err("ERROR: UF2 block %zu has an invalid payload size.\n", pos / UF2_BLOCK_SIZE);
+            return false;
+        }
+        if (!flash_write(w, addr, block + 32, payload)) return false;
+    }
+    return true;
+}
+
+image_format_t image_format_detect(const unsigned char *data, size_t size) {
+    if (size >= 4 && memcmp(data, "\x7f" "ELF", 4) == 0) return IMAGE_FORMAT_ELF;
+    if (size >= UF2_BLOCK_SIZE && read_le32(data) == UF2_MAGIC_START0 && read_le32(data + 4) == UF2_MAGIC_START1) return IMAGE_FORMAT_UF2;
+    if (size >= 11 && data[0] == ':' && hex_byte(data + 1) >= 0 && hex_byte(data + 7) >= 0) return IMAGE_FORMAT_IHEX;
+    return IMAGE_FORMAT_BIN;
+}
+
+const char *image_format_name(image_format_t format) {
+    switch (format) {
+        case IMAGE_FORMAT_IHEX:
+            return "Intel HEX";
+        case IMAGE_FORMAT_ELF:
+            return "ELF";
+        case IMAGE_FORMAT_UF2:
+            return "UF2";
+        default:
+            return "binary";
+    }
+}
+
+bool image_format_load(image_format_t format, const unsigned char *data, size_t size, unsigned char *flash, size_t flash_size, uint32_t *start, uint32_t *end) {
+    flash_writer_t w  = {.flash = flash, .flash_size = flash_size};
+    bool           ok = false;
+
+    switch (format) {
+        case IMAGE_FORMAT_IHEX:
+            ok = load_ihex(&w, data, size);
+            break;
+        case IMAGE_FORMAT_ELF:
+            ok = load_elf(&w, data, size);
+            break;
+        case IMAGE_FORMAT_UF2:
+            ok = load_uf2(&w, data, size);
+            break;
+        default:
+            break;
+    }
+    if (!ok) return false;
+    if (!w.written) {
+        image_err("ERROR: %s file contains no data for the flash.\n", image_format_name(format));
+        return false;
+    }
+    *start = w.start;
+    *end   = w.end;
+    return true;
+}
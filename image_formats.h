@@ -0,0 +1,29 @@
+#ifndef IMAGE_FORMATS_H
+#define IMAGE_FORMATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Firmware file formats prepare_file_to_flash understands. Everything that
+// isn't recognised as one of the others is flashed as a raw binary.
+typedef enum {
+    IMAGE_FORMAT_BIN,
+    IMAGE_FORMAT_IHEX,
+    IMAGE_FORMAT_ELF,
+    IMAGE_FORMAT_UF2,
+} image_format_t;
+
+// Recognise the format from the file contents.
+image_format_t image_format_detect(const unsigned char *data, size_t size);
+
+const char *image_format_name(image_format_t format);
+
+// Write the records of a HEX, ELF or UF2 file into flash, a buffer standing for
+// flash addresses [0, flash_size) that the caller filled with the blank value.
+// Records are copied in a single pass over data without further allocations.
+// On success [*start, *end) is the address range the records covered; a file
+// without any data fails.
+bool image_format_load(image_format_t format, const unsigned char *data, size_t size, unsigned char *flash, size_t flash_size, uint32_t *start, uint32_t *end);
+
+#endif // IMAGE_FORMATS_H
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image_cache.h"
+#include "journal.h"
+#include "sha256.h"
+
+#define JOURNAL_MAGIC "sonixflasher-journal-1"
+#define JOURNAL_PATH_SIZE 1024
+#define JOURNAL_KEY_LENGTH 40
+
+char *journal_default_dir(void) {
+    char *cache = image_cache_default_dir();
+    if (cache == NULL) return NULL;
+
+    size_t size = strlen(cache) + sizeof("/journal");
+    char  *dir  = malloc(size);
+    if (dir) snprintf(dir, size, "%s/journal", cache);
+    free(cache);
+    return dir;
+}
+
+// Device names are paths, the file is named after their hash instead.
+static bool journal_path(const char *dir, const char *device, char *out, size_t out_size) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char    hex[SHA256_DIGEST_SIZE * 2 + 1];
+
+    sha256(device, strlen(device), digest);
+    sha256_hex(digest, hex);
+    return snprintf(out, out_size, "%s/%.*s.journal", dir, JOURNAL_KEY_LENGTH, hex) < (int)out_size;
+}
+
+bool journal_load(const char *dir, const char *device, journal_entry_t *entry) {
+    char path[JOURNAL_PATH_SIZE];
+    char line[JOURNAL_PATH_SIZE + 160];
+    char magic[32], hex[SHA256_DIGEST_SIZE * 2 + 1], digest_hex[SHA256_DIGEST_SIZE * 2 + 1];
+
+    if (!journal_path(dir, device, path, sizeof(path))) return false;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return false;
+    bool ok = fgets(line, sizeof(line), fp) != NULL;
+    fclose(fp);
+    if (!ok) return false;
+
+    // Lines are "magic digest offset size done device", the device name last
+    int name_at = 0;
+    if (sscanf(line, "%31s %64s %ld %ld %ld %n", magic, hex, &entry->offset, &entry->size, &entry->done, &name_at) != 5 || name_at == 0) return false;
+    line[strcspn(line, "\n")] = '\0';
+    if (strcmp(magic, JOURNAL_MAGIC) != 0 || strcmp(line + name_at, device) != 0) return false;
+    if (strlen(hex) != SHA256_DIGEST_SIZE * 2 || entry->done <= 0 || entry->done > entry->size) return false;
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) return false;
+        entry->digest[i] = (uint8_t)byte;
+    }
+    sha256_hex(entry->digest, digest_hex);
+    return strcmp(digest_hex, hex) == 0;
+}
+
+bool journal_store(const char *dir, const char *device, const journal_entry_t *entry) {
+    char path[JOURNAL_PATH_SIZE];
+    char tmp_path[JOURNAL_PATH_SIZE];
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+
+    if (!cache_mkdirs(dir)) {
+        fprintf(stderr, "Warning: could not create journal directory %s.\n", dir);
+        return false;
+    }
+    if (!journal_path(dir, device, path, sizeof(path)) || snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, cache_pid()) >= (int)sizeof(tmp_path)) {
+        fprintf(stderr, "Warning: journal path too long, progress not recorded.\n");
+        return false;
+    }
+
+    sha256_hex(entry->digest, hex);
+    FILE *fp = fopen(tmp_path, "w");
+    bool  ok = fp != NULL;
+    ok       = ok && fprintf(fp, "%s %s %ld %ld %ld %s\n", JOURNAL_MAGIC, hex, entry->offset, entry->size, entry->done, device) > 0;
+    if (fp) ok = fclose(fp) == 0 && ok;
+    if (ok) ok = cache_rename(tmp_path, path);
+    if (!ok) {
+        remove(tmp_path);
+        fprintf(stderr, "Warning: could not write journal %s.\n", path);
+    }
+    return ok;
+}
+
+void journal_clear(const char *dir, const char *device) {
+    char path[JOURNAL_PATH_SIZE];
+
+    if (journal_path(dir, device, path, sizeof(path))) remove(path);
+}
@@ -0,0 +1,33 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+// Journal of interrupted flashes for --resume. When a transfer breaks off, how
+// far the device got is recorded per device, keyed by its USB topology, so the
+// next run can continue there instead of starting over. Each device has one
+// small text file in the journal directory, replaced atomically.
+
+typedef struct {
+    uint8_t digest[SHA256_DIGEST_SIZE]; // SHA-256 of the firmware file
+    long    offset;                     // Flash offset as requested
+    long    size;                       // Prepared image size
+    long    done;                       // Image bytes the device accepted
+} journal_entry_t;
+
+// Journal directory: "journal" in the image cache directory. Returns a malloc'd
+// string, or NULL when no location could be determined.
+char *journal_default_dir(void);
+
+// Read the entry of device. False when there is none or it can't be parsed.
+bool journal_load(const char *dir, const char *device, journal_entry_t *entry);
+
+bool journal_store(const char *dir, const char *device, const journal_entry_t *entry);
+
+// Forget the entry of device, if any.
+void journal_clear(const char *dir, const char *device);
+
+#endif // JOURNAL_H
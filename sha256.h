@@ -0,0 +1,26 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length; // Bytes hashed so far
+    uint8_t  block[64];
+    size_t   block_len;
+} sha256_ctx_t;
+
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t size);
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// One-shot helper.
+void sha256(const void *data, size_t size, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// Write the digest as 64 lowercase hex characters plus a terminating NUL.
+void sha256_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char out[SHA256_DIGEST_SIZE * 2 + 1]);
+
+#endif // SHA256_H
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sonixflasher.h"
+#include "sn32_emulator.h"
+
+typedef struct {
+    const char *name;
+    uint8_t     family;  // Reported in data[9] of CMD_GET_FW_VERSION
+    uint8_t     variant; // Reported in data[11], tells the SN240 family members apart
+    uint16_t    rom_size;
+    uint16_t    rom_pages;
+    uint16_t    cs0;     // Code Security value reported at CS0
+} sn32_emulated_chip_t;
+
+// clang-format off
+static const sn32_emulated_chip_t emulated_chips[] = {
+    {"220",  SN240,  1, USER_ROM_SIZE_SN32F220,  USER_ROM_PAGES_SN32F220,  CS0_1},
+    {"230",  SN240,  2, USER_ROM_SIZE_SN32F230,  USER_ROM_PAGES_SN32F230,  CS0_1},
+    {"240",  SN240,  3, USER_ROM_SIZE_SN32F240,  USER_ROM_PAGES_SN32F240,  CS0_1},
+    {"240b", SN240B, 0, USER_ROM_SIZE_SN32F240B, USER_ROM_PAGES_SN32F240B, CS0_0},
+    {"240c", SN240C, 0, USER_ROM_SIZE_SN32F240C, USER_ROM_PAGES_SN32F240C, CS0_1},
+    {"260",  SN260,  0, USER_ROM_SIZE_SN32F260,  USER_ROM_PAGES_SN32F260,  CS0_0},
+    {"280",  SN280,  0, USER_ROM_SIZE_SN32F280,  USER_ROM_PAGES_SN32F280,  CS0_1},
+    {"290",  SN290,  0, USER_ROM_SIZE_SN32F290,  USER_ROM_PAGES_SN32F290,  CS0_1},
+};
+// clang-format on
+
+struct sn32_emulator {
+    const sn32_emulated_chip_t *chip;
+    unsigned int                latency_us;
+    unsigned char              *rom;
+    long                        rom_size;
+    long                        page_size;
+    uint16_t                    code_option;
+    uint16_t                    cs_value;
+    unsigned char               response[REPORT_SIZE]; // Returned by the next get-feature
+    uint32_t                    program_start;         // Program mode: first address
+    uint32_t                    program_addr;          // Program mode: next address to write
+    uint32_t                    program_remaining;     // Program mode: reports still expected
+    bool                        rebooted;
+    const wchar_t              *error;
+};
+
+static void emulator_reply(sn32_emulator_t *emu, uint8_t command, uint32_t status) {
+    uint32_t cmdreply = CMD_VERIFY(command);
+
+    memset(emu->response, 0, REPORT_SIZE);
+    memcpy(emu->response, &cmdreply, sizeof(uint32_t));
+    memcpy(emu->response + 4, &status, sizeof(uint32_t));
+}
+
+static void emulator_reply_checksum(sn32_emulator_t *emu, uint32_t addr, uint32_t size) {
+    uint16_t checksum = 0;
+
+    if (addr < emu->rom_size && size <= emu->rom_size - addr) checksum = checksum16(emu->rom + addr, size);
+    memcpy(emu->response + 8, &checksum, sizeof(uint16_t));
+}
+
+// Chips that erase while programming overwrite flash, the others can only clear
+// bits and rely on a preceding CMD_ENABLE_ERASE.
+static void emulator_program(sn32_emulator_t *emu, const unsigned char *data) {
+    bool erase_on_write = emu->chip->family == SN240B || emu->chip->family == SN260;
+
+    if (emu->program_addr + REPORT_SIZE <= emu->rom_size) {
+        for (int i = 0; i < REPORT_SIZE; i++) {
+            if (erase_on_write)
+                emu->rom[emu->program_addr + i] = data[i];
+            else
+                emu->rom[emu->program_addr + i] &= data[i];
+        }
+    }
+    emu->program_addr += REPORT_SIZE;
+
+    // Mid-stream status requests see the last chunk taken, the checksum comes at the end.
+    // On hardware it only matches the written data for writes from address 0, what
+    // it holds otherwise isn't known, so other writes get it off by one.
+    emulator_reply(emu, CMD_ENABLE_PROGRAM, CMD_ACK);
+    if (--emu->program_remaining == 0) {
+        emulator_reply_checksum(emu, emu->program_start, emu->program_addr - emu->program_start);
+        if (emu->program_start != 0) emu->response[8]++;
+    }
+    memcpy(emu->response + LAST_CHUNK_OFFSET, data + LAST_CHUNK_OFFSET, sizeof(uint32_t));
+}
+
+static void emulator_command(sn32_emulator_t *emu, const unsigned char *data) {
+    uint16_t base   = 0;
+    uint16_t arg16a = 0;
+    uint16_t arg16b = 0;
+    uint32_t arg32a = 0;
+    uint32_t arg32b = 0;
+
+    memcpy(&base, data + 1, sizeof(uint16_t));
+    memcpy(&arg16a, data + 4, sizeof(uint16_t));
+    memcpy(&arg16b, data + 6, sizeof(uint16_t));
+    memcpy(&arg32a, data + 4, sizeof(uint32_t));
+    memcpy(&arg32b, data + 8, sizeof(uint32_t));
+
+    if (base != CMD_BASE) {
+        emulator_reply(emu, data[0], 0);
+        return;
+    }
+
+    switch (data[0]) {
+        case CMD_GET_FW_VERSION:
+            emulator_reply(emu, CMD_GET_FW_VERSION, CMD_ACK);
+            emu->response[8]  = 32;
+            emu->response[9]  = emu->chip->family;
+            emu->response[10] = 0;
+            emu->response[11] = emu->chip->variant;
+            emu->response[12] = emu->code_option >> 8;
+            emu->response[13] = emu->code_option & 0xFF;
+            emu->response[14] = emu->cs_value >> 8;
+            emu->response[15] = emu->cs_value & 0xFF;
+            break;
+        case CMD_COMPARE_CODE_OPTION:
+            emulator_reply(emu, CMD_COMPARE_CODE_OPTION, arg16a == emu->code_option ? CMD_ACK : 0);
+            break;
+        case CMD_SET_ENCRYPTION_ALGO:
+            emu->code_option = arg16a;
+            emu->cs_value    = arg16b;
+            emulator_reply(emu, CMD_SET_ENCRYPTION_ALGO, CMD_ACK);
+            break;
+        case CMD_ENABLE_ERASE: {
+            uint16_t page_start = arg16a;
+            uint16_t page_end   = 0;
+            memcpy(&page_end, data + 8, sizeof(uint16_t));
+            if (page_end > emu->chip->rom_pages) page_end = emu->chip->rom_pages;
+            if (page_start < page_end) memset(emu->rom + page_start * emu->page_size, 0xFF, (page_end - page_start) * emu->page_size);
+            emulator_reply(emu, CMD_ENABLE_ERASE, CMD_ACK);
+            if (page_start < page_end) emulator_reply_checksum(emu, page_start * emu->page_size, (page_end - page_start) * emu->page_size);
+            break;
+        }
+        case CMD_ENABLE_PROGRAM:
+            emu->program_start     = arg32a;
+            emu->program_addr      = arg32a;
+            emu->program_remaining = arg32b;
+            emulator_reply(emu, CMD_ENABLE_PROGRAM, arg32a + (uint64_t)arg32b * REPORT_SIZE <= emu->rom_size ? CMD_ACK : 0);
+            break;
+        case CMD_GET_CHECKSUM: // The flasher's unverified guess at the layout, proves nothing about real chips
+            emulator_reply(emu, CMD_GET_CHECKSUM, CMD_ACK);
+            emulator_reply_checksum(emu, arg32a, arg32b * REPORT_SIZE);
+            break;
+        case CMD_RETURN_USER_MODE:
+            emu->rebooted = true;
+            break;
+        default:
+            emulator_reply(emu, data[0], 0);
+            break;
+    }
+}
+
+static int emulator_send_feature_report(void *dev, const unsigned char *data, size_t length) {
+    sn32_emulator_t *emu = dev;
+
+    if (emu->latency_us) usleep(emu->latency_us);
+    if (emu->rebooted) {
+        emu->error = L"Device left bootloader mode";
+        return -1;
+    }
+    if (length < 2 || length > REPORT_SIZE + 1) {
+        emu->error = L"Invalid report length";
+        return -1;
+    }
+
+    // Skip the Report ID, commands are laid out from the first payload byte
+    unsigned char payload[REPORT_SIZE] = {0};
+    memcpy(payload, data + 1, length - 1);
+    if (emu->program_remaining > 0)
+        emulator_program(emu, payload);
+    else
+        emulator_command(emu, payload);
+    return (int)length;
+}
+
+static int emulator_get_feature_report(void *dev, unsigned char *data, size_t length) {
+    sn32_emulator_t *emu = dev;
+
+    if (emu->latency_us) usleep(emu->latency_us);
+    if (emu->rebooted) {
+        emu->error = L"Device left bootloader mode";
+        return -1;
+    }
+    if (length > REPORT_SIZE + 1) length = REPORT_SIZE + 1;
+    data[0] = 0x00;
+    memcpy(data + 1, emu->response, length - 1);
+    return (int)length;
+}
+
+static const wchar_t *emulator_error(void *dev) {
+    sn32_emulator_t *emu = dev;
+    return emu->error ? emu->error : L"Success";
+}
+
+static void emulator_close(void *dev) {
+    sn32_emulator_t *emu = dev;
+    free(emu->rom);
+    free(emu);
+}
+
+const sn32_transport_t sn32_emulator_transport = {
+    .name                = "emulator",
+    .send_feature_report = emulator_send_feature_report,
+    .get_feature_report  = emulator_get_feature_report,
+    .error               = emulator_error,
+    .close               = emulator_close,
+};
+
+sn32_emulator_t *sn32_emulator_open(const char *chip, unsigned int latency_us) {
+    const sn32_emulated_chip_t *found = NULL;
+
+    for (size_t i = 0; i < sizeof(emulated_chips) / sizeof(emulated_chips[0]); i++) {
+        if (strcmp(chip, emulated_chips[i].name) == 0) found = &emulated_chips[i];
+    }
+    if (found == NULL) return NULL;
+
+    sn32_emulator_t *emu = calloc(1, sizeof(*emu));
+    if (emu == NULL) return NULL;
+    emu->chip       = found;
+    emu->latency_us = latency_us;
+    emu->rom_size   = USER_ROM_SIZE_KB(found->rom_size);
+    emu->page_size  = emu->rom_size / found->rom_pages;
+    emu->cs_value   = found->cs0;
+    emu->rom        = malloc(emu->rom_size);
+    if (emu->rom == NULL) {
+        free(emu);
+        return NULL;
+    }
+    memset(emu->rom, 0xFF, emu->rom_size);
+    return emu;
+}
+
+void sn32_emulator_list_chips(void) {
+    for (size_t i = 0; i < sizeof(emulated_chips) / sizeof(emulated_chips[0]); i++)
+        fprintf(stderr, "%s%s", i ? ", " : "", emulated_chips[i].name);
+    fprintf(stderr, "\n");
+}
@@ -0,0 +1,20 @@
+#ifndef SN32_EMULATOR_H
+#define SN32_EMULATOR_H
+
+#include "sonixflasher.h"
+
+// In-process emulation of the SN32 ISP bootloader, used through
+// sn32_emulator_transport in place of a real HID device.
+typedef struct sn32_emulator sn32_emulator_t;
+
+extern const sn32_transport_t sn32_emulator_transport;
+
+// Create an emulated device for chip (220, 230, 240, 240b, 240c, 260, 280 or
+// 290) that delays every feature report by latency_us. Returns NULL for an
+// unknown chip.
+sn32_emulator_t *sn32_emulator_open(const char *chip, unsigned int latency_us);
+
+// Print the list of chip names sn32_emulator_open accepts.
+void sn32_emulator_list_chips(void);
+
+#endif // SN32_EMULATOR_H
@@ -0,0 +1,1673 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <poll.h>
+#endif
+
+#ifdef HAVE_LIBUDEV
+#include <libudev.h>
+#endif
+
+#include <hidapi.h>
+
+#include "sonixflasher.h"
+#include "sonixflash.h"
+#include "sn32_emulator.h"
+#include "trace.h"
+#include "watchdog.h"
+#ifdef HAVE_HIDRAW
+#include "hidraw_transport.h"
+#endif
+
+#define PROGRESS_INTERVAL_MS 250
+#define PROGRESS_STRIDE 32 // Reports between clock reads for progress updates
+#define FINALIZE_CHUNK_REPORTS 64 // 4 KB, checksummed and hashed while in L1
+
+const unsigned int known_isp_pids[] = {SN229_PID, SN239_PID, SN249_PID, SN248B_PID, SN248C_PID, SN268_PID, SN289_PID, SN299_PID};
+
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The fixed delays main() used to sleep: 1 s after init, the code option check,
+// the CS reset and the erase, 2 s before the reboot. They are only waited for after
+// stages that actually ran, so the 240B and 260, which have no code option check
+// or explicit erase, and chips already at CS0 skip those delays.
+static const sn32_timing_t timing_default = {1000, 1000, 1000, 1000, 2000};
+
+void session_init(session_t *s, const sn32_transport_t *transport, void *handle, const char *path, const char *prefix) {
+    memset(s, 0, sizeof(*s));
+    s->transport      = transport;
+    s->handle         = handle;
+    s->path           = path ? strdup(path) : NULL;
+    s->code_option    = 0x0000;
+    s->user_rom_size  = USER_ROM_SIZE_SN32F260;
+    s->user_rom_pages = USER_ROM_PAGES_SN32F260;
+    s->max_firmware   = USER_ROM_SIZE_KB(USER_ROM_SIZE_SN32F260);
+    s->blank_checksum = 0x0000;
+    s->cs0            = CS0_0;
+    s->page_size      = USER_ROM_SIZE_KB(USER_ROM_SIZE_SN32F260) / USER_ROM_PAGES_SN32F260;
+    s->timing         = &timing_default;
+    if (prefix) snprintf(s->prefix, sizeof(s->prefix), "%s", prefix);
+}
+
+// Give every transport call a deadline of io_timeout_ms and the whole session a
+// budget of budget_ms from now, either 0 for none. The calls then run on a
+// watchdog thread.
+bool session_set_deadlines(session_t *s, uint32_t io_timeout_ms, uint32_t budget_ms) {
+    s->io_timeout_ms = io_timeout_ms;
+    s->deadline_ns   = budget_ms ? monotonic_ns() + budget_ms * 1000000ull : 0;
+    if (s->watchdog || (io_timeout_ms == 0 && budget_ms == 0)) return true;
+    s->watchdog = watchdog_start();
+    if (s->watchdog == NULL) session_err(s, "ERROR: Could not start the I/O watchdog.\n");
+    return s->watchdog != NULL;
+}
+
+void session_free(session_t *s) {
+    if (s->watchdog) watchdog_stop(s->watchdog);
+    s->watchdog = NULL;
+    trace_free(s->trace);
+    s->trace = NULL;
+    free(s->path);
+    s->path = NULL;
+    if (s->stats) {
+        free(s->stats->set_rtt.samples);
+        free(s->stats->get_rtt.samples);
+        free(s->stats);
+        s->stats = NULL;
+    }
+}
+
+// Write formatted output for a session. Without a prefix the text goes straight
+// through; with one, output is held until a full line is available so lines from
+// concurrent sessions never interleave mid-line.
+static void session_vprint(session_t *s, int stream_no, const char *fmt, va_list ap) {
+    FILE *stream = stream_no ? stderr : stdout;
+    char  text[1024];
+
+    vsnprintf(text, sizeof(text), fmt, ap);
+
+    // A sink is only used by the thread running the session, no locking needed
+    if (s && s->sink) {
+        char  *line = s->out_line[stream_no];
+        size_t len  = s->out_len[stream_no];
+        for (const char *c = text; *c; c++) {
+            if (*c != '\n' && len < sizeof(s->out_line[0]) - 1) line[len++] = *c;
+            if (*c == '\n') {
+                line[len] = '\0';
+                s->sink(s->sink_ctx, stream_no, line);
+                len = 0;
+            }
+        }
+        s->out_len[stream_no] = len;
+        return;
+    }
+
+    pthread_mutex_lock(&output_lock);
+    if (s == NULL || s->prefix[0] == '\0') {
+        fputs(text, stream);
+        pthread_mutex_unlock(&output_lock);
+        return;
+    }
+
+    char  *line = s->out_line[stream_no];
+    size_t len  = s->out_len[stream_no];
+    for (const char *c = text; *c; c++) {
+        if (len < sizeof(s->out_line[0]) - 1) line[len++] = *c;
+        if (*c == '\n') {
+            line[len] = '\0';
+            fprintf(stream, "%s %s", s->prefix, line);
+            len = 0;
+        }
+    }
+    s->out_len[stream_no] = len;
+    fflush(stream);
+    pthread_mutex_unlock(&output_lock);
+}
+
+void session_log(session_t *s, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    session_vprint(s, 0, fmt, ap);
+    va_end(ap);
+}
+
+void session_err(session_t *s, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    session_vprint(s, 1, fmt, ap);
+    va_end(ap);
+}
+
+static int hidapi_send_feature_report(void *dev, const unsigned char *data, size_t length) {
+    return hid_send_feature_report(dev, data, length);
+}
+
+static int hidapi_get_feature_report(void *dev, unsigned char *data, size_t length) {
+    return hid_get_feature_report(dev, data, length);
+}
+
+static const wchar_t *hidapi_error(void *dev) {
+    return hid_error(dev);
+}
+
+static void hidapi_close(void *dev) {
+    hid_close(dev);
+}
+
+static void *hidapi_open_path(const char *path) {
+    return hid_open_path(path);
+}
+
+const sn32_transport_t hidapi_transport = {
+    .name                = "hidapi",
+    .send_feature_report = hidapi_send_feature_report,
+    .get_feature_report  = hidapi_get_feature_report,
+    .error               = hidapi_error,
+    .close               = hidapi_close,
+    .enumerate           = hid_enumerate,
+    .free_enumeration    = hid_free_enumeration,
+    .open_path           = hidapi_open_path,
+};
+
+// Transports of real devices, selectable by name
+const sn32_transport_t *const sn32_transports[] = {
+    &hidapi_transport,
+#ifdef HAVE_HIDRAW
+    &hidraw_transport,
+#endif
+};
+const size_t sn32_transport_count = sizeof(sn32_transports) / sizeof(sn32_transports[0]);
+
+const sn32_transport_t *sn32_transport_find(const char *name) {
+    for (size_t i = 0; i < sn32_transport_count; i++) {
+        if (strcmp(sn32_transports[i]->name, name) == 0) return sn32_transports[i];
+    }
+    return NULL;
+}
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Record a stage, or one attempt of a retried stage, that started at start_ns
+// and ends now, in the session stats and through the stage hook when set.
+void stage_record(session_t *s, const char *stage, int attempt, uint64_t start_ns, bool ok) {
+    if (s == NULL) return;
+    if (s->stage_hook) s->stage_hook(s, stage, attempt, start_ns, ok);
+    if (s->stats == NULL) return;
+    if (s->stats->event_count == MAX_STAGE_EVENTS) {
+        s->stats->events_dropped++;
+        return;
+    }
+    stage_event_t *e = &s->stats->events[s->stats->event_count++];
+    e->stage         = stage;
+    e->attempt       = attempt;
+    e->start_ns      = start_ns;
+    e->end_ns        = monotonic_ns();
+    e->ok            = ok;
+}
+
+static void rtt_add(rtt_samples_t *rtt, uint64_t ns) {
+    if (rtt->count == rtt->capacity) {
+        size_t    capacity = rtt->capacity ? rtt->capacity * 2 : 1024;
+        uint64_t *samples  = realloc(rtt->samples, capacity * sizeof(uint64_t));
+        if (samples == NULL) return;
+        rtt->samples  = samples;
+        rtt->capacity = capacity;
+    }
+    rtt->samples[rtt->count++] = ns;
+}
+
+void clear_buffer(unsigned char *data, size_t length) {
+    for (int i = 0; i < length; i++)
+        data[i] = 0;
+}
+
+void print_buffer(unsigned char *data, size_t length) {
+    printf("Sending Report...\n");
+    for (int i = 0; i < length; i++)
+        printf("%02x", data[i]);
+    printf("\n");
+}
+
+bool read_response_16(unsigned char *data, uint32_t offset, uint16_t expected_result, uint16_t *resp) {
+    uint16_t r = *resp;
+
+    memcpy(&r, data + offset, sizeof(uint16_t));
+
+    *resp = r;
+    return r == expected_result;
+}
+
+bool read_response_32(unsigned char *data, uint32_t offset, uint32_t expected_result, uint32_t *resp) {
+    uint32_t r = *resp;
+
+    memcpy(&r, data + offset, sizeof(uint32_t));
+
+    *resp = r;
+    return r == expected_result;
+}
+
+void write_buffer_32(unsigned char *data, uint32_t cmd) {
+    memcpy(data, &cmd, 4);
+}
+
+void write_buffer_16(unsigned char *data, uint16_t cmd) {
+    memcpy(data, &cmd, 2);
+}
+
+void print_data(session_t *s, const unsigned char *data, int length) {
+    for (int i = 0; i < length; i++) {
+        if (i % 16 == 0) {
+            if (i > 0) {
+                session_log(s, "\n");
+            }
+            session_log(s, "%04x: ", i); // Print address offset
+        }
+        session_log(s, "%02x ", data[i]);
+    }
+    session_log(s, "\n");
+}
+
+bool is_known_isp_pid(unsigned int pid) {
+    size_t num_known_pids = sizeof(known_isp_pids) / sizeof(known_isp_pids[0]);
+    for (size_t i = 0; i < num_known_pids; ++i) {
+        if (pid == known_isp_pids[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Stage a command belongs to, for timeout reports.
+static const char *command_stage(uint8_t command) {
+    switch (command) {
+        case CMD_GET_FW_VERSION:
+            return "init";
+        case CMD_COMPARE_CODE_OPTION:
+            return "code_option_check";
+        case CMD_SET_ENCRYPTION_ALGO:
+            return "code_option_set";
+        case CMD_ENABLE_ERASE:
+            return "erase";
+        case CMD_ENABLE_PROGRAM:
+            return "program";
+        case CMD_GET_CHECKSUM:
+            return "checksum";
+        case CMD_RETURN_USER_MODE:
+            return "reboot_user";
+    }
+    return "command";
+}
+
+// Give up on the session in stage, start_ns being when the wait that overran began.
+static void session_timed_out(session_t *s, const char *stage, uint64_t start_ns, bool budget) {
+    s->timeout_stage = stage;
+    stage_record(s, "timeout", 1, start_ns, false);
+    if (budget)
+        session_err(s, "ERROR: Session ran out of time during %s, giving up on the device.\n", stage);
+    else
+        session_err(s, "ERROR: Device didn't answer within %u ms during %s, giving up on it.\n", s->io_timeout_ms, stage);
+}
+
+// Sleep for ms unless that would take the session past the end of its time
+// budget. The session then times out in stage at once, as a call would at the
+// deadline, and false is returned.
+bool session_sleep(session_t *s, uint32_t ms, const char *stage) {
+    if (s->timeout_stage) return false;
+    uint64_t now = monotonic_ns();
+    if (s->deadline_ns && now + ms * 1000000ull > s->deadline_ns) {
+        session_timed_out(s, stage, now, true);
+        return false;
+    }
+    usleep(ms * 1000);
+    return true;
+}
+
+// Every feature report goes through here. Without deadlines the transport is
+// called directly; with them the call runs on the watchdog and is given up on
+// at the deadline, the sooner of the call and session ones. The session then
+// fails every further call, and its handle passes to the watchdog, which closes
+// it once the device lets go.
+static int transport_call(session_t *s, bool get, unsigned char *data, size_t length, const char *stage) {
+    if (s->timeout_stage) return -1;
+    if (s->watchdog == NULL) return get ? s->transport->get_feature_report(s->handle, data, length) : s->transport->send_feature_report(s->handle, data, length);
+
+    uint64_t now      = monotonic_ns();
+    uint64_t deadline = s->io_timeout_ms ? now + s->io_timeout_ms * 1000000ull : UINT64_MAX;
+    if (s->deadline_ns && s->deadline_ns < deadline) deadline = s->deadline_ns;
+    if (now < deadline) {
+        int res = watchdog_call(s->watchdog, s->transport, s->handle, get, data, length, deadline);
+        if (res != WATCHDOG_TIMEOUT) return res;
+        s->transport = &watchdog_abandoned_transport;
+        s->handle    = s->watchdog;
+        s->watchdog  = NULL;
+    }
+    session_timed_out(s, stage, now, deadline == s->deadline_ns);
+    return -1;
+}
+
+bool hid_set_feature(session_t *s, const unsigned char *data, size_t length) {
+    if (length > REPORT_SIZE) {
+        session_err(s, "ERROR: Report can't be more than %d bytes!! (Attempted: %zu bytes)\n", REPORT_SIZE, length);
+        return false;
+    }
+
+    if (s->debug) {
+        session_log(s, "\n");
+        session_log(s, "Sending payload...\n");
+        print_data(s, data, length);
+    }
+
+    // Set Report ID to 0 before passing to hidapi.
+    // Allocate a send buffer with an extra byte
+    unsigned char send_buf[REPORT_SIZE + 1];
+
+    // Set the Report ID byte (0x00) at the start of the buffer
+    send_buf[0] = 0x00;
+
+    // Copy the data into the buffer, starting from the second byte
+    memcpy(send_buf + 1, data, length);
+
+    // Send the feature report using the send buffer
+    s->reports++;
+    uint64_t start = s->stats || s->trace ? monotonic_ns() : 0;
+    bool     cmd   = length >= 3 && (data[1] | data[2] << 8) == CMD_BASE;
+    int      res   = transport_call(s, false, send_buf, length + 1, cmd ? command_stage(data[0]) : s->chip ? "program" : "oem_reboot");
+    if (s->stats || s->trace) {
+        uint64_t end = monotonic_ns();
+        if (s->stats) rtt_add(&s->stats->set_rtt, end - start);
+        if (s->trace) trace_set(s->trace, data, length, res, start, end);
+    }
+    if (res < 0) {
+        if (s->timeout_stage) return false; // Already reported
+        session_err(s, "ERROR: Error while writing command 0x%02x! Reason: %ls\n", data[0], s->transport->error(s->handle));
+        return false;
+    }
+
+    return true;
+}
+int sn32_decode_chip(session_t *s, unsigned char *data) {
+    // data[8-11] holds the bootloader version
+    if (data[8] == 32) {
+        session_log(s, "Sonix SN32 Detected.\n");
+        session_log(s, "\n");
+        session_log(s, "Checking variant... ");
+
+        int sn32_family;
+        switch (data[9]) {
+            case SN240:
+                switch (data[11]) {
+                    case 1:
+                        session_log(s, "220 Detected!\n");
+                        s->user_rom_size  = USER_ROM_SIZE_SN32F220;
+                        s->user_rom_pages = USER_ROM_PAGES_SN32F220;
+                        s->max_firmware   = USER_ROM_SIZE_KB(s->user_rom_size);
+                        s->cs0            = CS0_1;
+                        s->blank_checksum = 0xe000;
+                        sn32_family      = SN240;
+                        break;
+                    case 2:
+                        session_log(s, "230 Detected!\n");
+                        s->user_rom_size  = USER_ROM_SIZE_SN32F230;
+                        s->user_rom_pages = USER_ROM_PAGES_SN32F230;
+                        s->max_firmware   = USER_ROM_SIZE_KB(s->user_rom_size);
+                        s->cs0            = CS0_1;
+                        s->blank_checksum = 0xc000;
+                        sn32_family      = SN240;
+                        break;
+                    case 3:
+                        session_log(s, "240 Detected!\n");
+                        s->user_rom_size  = USER_ROM_SIZE_SN32F240;
+                        s->user_rom_pages = USER_ROM_PAGES_SN32F240;
+                        s->max_firmware   = USER_ROM_SIZE_KB(s->user_rom_size);
+                        s->cs0            = CS0_1;
+                        s->blank_checksum = 0x8000;
+                        sn32_family      = SN240;
+                        break;
+                    default:
+                        session_log(s, "\n");
+                        session_err(s, "ERROR: Unsupported 2xx variant: %d.%d.%d, we don't support this chip.\n", data[9], data[10], data[11]);
+                        sn32_family = 0;
+                        break;
+                }
+                break;
+            case SN260:
+                session_log(s, "260 Detected!\n");
+                s->user_rom_size  = USER_ROM_SIZE_SN32F260;
+                s->user_rom_pages = USER_ROM_PAGES_SN32F260;
+                s->max_firmware   = USER_ROM_SIZE_KB(s->user_rom_size);
+                s->cs0            = CS0_0;
+                s->blank_checksum = 0x8000;
+                sn32_family      = SN260;
+                break;
+            case SN240B:
+                session_log(s, "240B Detected!\n");
+                s->user_rom_size  = USER_ROM_SIZE_SN32F240B;
+                s->user_rom_pages = USER_ROM_PAGES_SN32F240B;
+                s->max_firmware   = USER_ROM_SIZE_KB(s->user_rom_size);
+                s->cs0            = CS0_0;
+                s->blank_checksum = 0x8000;
+                sn32_family      = SN240B;
+                break;
+            case SN280:
+                session_log(s, "280 Detected!\n");
+                s->user_rom_size  = USER_ROM_SIZE_SN32F280;
+                s->user_rom_pages = USER_ROM_PAGES_SN32F280;
+                s->max_firmware   = USER_ROM_SIZE_KB(s->user_rom_size);
+                s->cs0            = CS0_1;
+                s->blank_checksum = 0x0000;
+                sn32_family      = SN280;
+                break;
+            case SN290:
+                session_log(s, "290 Detected!\n");
+                s->user_rom_size  = USER_ROM_SIZE_SN32F290;
+                s->user_rom_pages = USER_ROM_PAGES_SN32F290;
+                s->max_firmware   = USER_ROM_SIZE_KB(s->user_rom_size);
+                s->cs0            = CS0_1;
+                s->blank_checksum = 0x0000;
+                sn32_family      = SN290;
+                break;
+            case SN240C:
+                session_log(s, "240C Detected!\n");
+                s->user_rom_size  = USER_ROM_SIZE_SN32F240C;
+                s->user_rom_pages = USER_ROM_PAGES_SN32F240C;
+                s->max_firmware   = USER_ROM_SIZE_KB(s->user_rom_size);
+                s->cs0            = CS0_1;
+                s->blank_checksum = 0x0000;
+                sn32_family      = SN240C;
+                break;
+            default:
+                session_log(s, "\n");
+                session_err(s, "ERROR: Unsupported bootloader version: %d.%d.%d, we don't support this chip.\n", data[9], data[10], data[11]);
+                sn32_family = 0;
+                break;
+        }
+
+        if (sn32_family != 0) s->page_size = USER_ROM_SIZE_KB(s->user_rom_size) / s->user_rom_pages;
+        return sn32_family;
+    } else {
+        session_err(s, "ERROR: Unsupported family version: %d, we don't support this chip.\n", data[8]);
+        return 0;
+    }
+}
+
+bool sn32_check_isp_code_option(session_t *s, unsigned char *data) {
+    uint16_t received_code_option = (data[12] << 8) | data[13];
+    session_log(s, "Checking Code Option Table... Expected: 0x%04X Received: 0x%04X.\n", s->code_option, received_code_option);
+    if (received_code_option != s->code_option) {
+        session_log(s, "Updating Code Option Table from 0x%04X to 0x%04X\n", s->code_option, received_code_option);
+        s->code_option = received_code_option;
+        return false;
+    }
+    return true;
+}
+
+int sn32_get_code_security(session_t *s, unsigned char *data) {
+    int      cs_level = -1;
+    uint16_t cs_value = (data[14] << 8) | data[15];
+
+    switch (cs_value) {
+        case CS0_0:
+        case CS0_1:
+            cs_level = 0;
+            break;
+        case CS1:
+            cs_level = 1;
+            break;
+        case CS2:
+            cs_level = 2;
+            break;
+        case CS3:
+            cs_level = 3;
+            break;
+        default:
+            session_err(s, "ERROR: Unsupported Code Security value: 0x%04X, we don't support this chip.\n", cs_value);
+            return cs_level;
+    }
+
+    session_log(s, "Current Security level: CS%d. Code Security value: 0x%04X.\n", cs_level, cs_value);
+    return cs_level;
+}
+
+// Classify a response for the trace the same way hid_get_feature checks it.
+static uint8_t trace_response_status(const unsigned char *recv_buf, int res, size_t data_size, uint32_t command) {
+    uint32_t cmdreply, status;
+
+    if (res < 0) return TRACE_IO_ERROR;
+    if (res != (int)data_size + 1 || res < 9) return TRACE_SHORT;
+    memcpy(&cmdreply, recv_buf + 1, sizeof(cmdreply));
+    memcpy(&status, recv_buf + 5, sizeof(status));
+    if (cmdreply != CMD_VERIFY(command)) return TRACE_BAD_CMD;
+    if (status != CMD_ACK) return TRACE_NAK;
+    return TRACE_OK;
+}
+
+bool hid_get_feature(session_t *s, unsigned char *data, size_t data_size, uint32_t command) {
+    // The report comes back with its Report ID in front, receive it in a buffer
+    // with room for that extra byte
+    unsigned char recv_buf[REPORT_SIZE + 1];
+
+    if (data_size > REPORT_SIZE) {
+        session_err(s, "ERROR: Report can't be more than %d bytes!! (Attempted: %zu bytes)\n", REPORT_SIZE, data_size);
+        return false;
+    }
+    clear_buffer(data, data_size);
+
+    uint8_t attempt_no = 1;
+    while (attempt_no <= MAX_ATTEMPTS) {
+        clear_buffer(recv_buf, sizeof(recv_buf));
+
+        // Attempt to get the feature report
+        uint64_t start = s->stats || s->trace ? monotonic_ns() : 0;
+        int      res   = transport_call(s, true, recv_buf, data_size + 1, command_stage(command & 0xFF));
+        if (s->stats || s->trace) {
+            uint64_t end = monotonic_ns();
+            if (s->stats) rtt_add(&s->stats->get_rtt, end - start);
+            if (s->trace) trace_get(s->trace, command & 0xFF, res >= 13 ? recv_buf + 1 : NULL, res, trace_response_status(recv_buf, res, data_size, command), start, end);
+        }
+        s->reports++;
+
+        if (res == (data_size + 1)) {
+            // Strip the Report ID
+            memcpy(data, recv_buf + 1, res - 1);
+
+            if (s->debug) {
+                session_log(s, "\n");
+                session_log(s, "Received payload...\n");
+                print_data(s, data, res - 1);
+            }
+
+            // Check the status directly in the data buffer
+            unsigned int cmdreply = *((unsigned int *)(data));
+            unsigned int status   = *((unsigned int *)(data + 4));
+            if (cmdreply == CMD_VERIFY(command)) {
+                if (status != CMD_ACK) {
+                    session_err(s, "ERROR: Invalid response status: 0x%08x, expected 0x%08x for command 0x%02x.\n", status, CMD_ACK, command & 0xFF);
+                    return false;
+                }
+
+                // Success
+                return true;
+            } else {
+                session_err(s, "ERROR: Invalid response command: 0x%08x, expected command 0x%02x.\n", cmdreply, command & 0xFF);
+                if ((cmdreply == CMD_VERIFY(CMD_ENABLE_PROGRAM)) && (status == CMD_ACK)) {
+                    session_log(s, "Device progam pending. Please power cycle the device.\n");
+                }
+                return false;
+            }
+        } else if (res < 0) {
+            if (s->timeout_stage) return false;
+            // Error condition, such as abort pipe
+            session_err(s, "ERROR: Device busy or failed to get feature report, retrying...\n");
+            stage_record(s, "get_feature_retry", attempt_no, start, false);
+            attempt_no++;
+            if (!session_sleep(s, RETRY_DELAY_MS, command_stage(command & 0xFF))) return false; // Delay before retrying
+        } else {
+            // Incorrect response length
+            session_err(s, "ERROR: Invalid response length for command 0x%02x: got %d, expected %zu.\n", command & 0xFF, res, data_size + 1);
+            return false;
+        }
+    }
+
+    // After retries failed
+    session_err(s, "ERROR: Failed to get feature report for command 0x%02x after %d retries.\n", command & 0xFF, attempt_no);
+    return false;
+}
+
+// Give the bootloader the settle time of the stage it just finished. Its
+// get-feature only repeats the last response, so there is no readiness to poll
+// for and the fixed delay is all there is.
+bool wait_settle(session_t *s, uint16_t ms) {
+    uint64_t start = monotonic_ns();
+    bool     ok    = session_sleep(s, ms, "settle");
+
+    stage_record(s, "settle", 1, start, ok);
+    return ok;
+}
+
+bool send_magic_command(session_t *s, const uint32_t *command) {
+    unsigned char buf[REPORT_SIZE];
+
+    clear_buffer(buf, sizeof(buf));
+    write_buffer_32(buf, command[0]);
+    write_buffer_32(buf + sizeof(uint32_t), command[1]);
+    uint8_t attempt_no = 1;
+    while (!hid_set_feature(s, buf, REPORT_SIZE) && attempt_no <= MAX_ATTEMPTS) // Try {MAX ATTEMPTS} to init flash.
+    {
+        if (s->timeout_stage) return false;
+        session_log(s, "Failed to greet device, re-trying in 1 second. Attempt %d of %d...\n", attempt_no, MAX_ATTEMPTS);
+        if (!session_sleep(s, 1000, "oem_reboot")) return false;
+        attempt_no++;
+    }
+    if (attempt_no > MAX_ATTEMPTS) return false;
+    clear_buffer(buf, sizeof(buf));
+    return true;
+}
+
+bool reboot_to_bootloader(session_t *s, char *oem_option) {
+    uint32_t sonix_reboot[2] = {0x5AA555AA, 0xCC3300FF};
+    uint32_t hfd_reboot[2]   = {0x5A8942AA, 0xCC6271FF};
+
+    if (oem_option == NULL) {
+        session_log(s, "ERROR: reboot option cannot be null.\n");
+        return false;
+    }
+    if (strcmp(oem_option, "sonix") == 0 || strcmp(oem_option, "evision") == 0) {
+        return send_magic_command(s, sonix_reboot);
+    } else if (strcmp(oem_option, "hfd") == 0) {
+        return send_magic_command(s, hfd_reboot);
+    }
+    session_log(s, "ERROR: unsupported reboot option selected.\n");
+    return false;
+}
+
+// Derive a stable per-device key from a hidapi path. hidapi-libusb paths look like
+// "1-2.3:1.0" (bus-ports:config.interface) and every interface of one device shares
+// the part before the colon; hidraw nodes are resolved to the same form. Paths
+// from other backends are used as-is. Returns true when the key is a USB port
+// path, which survives re-enumeration.
+bool device_topology(const char *path, char *out, size_t out_size) {
+#ifdef HAVE_HIDRAW
+    char usb_path[TOPOLOGY_SIZE];
+    if (hidraw_usb_path(path, usb_path, sizeof(usb_path))) path = usb_path;
+#endif
+    size_t len = strcspn(path, ":");
+    bool   usb = path[len] == ':' && len > 0;
+    for (size_t i = 0; usb && i < len; i++) {
+        if (!(path[i] >= '0' && path[i] <= '9') && path[i] != '-' && path[i] != '.') usb = false;
+    }
+    if (!usb) len = strlen(path);
+    if (len >= out_size) len = out_size - 1;
+    memcpy(out, path, len);
+    out[len] = '\0';
+    return usb;
+}
+
+void isp_watch_start(isp_watch_t *w) {
+    memset(w, 0, sizeof(*w));
+#ifdef HAVE_LIBUDEV
+    w->udev = udev_new();
+    if (w->udev == NULL) return;
+    w->monitor = udev_monitor_new_from_netlink(w->udev, "udev");
+    // The hidraw node is created after the usb_device, so watch for both
+    if (w->monitor == NULL || udev_monitor_filter_add_match_subsystem_devtype(w->monitor, "usb", "usb_device") < 0 || udev_monitor_filter_add_match_subsystem_devtype(w->monitor, "hidraw", NULL) < 0 ||
+        udev_monitor_enable_receiving(w->monitor) < 0) {
+        if (w->monitor) udev_monitor_unref(w->monitor);
+        w->monitor = NULL;
+    }
+#endif
+}
+
+void isp_watch_stop(isp_watch_t *w) {
+#ifdef HAVE_LIBUDEV
+    if (w->monitor) udev_monitor_unref(w->monitor);
+    if (w->udev) udev_unref(w->udev);
+    w->monitor = NULL;
+    w->udev    = NULL;
+#endif
+}
+
+// Block until a Sonix USB device or its hidraw node arrives or timeout_ms
+// passes, and return whether something arrived. Events for other devices do
+// not extend the wait. Without libudev this just sleeps for one polling
+// interval and returns false.
+bool isp_watch_wait(isp_watch_t *w, int timeout_ms) {
+#ifdef HAVE_LIBUDEV
+    if (w->monitor) {
+        struct pollfd pfd      = {.fd = udev_monitor_get_fd(w->monitor), .events = POLLIN};
+        uint64_t      deadline = monotonic_ns() + (uint64_t)timeout_ms * 1000000;
+        for (uint64_t now = monotonic_ns(); now < deadline; now = monotonic_ns()) {
+            if (poll(&pfd, 1, (int)((deadline - now) / 1000000) + 1) <= 0) return false;
+            struct udev_device *dev = udev_monitor_receive_device(w->monitor);
+            if (dev == NULL) continue;
+            const char         *action    = udev_device_get_action(dev);
+            const char         *subsystem = udev_device_get_subsystem(dev);
+            struct udev_device *usb       = subsystem && strcmp(subsystem, "hidraw") == 0 ? udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device") : dev;
+            const char         *vid       = usb ? udev_device_get_sysattr_value(usb, "idVendor") : NULL;
+            bool                sonix     = action && strcmp(action, "add") == 0 && vid && strtol(vid, NULL, 16) == SONIX_VID;
+            udev_device_unref(dev);
+            if (sonix) return true;
+        }
+        return false;
+    }
+#endif
+    usleep((timeout_ms < REENUM_POLL_MS ? timeout_ms : REENUM_POLL_MS) * 1000);
+    return false;
+}
+
+// Find the ISP bootloader the keyboard re-enumerated as and move the session
+// over to it. When the old handle's USB port is known, only a bootloader on the
+// same port is accepted so parallel sessions never swap devices. The wait ends
+// with the session's time budget, which then times the session out.
+bool reacquire_isp_device(session_t *s, isp_watch_t *watch, const char *old_path) {
+    char     old_topology[TOPOLOGY_SIZE] = "";
+    bool     match_port                  = old_path && device_topology(old_path, old_topology, sizeof(old_topology));
+    uint64_t start                       = monotonic_ns();
+    uint64_t deadline                    = start + (uint64_t)REENUM_TIMEOUT_MS * 1000000;
+    bool     budget_ends                 = s->deadline_ns && s->deadline_ns < deadline;
+    uint64_t retry_until                 = 0;
+
+    if (budget_ends) deadline = s->deadline_ns;
+
+    session_log(s, "Waiting for the bootloader to enumerate...\n");
+    while (monotonic_ns() < deadline) {
+        struct hid_device_info *devs  = s->transport->enumerate(SONIX_VID, 0);
+        char                   *found = NULL;
+        for (struct hid_device_info *cur = devs; cur != NULL && found == NULL; cur = cur->next) {
+            char topology[TOPOLOGY_SIZE];
+            if (!is_known_isp_pid(cur->product_id)) continue;
+            device_topology(cur->path, topology, sizeof(topology));
+            if (!match_port || strcmp(topology, old_topology) == 0) found = strdup(cur->path);
+        }
+        s->transport->free_enumeration(devs);
+
+        if (found) {
+            void *handle = s->transport->open_path(found);
+            if (handle) {
+                s->transport->close(s->handle);
+                s->handle = handle;
+                free(s->path);
+                s->path = found;
+                stage_record(s, "reenumerate", 1, start, true);
+                session_log(s, "Bootloader found after %.0f ms: %s\n", (monotonic_ns() - start) / 1e6, found);
+                return true;
+            }
+            free(found);
+        }
+
+        // A device's nodes appear one after another, so after an arrival the
+        // open is retried at short intervals before waiting for events again
+        uint64_t now = monotonic_ns();
+        if (now >= deadline) break;
+        int remaining_ms = (int)((deadline - now) / 1000000) + 1;
+        if (now < retry_until)
+            usleep((remaining_ms < REENUM_POLL_MS ? remaining_ms : REENUM_POLL_MS) * 1000);
+        else if (isp_watch_wait(watch, remaining_ms))
+            retry_until = monotonic_ns() + (uint64_t)REENUM_SETTLE_MS * 1000000;
+    }
+    stage_record(s, "reenumerate", 1, start, false);
+    if (budget_ends) {
+        session_timed_out(s, "reenumerate", start, true);
+        return false;
+    }
+    session_err(s, "Warning: bootloader did not enumerate within %d ms, continuing with the old handle.\n", REENUM_TIMEOUT_MS);
+    return false;
+}
+
+bool protocol_init(session_t *s, bool oem_reboot, char *oem_option) {
+    unsigned char buf[REPORT_SIZE];
+    uint32_t      resp = 0;
+    uint64_t      start = monotonic_ns();
+    s->chip             = 0;
+    // 0) Request bootloader reboot
+    if (oem_reboot && !s->reacquired) {
+        isp_watch_t watch;
+        session_log(s, "Requesting bootloader reboot...\n");
+        isp_watch_start(&watch);
+        bool rebooted = reboot_to_bootloader(s, oem_option);
+        stage_record(s, "oem_reboot", 1, start, rebooted);
+        if (rebooted) {
+            session_log(s, "Bootloader reboot request success.\n");
+            // The keyboard drops off the bus and comes back as the ISP device
+            if (s->transport->enumerate) s->reacquired = reacquire_isp_device(s, &watch, s->path);
+            isp_watch_stop(&watch);
+            if (s->timeout_stage) return false;
+        } else {
+            isp_watch_stop(&watch);
+            session_log(s, "ERROR: Bootloader reboot request failed.\n");
+            return false;
+        }
+    }
+
+    // 01) Initialize
+    session_log(s, "\n");
+    session_log(s, "Fetching flash version...\n");
+
+    clear_buffer(buf, REPORT_SIZE);
+    buf[0] = CMD_GET_FW_VERSION;
+    write_buffer_16(buf + 1, CMD_BASE);
+    write_buffer_16(buf + 4, s->code_option);
+    uint8_t attempt_no = 1;
+    start              = monotonic_ns();
+    while (!hid_set_feature(s, buf, REPORT_SIZE) && attempt_no <= MAX_ATTEMPTS) // Try {MAX ATTEMPTS} to init flash.
+    {
+        stage_record(s, "fw_version_send", attempt_no, start, false);
+        if (s->timeout_stage) return false;
+        session_log(s, "Flash failed to fetch flash version, re-trying in 3 seconds. Attempt %d of %d...\n", attempt_no, MAX_ATTEMPTS);
+        if (!session_sleep(s, 3000, "init")) return false;
+        attempt_no++;
+        start = monotonic_ns();
+    }
+    if (attempt_no > MAX_ATTEMPTS) return false;
+
+    bool got_version = hid_get_feature(s, buf, REPORT_SIZE, CMD_GET_FW_VERSION);
+    stage_record(s, "fw_version", attempt_no, start, got_version);
+    if (!got_version) return false;
+    s->chip = sn32_decode_chip(s, buf);
+    if (s->chip == 0) return false;
+    s->cs_level = sn32_get_code_security(s, buf);
+    if (s->cs_level < 0) return false;
+    if (!sn32_check_isp_code_option(s, buf)) return false;
+
+    bool reboot_fail = !s->reacquired && !read_response_32(buf, 0, 0, &resp);
+    bool init_fail   = !read_response_32(buf, 0, CMD_VERIFY(CMD_GET_FW_VERSION), &resp);
+    if (init_fail) {
+        if (oem_reboot && reboot_fail) {
+            session_err(s, "ERROR: Failed to initialize: response cmd is 0x%08x, expected 0x%08x.\n", resp, 0);
+        } else
+            session_err(s, "ERROR: Failed to initialize: response cmd is 0x%08x, expected 0x%08x.\n", resp, CMD_VERIFY(CMD_GET_FW_VERSION));
+        return false;
+    }
+    return true;
+}
+
+bool protocol_code_option_check(session_t *s) {
+    unsigned char buf[REPORT_SIZE];
+    // 02) Prepare for Code Option Table check
+    session_log(s, "\n");
+    session_log(s, "Checking Code Option Table...\n");
+    clear_buffer(buf, REPORT_SIZE);
+    buf[0] = CMD_COMPARE_CODE_OPTION;
+    write_buffer_16(buf + 1, CMD_BASE);
+    write_buffer_16(buf + 4, s->code_option);
+    if (!hid_set_feature(s, buf, REPORT_SIZE)) return false;
+    clear_buffer(buf, REPORT_SIZE);
+    return true;
+}
+
+bool protocol_code_option_set(session_t *s, uint16_t code_option, uint16_t cs_value) {
+    unsigned char buf[REPORT_SIZE];
+    // 03) Set Code Option Table
+    session_log(s, "\n");
+    session_log(s, "Setting Code Option Table 0x%04x with Code Security value 0x%04X...\n", code_option, cs_value);
+    clear_buffer(buf, REPORT_SIZE);
+    buf[0] = CMD_SET_ENCRYPTION_ALGO;
+    write_buffer_16(buf + 1, CMD_BASE);
+    write_buffer_16(buf + 4, code_option);
+    write_buffer_16(buf + 6, cs_value);
+    if (!hid_set_feature(s, buf, REPORT_SIZE)) return false;
+    if (!hid_get_feature(s, buf, REPORT_SIZE, CMD_SET_ENCRYPTION_ALGO)) return false;
+    clear_buffer(buf, REPORT_SIZE);
+    return true;
+}
+
+bool erase_flash(session_t *s, uint16_t page_start, uint16_t page_end, uint16_t blank_checksum) {
+    unsigned char buf[REPORT_SIZE];
+    uint16_t      resp  = 0;
+    uint64_t      start = monotonic_ns();
+    // 04) Erase flash
+    session_log(s, "\n");
+    session_log(s, "Erasing flash from page %u to page %u...\n", page_start, page_end);
+    clear_buffer(buf, REPORT_SIZE);
+    buf[0] = CMD_ENABLE_ERASE;
+    write_buffer_16(buf + 1, CMD_BASE);
+    write_buffer_16(buf + 4, page_start);
+    write_buffer_16(buf + 8, page_end);
+    if (!hid_set_feature(s, buf, REPORT_SIZE) || !hid_get_feature(s, buf, REPORT_SIZE, CMD_ENABLE_ERASE)) {
+        stage_record(s, "erase", 1, start, false);
+        return false;
+    }
+    bool verified = read_response_16(buf, 8, blank_checksum, &resp);
+    stage_record(s, "erase", 1, start, verified);
+    if (verified) {
+        session_log(s, "Flash erase verified. \n");
+        return true;
+    } else {
+        session_err(s, "ERROR: Failed to verify flash erase: response is 0x%04x, expected 0x%04x.\n", resp, blank_checksum);
+        return false;
+    }
+    clear_buffer(buf, REPORT_SIZE);
+    return false;
+}
+
+// Ask the bootloader for the checksum of size bytes of flash at addr. The request
+// is assumed to carry the address and report count in the same places as
+// CMD_ENABLE_PROGRAM, and the checksum to come back where the erase verification
+// puts it. Neither is confirmed on a device yet, hence the opt-in.
+bool protocol_get_checksum(session_t *s, uint32_t addr, uint32_t size, uint16_t *checksum) {
+    unsigned char buf[REPORT_SIZE];
+    uint64_t      start = monotonic_ns();
+
+    if (!s->range_checksum) {
+        session_err(s, "ERROR: Range checksums are disabled, the checksum command is unverified on hardware.\n");
+        return false;
+    }
+    clear_buffer(buf, REPORT_SIZE);
+    buf[0] = CMD_GET_CHECKSUM;
+    write_buffer_16(buf + 1, CMD_BASE);
+    write_buffer_32(buf + 4, addr);
+    write_buffer_32(buf + 8, size / REPORT_SIZE);
+    bool ok = hid_set_feature(s, buf, REPORT_SIZE) && hid_get_feature(s, buf, REPORT_SIZE, CMD_GET_CHECKSUM);
+    stage_record(s, "checksum", 1, start, ok);
+    if (!ok) return false;
+    *checksum = 0;
+    read_response_16(buf, 8, 0, checksum);
+    return true;
+}
+
+bool protocol_reboot_user(session_t *s) {
+    unsigned char buf[REPORT_SIZE];
+    // 08) Reboot to User Mode
+    session_log(s, "\n");
+    session_log(s, "Flashing done. Rebooting.\n");
+    clear_buffer(buf, REPORT_SIZE);
+    buf[0] = CMD_RETURN_USER_MODE;
+    write_buffer_16(buf + 1, CMD_BASE);
+    if (!hid_set_feature(s, buf, REPORT_SIZE)) return false;
+    clear_buffer(buf, REPORT_SIZE);
+    return true;
+}
+
+// Failsafe when flashing a 268 w/o jumploader and offset. Returns the offset to use.
+// The pauses that give an operator time to abort are only made when the session
+// asks for them, and count against its time budget; after a timeout the caller's
+// next call fails.
+long sn32_check_offset(session_t *s, long offset, const fw_image_t *image, bool skip_offset_check) {
+    if (s->chip == SN260 && !(image->flags & IMAGE_JUMPLOADER) && offset == 0) {
+        session_log(s, "Warning: 26X flashing without offset.\n");
+        session_log(s, "Warning: POTENTIALLY DANGEROUS OPERATION.\n");
+        if (s->warning_pauses && !session_sleep(s, 3000, "offset_check")) return offset;
+        if (skip_offset_check) {
+            if (s->warning_pauses) {
+                session_log(s, "Warning: Flashing 26X without offset. Operation will continue after 10s...\n");
+                session_sleep(s, 10000, "offset_check");
+            } else {
+                session_log(s, "Warning: Flashing 26X without offset.\n");
+            }
+        } else {
+            session_log(s, "Fail safing to offset 0x%04x\n", QMK_OFFSET_DEFAULT);
+            offset = QMK_OFFSET_DEFAULT;
+        }
+    }
+    return offset;
+}
+
+// Ask the bootloader, in the middle of a program stream, for the last report it
+// took. A device that dropped out of program mode stops acknowledging, and one
+// that lost reports holds a different last chunk than the report just sent.
+static bool program_probe(session_t *s, const unsigned char *report) {
+    unsigned char buf[REPORT_SIZE];
+    uint32_t      last_chunk = 0;
+    uint32_t      resp       = 0;
+
+    memcpy(&last_chunk, report + LAST_CHUNK_OFFSET, sizeof(uint32_t));
+    if (!hid_get_feature(s, buf, REPORT_SIZE, CMD_ENABLE_PROGRAM)) return false;
+    if (!read_response_32(buf, LAST_CHUNK_OFFSET, last_chunk, &resp)) {
+        session_err(s, "ERROR: Bootloader is out of step: last chunk is 0x%08x, expected 0x%08x.\n", resp, last_chunk);
+        return false;
+    }
+    return true;
+}
+
+// Program size bytes from data at offset and check the bootloader's completion
+// report. checksum is the host checksum of the data, on success
+// *device_checksum holds the one reported back by the bootloader.
+bool program_range(session_t *s, long offset, const unsigned char *data, long size, uint16_t checksum, uint16_t *device_checksum) {
+    unsigned char buf[REPORT_SIZE];
+    uint32_t      resp  = 0;
+    uint64_t      start = monotonic_ns();
+
+    // 05) Enable program
+    session_log(s, "\n");
+    session_log(s, "Enabling Program mode...\n");
+
+    clear_buffer(buf, REPORT_SIZE);
+    buf[0] = CMD_ENABLE_PROGRAM;
+    write_buffer_16(buf + 1, CMD_BASE);
+    write_buffer_32(buf + 4, (uint32_t)offset);
+    write_buffer_32(buf + 8, (uint32_t)(size / REPORT_SIZE));
+    s->programmed = 0;
+    if (!hid_set_feature(s, buf, REPORT_SIZE)) return false;
+
+    if (!hid_get_feature(s, buf, REPORT_SIZE, CMD_ENABLE_PROGRAM)) return false;
+    clear_buffer(buf, REPORT_SIZE);
+
+    // 06) Flash
+    session_log(s, "Flashing device, please wait...\n");
+
+    // The image is padded to whole reports, feed them straight from memory
+    uint64_t next_progress = start + PROGRESS_INTERVAL_MS * 1000000ull;
+    long     probe_every   = s->probe_interval == PROBE_PAGE ? s->page_size / REPORT_SIZE : s->probe_interval;
+    for (long pos = 0; pos < size; pos += REPORT_SIZE) {
+        if (!hid_set_feature(s, data + pos, REPORT_SIZE)) {
+            stage_record(s, "program", 1, start, false);
+            return false;
+        }
+        // Probes fall on flash addresses, so per-page probes land on page boundaries
+        if (probe_every > 0 && ((offset + pos) / REPORT_SIZE + 1) % probe_every == 0 && pos + REPORT_SIZE < size) {
+            uint64_t probe_start = monotonic_ns();
+            if (!program_probe(s, data + pos)) {
+                session_err(s, "ERROR: Device stopped taking data after %ld of %ld bytes, aborting.\n", pos + REPORT_SIZE, size);
+                stage_record(s, "program_probe", 1, probe_start, false);
+                stage_record(s, "program", 1, start, false);
+                return false;
+            }
+            // Only data up to a good probe is known to have landed, sent reports don't count
+            s->programmed = pos + REPORT_SIZE;
+        }
+        if (s->progress_hook && (pos / REPORT_SIZE) % PROGRESS_STRIDE == 0 && monotonic_ns() >= next_progress) {
+            s->progress_hook(s, pos + REPORT_SIZE, size, start);
+            next_progress = monotonic_ns() + PROGRESS_INTERVAL_MS * 1000000ull;
+        }
+    }
+    if (s->progress_hook) s->progress_hook(s, size, size, start);
+    stage_record(s, "program", 1, start, true);
+
+    uint32_t last_chunk = 0;
+    memcpy(&last_chunk, data + size - sizeof(uint32_t), sizeof(uint32_t));
+    session_log(s, "Flashed File Checksum: 0x%04x\n", checksum);
+
+    // 07) Verify flash complete
+    session_log(s, "\n");
+    session_log(s, "Verifying flash completion...\n");
+    start         = monotonic_ns();
+    bool received = hid_get_feature(s, buf, REPORT_SIZE, CMD_ENABLE_PROGRAM);
+    bool complete = received && read_response_32(buf, LAST_CHUNK_OFFSET, last_chunk, &resp);
+    stage_record(s, "program_verify", 1, start, complete);
+    if (!received) return false;
+    if (!complete) {
+        session_err(s, "ERROR: Failed to verify flash completion: response is 0x%08x, expected 0x%08x.\n", resp, last_chunk);
+        return false;
+    }
+    session_log(s, "Flash completion verified. \n");
+    s->programmed    = size;
+    *device_checksum = (uint16_t)resp;
+    read_response_16(buf, 8, checksum, device_checksum);
+    return true;
+}
+
+// Checksum the bootloader reports for a range of erased flash: every 16-bit
+// word reads back as 0xFFFF.
+uint16_t blank_checksum_range(long size) {
+    return (uint16_t)(0u - (uint32_t)(size / 2));
+}
+
+// Compare the device checksum of the image's address range with the host image.
+// Trailing blank reports may read back either as the image or as erased flash,
+// depending on whether they were trimmed when flashing.
+bool verify_image(session_t *s, long offset, const fw_image_t *image) {
+    long     size            = image_trimmed_size(image);
+    uint16_t checksum        = image_range_checksum(image, 0, size);
+    uint16_t device_checksum = 0;
+
+    session_log(s, "\n");
+    session_log(s, "Verifying 0x%05lx-0x%05lx against the device checksum...\n", offset, offset + image->size);
+    if (!protocol_get_checksum(s, offset, size, &device_checksum)) return false;
+    s->image_checksum  = checksum;
+    s->device_checksum = device_checksum;
+    s->checksum_read   = true;
+    if (device_checksum != checksum) {
+        session_err(s, "ERROR:Flash Verification Checksum: FAILED! response is 0x%04x, expected 0x%04x.\n", device_checksum, checksum);
+        return false;
+    }
+    if (size < image->size) {
+        long tail = image->size - size;
+        if (!protocol_get_checksum(s, offset + size, tail, &device_checksum)) return false;
+        checksum = image_range_checksum(image, size, tail);
+        if (device_checksum != checksum && device_checksum != blank_checksum_range(tail)) {
+            session_err(s, "ERROR:Flash Verification Checksum: FAILED! 0x%05lx-0x%05lx response is 0x%04x, expected 0x%04x or 0x%04x.\n", offset + size, offset + image->size, device_checksum, checksum, blank_checksum_range(tail));
+            return false;
+        }
+    }
+    session_log(s, "Flash Verification Checksum: OK!\n");
+    return true;
+}
+
+// Compare the completion checksum program_range got back with the host checksum
+// of the range it programmed at address. The bootloader's value only matches for
+// writes from address 0, for others a mismatch is not an error and the range
+// readback of verify_image, when enabled, is the only verification.
+static bool check_completion(session_t *s, long address, uint16_t checksum, uint16_t device_checksum) {
+    s->image_checksum  = checksum;
+    s->device_checksum = device_checksum;
+    s->checksum_read   = true;
+    if (device_checksum == checksum) {
+        session_log(s, "Flash Verification Checksum: OK!\n");
+        return true;
+    }
+    if (address != 0) {
+        session_log(s, "Warning: offset 0x%04lx requested. Flash Verification Checksum disabled.\n", address);
+        return true;
+    }
+    session_err(s, "ERROR:Flash Verification Checksum: FAILED! response is 0x%04x, expected 0x%04x.\n", device_checksum, checksum);
+    return false;
+}
+
+// Program the whole image. With trim set the flash behind the image must have
+// just been erased: trailing reports that read as erased flash are left out and
+// verification covers only the reports actually sent.
+bool flash(session_t *s, long offset, const fw_image_t *image, bool skip_offset_check, bool trim) {
+    uint16_t device_checksum = 0;
+    long     size            = trim ? image_trimmed_size(image) : image->size;
+    uint16_t checksum        = size == image->size ? image->checksum : image_range_checksum(image, 0, size);
+
+    offset = sn32_check_offset(s, offset, image, skip_offset_check);
+    if (size != image->size) session_log(s, "Trimmed %ld trailing blank reports (%ld bytes).\n", (image->size - size) / REPORT_SIZE, image->size - size);
+    if (!program_range(s, offset, image->data, size, checksum, &device_checksum)) return false;
+    if (!check_completion(s, offset, checksum, device_checksum)) return false;
+    // Offset writes can only be verified by reading the range back
+    return offset == 0 || !s->range_checksum || verify_image(s, offset, image);
+}
+
+// Continue a flash of the image that broke off after the device confirmed done
+// bytes. Programming restarts at the page holding that point, after erasing the
+// pages from there on, and the whole image is verified at the end. Without range
+// checksums that verification isn't possible, so nothing is resumed. Sets
+// *needs_full_flash when no whole page of the image was written or the whole
+// image can't be verified.
+bool flash_resume(session_t *s, long offset, const fw_image_t *image, bool skip_offset_check, long done, bool *needs_full_flash) {
+    uint16_t device_checksum = 0;
+
+    *needs_full_flash = false;
+    if (!s->range_checksum) {
+        session_log(s, "Warning: resuming needs --range-checksum to verify the whole image afterwards.\n");
+        *needs_full_flash = true;
+        return false;
+    }
+    offset            = sn32_check_offset(s, offset, image, skip_offset_check);
+    long resume       = (offset + done) / s->page_size * s->page_size;
+    long start        = resume - offset;
+    if (done <= 0 || done > image->size || start <= 0) {
+        *needs_full_flash = true;
+        return false;
+    }
+
+    session_log(s, "\n");
+    session_log(s, "Resuming the interrupted flash at 0x%05lx, %ld of %ld bytes left...\n", resume, image->size - start, image->size);
+    s->programmed = start;
+    if (s->chip != SN240B && s->chip != SN260) {
+        long page_end = (offset + image->size + s->page_size - 1) / s->page_size;
+        if (page_end > s->user_rom_pages) page_end = s->user_rom_pages;
+        if (!erase_flash(s, resume / s->page_size, page_end, blank_checksum_range(page_end * s->page_size - resume))) return false;
+        wait_settle(s, s->timing->erase_ms);
+    }
+    uint16_t checksum = image_range_checksum(image, start, image->size - start);
+    bool     ok       = program_range(s, resume, image->data + start, image->size - start, checksum, &device_checksum);
+    s->programmed += start;
+    if (!ok || !check_completion(s, resume, checksum, device_checksum)) return false;
+    // The completion checksum covers the resumed part at best, check the whole image
+    return verify_image(s, offset, image);
+}
+
+// Program the dirty range [start, end) of the image, erasing the pages it covers
+// first on chips that need an explicit erase. A first page that also holds flash
+// below the image can't be erased; it is programmed as is when it reads blank from
+// start on, otherwise the range can't be updated and false is returned.
+bool program_dirty_range(session_t *s, long offset, const fw_image_t *image, long start, long end) {
+    uint16_t checksum        = image_range_checksum(image, start - offset, end - start);
+    uint16_t device_checksum = 0;
+
+    session_log(s, "\n");
+    session_log(s, "Updating 0x%05lx-0x%05lx...\n", start, end);
+    if (s->chip != SN240B && s->chip != SN260) {
+        long page_start = start / s->page_size;
+        long page_end   = (end + s->page_size - 1) / s->page_size;
+        if (page_start * s->page_size < offset) {
+            long lead_end = (page_start + 1) * s->page_size;
+            if (!protocol_get_checksum(s, start, lead_end - start, &device_checksum)) return false;
+            if (device_checksum != blank_checksum_range(lead_end - start)) {
+                session_err(s, "ERROR: 0x%05lx-0x%05lx differs, but flash page %ld also holds 0x%05lx-0x%05lx below the image, a differential flash can't erase it.\n", start, lead_end, page_start, page_start * s->page_size, offset);
+                return false;
+            }
+            session_log(s, "Flash page %ld is blank from 0x%05lx on, programming it without an erase.\n", page_start, start);
+            page_start++;
+        }
+        if (page_start < page_end && !erase_flash(s, page_start, page_end, blank_checksum_range((page_end - page_start) * s->page_size))) return false;
+    }
+    if (!program_range(s, start, image->data + (start - offset), end - start, checksum, &device_checksum)) return false;
+    if (!check_completion(s, start, checksum, device_checksum)) return false;
+
+    // Differential flashes rely on range checksums, read the range back to verify it
+    if (!protocol_get_checksum(s, start, end - start, &device_checksum)) return false;
+    if (device_checksum != checksum) {
+        session_err(s, "ERROR: Range 0x%05lx-0x%05lx checksum mismatch: device 0x%04x, expected 0x%04x.\n", start, end, device_checksum, checksum);
+        return false;
+    }
+    return true;
+}
+
+// Erase the user ROM from the page holding end onwards unless it reads as blank
+// already, so nothing of a larger previous firmware is left behind the image.
+bool erase_tail(session_t *s, long end) {
+    long     rom_end         = USER_ROM_SIZE_KB(s->user_rom_size);
+    long     tail_start      = (end + s->page_size - 1) / s->page_size * s->page_size;
+    uint16_t device_checksum = 0;
+
+    if (tail_start >= rom_end) return true;
+    if (!protocol_get_checksum(s, tail_start, rom_end - tail_start, &device_checksum)) return false;
+    if (device_checksum == blank_checksum_range(rom_end - tail_start)) return true;
+    return erase_flash(s, tail_start / s->page_size, s->user_rom_pages, blank_checksum_range(rom_end - tail_start));
+}
+
+// Erase only the pages that size bytes at offset occupy, verified against the
+// blank checksum of that range. Nothing below the image is touched: a leading
+// page the image only partly covers is left unerased when the image's part of it
+// reads blank already, which needs range checksums, and the erase is refused
+// otherwise.
+bool erase_image_range(session_t *s, long offset, long size) {
+    long page_start = offset / s->page_size;
+    long page_end   = (offset + size + s->page_size - 1) / s->page_size;
+
+    if (page_end > s->user_rom_pages) page_end = s->user_rom_pages;
+    if (offset % s->page_size != 0) {
+        long     lead_end        = (page_start + 1) * s->page_size;
+        uint16_t device_checksum = 0;
+        if (!s->range_checksum || !protocol_get_checksum(s, offset, lead_end - offset, &device_checksum) || device_checksum != blank_checksum_range(lead_end - offset)) {
+            session_err(s, "ERROR: offset 0x%05lx starts inside flash page %ld, erasing it would also wipe 0x%05lx-0x%05lx below the image.\n", offset, page_start, page_start * s->page_size, offset);
+            session_err(s, "ERROR: Flash from a page boundary, or with --range-checksum if the page is blank from the offset on.\n");
+            return false;
+        }
+        session_log(s, "Flash page %ld is blank from 0x%05lx on, programming it without an erase.\n", page_start, offset);
+        if (++page_start >= page_end) return true;
+    }
+    session_log(s, "\n");
+    session_log(s, "Erase plan: pages %ld-%ld of %u, %ld bytes at 0x%05lx.\n", page_start, page_end, s->user_rom_pages, (page_end - page_start) * s->page_size, page_start * s->page_size);
+    return erase_flash(s, page_start, page_end, blank_checksum_range((page_end - page_start) * s->page_size));
+}
+
+// Flash only the parts of the image that differ from the device contents.
+// Device and host checksums are compared block by block, each block covering
+// whole erase pages, and consecutive differing blocks are written as one range.
+// Sets *needs_full_flash when the offset isn't report aligned. Differences in a
+// first page shared with flash below the image fail the flash instead, see
+// program_dirty_range.
+bool flash_differential(session_t *s, long offset, const fw_image_t *image, bool skip_offset_check, bool *needs_full_flash) {
+    long block        = s->page_size > DIFF_BLOCK_SIZE ? s->page_size : DIFF_BLOCK_SIZE;
+    long run_start    = -1;
+    long programmed   = 0;
+    long reports_base = s->reports;
+
+    *needs_full_flash = false;
+    offset            = sn32_check_offset(s, offset, image, skip_offset_check);
+    long end          = offset + image->size;
+    if (offset % REPORT_SIZE != 0) {
+        session_log(s, "Warning: offset 0x%04lx is not report aligned, differential flash not possible.\n", offset);
+        *needs_full_flash = true;
+        return false;
+    }
+
+    session_log(s, "\n");
+    session_log(s, "Comparing device checksums in blocks of %ld bytes...\n", block);
+    for (long addr = offset; addr < end;) {
+        long     next            = (addr / block + 1) * block;
+        uint16_t device_checksum = 0;
+        if (next > end) next = end;
+
+        if (!protocol_get_checksum(s, addr, next - addr, &device_checksum)) return false;
+        bool differs = device_checksum != image_range_checksum(image, addr - offset, next - addr);
+        if (differs && run_start < 0) run_start = addr;
+        if (run_start >= 0 && (!differs || next == end)) {
+            long run_end = differs ? next : addr;
+            if (!program_dirty_range(s, offset, image, run_start, run_end)) return false;
+            programmed += run_end - run_start;
+            run_start = -1;
+        }
+        addr = next;
+    }
+
+    // Range checksums are in use already, so also clear what a larger firmware left behind the image
+    if (s->chip != SN240B && s->chip != SN260 && !erase_tail(s, end)) return false;
+
+    // A full flash is one erase and one program sequence, two reports each, plus the data
+    long full_reports = 4 + image->size / REPORT_SIZE;
+    long diff_reports = s->reports - reports_base;
+    session_log(s, "\n");
+    session_log(s, "Differential flash: programmed %ld of %ld bytes, %ld reports transferred (full flash: %ld, %ld bytes).\n", programmed, image->size, diff_reports, full_reports, full_reports * REPORT_SIZE);
+    return true;
+}
+
+bool sanity_check_firmware(session_t *s, const fw_image_t *image, long offset) {
+    if (image->size + offset > s->max_firmware) {
+        session_err(s, "ERROR: Firmware is too large too flash: 0x%08lx max allowed is 0x%08lx.\n", image->size, s->max_firmware - offset);
+        return false;
+    }
+    if (!(image->flags & IMAGE_MIN_SIZE_OK)) {
+        session_err(s, "ERROR: Firmware is too small.");
+        return false;
+    }
+
+    return true;
+
+    // TODO check pointer validity
+}
+
+bool sanity_check_jumploader_firmware(session_t *s, const fw_image_t *image) {
+    if (!(image->flags & IMAGE_JUMPLOADER_SIZE_OK)) {
+        session_err(s, "ERROR: Jumper loader is too large: 0x%08lx max allowed is 0x%08lx.\n", image->size, s->max_firmware - QMK_OFFSET_DEFAULT);
+        return false;
+    }
+
+    return true;
+}
+
+void *image_alloc(size_t size) {
+#ifdef _WIN32
+    return _aligned_malloc(size, IMAGE_ALIGNMENT);
+#else
+    void *p = NULL;
+    return posix_memalign(&p, IMAGE_ALIGNMENT, size) == 0 ? p : NULL;
+#endif
+}
+
+void image_alloc_free(void *p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+// Compute everything flashing needs from the padded image once: total and
+// per-report checksums, last chunk and the chip independent size checks. With
+// digest_size set, the SHA-256 of the first digest_size bytes goes to
+// image->digest; it is fed from the same chunks while they are still in cache,
+// so the image is only read once. False, without any output, when the per-report
+// table can't be allocated.
+bool image_finalize(fw_image_t *image, bool flash_jumploader, long digest_size) {
+    long         reports = image->size / REPORT_SIZE;
+    sha256_ctx_t digest;
+
+    image->report_checksums = malloc(reports * sizeof(uint16_t));
+    if (image->report_checksums == NULL) return false;
+    if (digest_size > 0) sha256_init(&digest);
+    image->checksum = 0;
+    for (long first = 0; first < reports; first += FINALIZE_CHUNK_REPORTS) {
+        long      count = reports - first < FINALIZE_CHUNK_REPORTS ? reports - first : FINALIZE_CHUNK_REPORTS;
+        long      start = first * REPORT_SIZE;
+        uint16_t *sums  = image->report_checksums + first;
+        checksum16_reports(image->data + start, count, sums);
+        for (long i = 0; i < count; i++)
+            image->checksum += sums[i];
+        if (start < digest_size) sha256_update(&digest, image->data + start, digest_size - start < count * REPORT_SIZE ? digest_size - start : count * REPORT_SIZE);
+    }
+    if (digest_size > 0) sha256_final(&digest, image->digest);
+    memcpy(&image->last_chunk, image->data + image->size - sizeof(uint32_t), sizeof(uint32_t));
+
+    if (flash_jumploader) image->flags |= IMAGE_JUMPLOADER;
+    if (image->size >= MIN_FIRMWARE) image->flags |= IMAGE_MIN_SIZE_OK;
+    if (image->size <= QMK_OFFSET_DEFAULT) image->flags |= IMAGE_JUMPLOADER_SIZE_OK;
+    return true;
+}
+
+// checksum16 of size bytes of the image from start, summed from the per-report
+// table when the range covers whole reports.
+uint16_t image_range_checksum(const fw_image_t *image, long start, long size) {
+    if (image->report_checksums == NULL || start % REPORT_SIZE != 0 || size % REPORT_SIZE != 0) return checksum16(image->data + start, size);
+
+    uint16_t checksum = 0;
+    for (long i = start / REPORT_SIZE; i < (start + size) / REPORT_SIZE; i++)
+        checksum += image->report_checksums[i];
+    return checksum;
+}
+
+long image_trimmed_size(const fw_image_t *image) {
+    long size = image->size;
+
+    // The padding added past the end of the file doesn't have to be written
+    while (size > REPORT_SIZE) {
+        for (long i = size - REPORT_SIZE; i < size && i < image->file_size; i++) {
+            if (image->data[i] != 0xFF) return size;
+        }
+        size -= REPORT_SIZE;
+    }
+    return size;
+}
+
+// Public API, see sonixflash.h.
+
+struct sonixflash {
+    session_t              session;
+    bool                   initialized;
+    sonixflash_log_fn      log;
+    sonixflash_progress_fn progress;
+    void                  *user;
+};
+
+static void sonixflash_sink(void *ctx, int stream_no, const char *line) {
+    sonixflash_t *f = ctx;
+    if (f->log) f->log(f->user, stream_no != 0, line);
+}
+
+static void sonixflash_progress(session_t *s, long done, long total, uint64_t start_ns) {
+    sonixflash_t *f = s->hook_ctx;
+    (void)start_ns;
+    if (f->progress) f->progress(f->user, done, total);
+}
+
+static sonixflash_status_t sonixflash_wrap(sonixflash_t **ctx, const sn32_transport_t *transport, void *handle, const char *path) {
+    sonixflash_t *f = calloc(1, sizeof(sonixflash_t));
+    if (f == NULL) {
+        transport->close(handle);
+        return SONIXFLASH_ERR_NOMEM;
+    }
+    session_init(&f->session, transport, handle, path, NULL);
+    f->session.sink          = sonixflash_sink;
+    f->session.sink_ctx      = f;
+    f->session.progress_hook = sonixflash_progress;
+    f->session.hook_ctx      = f;
+    *ctx                     = f;
+    return SONIXFLASH_OK;
+}
+
+sonixflash_status_t sonixflash_open(sonixflash_t **ctx, const char *backend, const char *path) {
+    const sn32_transport_t *transport = sn32_transport_find(backend ? backend : "hidapi");
+
+    if (ctx == NULL || path == NULL) return SONIXFLASH_ERR_ARGS;
+    if (transport == NULL) return SONIXFLASH_ERR_OPEN;
+    void *handle = transport->open_path(path);
+    if (handle == NULL) return SONIXFLASH_ERR_OPEN;
+    return sonixflash_wrap(ctx, transport, handle, path);
+}
+
+sonixflash_status_t sonixflash_open_vidpid(sonixflash_t **ctx, const char *backend, uint16_t vid, uint16_t pid) {
+    const sn32_transport_t *transport = sn32_transport_find(backend ? backend : "hidapi");
+
+    if (ctx == NULL) return SONIXFLASH_ERR_ARGS;
+    if (transport == NULL) return SONIXFLASH_ERR_OPEN;
+    struct hid_device_info *devs = transport->enumerate(vid, pid);
+    if (devs == NULL) return SONIXFLASH_ERR_OPEN;
+    sonixflash_status_t status = SONIXFLASH_ERR_OPEN;
+    void               *handle = transport->open_path(devs->path);
+    if (handle) status = sonixflash_wrap(ctx, transport, handle, devs->path);
+    transport->free_enumeration(devs);
+    return status;
+}
+
+sonixflash_status_t sonixflash_open_emulated(sonixflash_t **ctx, const char *chip) {
+    if (ctx == NULL || chip == NULL) return SONIXFLASH_ERR_ARGS;
+    sn32_emulator_t *emu = sn32_emulator_open(chip, 0);
+    if (emu == NULL) return SONIXFLASH_ERR_OPEN;
+    return sonixflash_wrap(ctx, &sn32_emulator_transport, emu, NULL);
+}
+
+void sonixflash_set_callbacks(sonixflash_t *ctx, sonixflash_log_fn log, sonixflash_progress_fn progress, void *user) {
+    ctx->log      = log;
+    ctx->progress = progress;
+    ctx->user     = user;
+}
+
+void sonixflash_set_range_checksum(sonixflash_t *ctx, bool enable) {
+    ctx->session.range_checksum = enable;
+}
+
+sonixflash_status_t sonixflash_set_timeouts(sonixflash_t *ctx, uint32_t io_timeout_ms, uint32_t session_timeout_ms) {
+    return session_set_deadlines(&ctx->session, io_timeout_ms, session_timeout_ms) ? SONIXFLASH_OK : SONIXFLASH_ERR_NOMEM;
+}
+
+// A failed call's status, SONIXFLASH_ERR_TIMEOUT when a deadline caused it.
+static sonixflash_status_t sonixflash_failed(const sonixflash_t *ctx, sonixflash_status_t status) {
+    return ctx->session.timeout_stage ? SONIXFLASH_ERR_TIMEOUT : status;
+}
+
+sonixflash_status_t sonixflash_init(sonixflash_t *ctx, const char *oem_reboot) {
+    session_t *s = &ctx->session;
+    char       option[16];
+    uint64_t   start;
+
+    snprintf(option, sizeof(option), "%s", oem_reboot ? oem_reboot : "");
+    start = monotonic_ns();
+    bool ok = protocol_init(s, oem_reboot != NULL, option);
+    stage_record(s, "init", 1, start, ok);
+    if (!ok) return sonixflash_failed(ctx, SONIXFLASH_ERR_INIT);
+    wait_settle(s, s->timing->init_ms);
+    if (s->chip != SN240B && s->chip != SN260) {
+        start = monotonic_ns();
+        ok    = protocol_code_option_check(s);
+        stage_record(s, "code_option_check", 1, start, ok);
+        if (!ok) return sonixflash_failed(ctx, SONIXFLASH_ERR_CODE_OPTION);
+        wait_settle(s, s->timing->code_option_ms);
+    }
+    ctx->initialized = true;
+    return SONIXFLASH_OK;
+}
+
+sonixflash_status_t sonixflash_get_info(sonixflash_t *ctx, sonixflash_info_t *info) {
+    const session_t *s = &ctx->session;
+
+    if (!ctx->initialized || info == NULL) return SONIXFLASH_ERR_ARGS;
+    info->chip        = s->chip;
+    info->rom_size    = s->max_firmware;
+    info->page_size   = s->page_size;
+    info->pages       = s->user_rom_pages;
+    info->cs_level    = s->cs_level;
+    info->code_option = s->code_option;
+    return SONIXFLASH_OK;
+}
+
+sonixflash_status_t sonixflash_set_code_option(sonixflash_t *ctx, uint16_t code_option, int cs_level) {
+    static const uint16_t cs_values[] = {CS0_0, CS1, CS2, CS3};
+    session_t            *s           = &ctx->session;
+
+    if (!ctx->initialized || cs_level < 0 || cs_level > 3) return SONIXFLASH_ERR_ARGS;
+    uint64_t start = monotonic_ns();
+    bool     ok    = protocol_code_option_set(s, code_option, cs_level == 0 ? s->cs0 : cs_values[cs_level]);
+    stage_record(s, "code_option_set", 1, start, ok);
+    if (!ok) return sonixflash_failed(ctx, SONIXFLASH_ERR_CODE_OPTION);
+    s->code_option = code_option;
+    s->cs_level    = cs_level;
+    wait_settle(s, s->timing->cs_reset_ms);
+    return SONIXFLASH_OK;
+}
+
+sonixflash_status_t sonixflash_erase(sonixflash_t *ctx, long start, long end) {
+    session_t *s = &ctx->session;
+
+    if (!ctx->initialized || start < 0 || end > s->max_firmware || start >= end || start % s->page_size != 0 || end % s->page_size != 0) return SONIXFLASH_ERR_ARGS;
+    if (s->chip == SN240B || s->chip == SN260) return SONIXFLASH_ERR_UNSUPPORTED;
+    if (!erase_flash(s, start / s->page_size, end / s->page_size, blank_checksum_range(end - start))) return sonixflash_failed(ctx, SONIXFLASH_ERR_ERASE);
+    wait_settle(s, s->timing->erase_ms);
+    return SONIXFLASH_OK;
+}
+
+// Copy data into an image padded the way the command line pads files.
+static sonixflash_status_t sonixflash_image(sonixflash_t *ctx, long offset, const void *data, size_t size, fw_image_t *image) {
+    session_t *s      = &ctx->session;
+    long       padded = ((long)size + REPORT_SIZE - 1) / REPORT_SIZE * REPORT_SIZE;
+
+    if (!ctx->initialized || data == NULL || size == 0 || offset < 0 || offset % REPORT_SIZE != 0) return SONIXFLASH_ERR_ARGS;
+    if (padded > s->max_firmware - offset) {
+        session_err(s, "ERROR: 0x%lx bytes at 0x%08lx don't fit the 0x%08lx bytes of flash.\n", padded, offset, s->max_firmware);
+        return SONIXFLASH_ERR_ARGS;
+    }
+    memset(image, 0, sizeof(*image));
+    image->data = image_alloc(padded);
+    if (image->data == NULL) return SONIXFLASH_ERR_NOMEM;
+    memcpy(image->data, data, size);
+    memset(image->data + size, 0, padded - size);
+    image->size      = padded;
+    image->file_size = size;
+    if (!image_finalize(image, false, 0)) {
+        session_err(s, "ERROR: Could not allocate the report checksum table.\n");
+        image_alloc_free(image->data);
+        return SONIXFLASH_ERR_NOMEM;
+    }
+    return SONIXFLASH_OK;
+}
+
+static void sonixflash_image_free(fw_image_t *image) {
+    free(image->report_checksums);
+    image_alloc_free(image->data);
+}
+
+sonixflash_status_t sonixflash_program(sonixflash_t *ctx, long offset, const void *data, size_t size, bool skip_offset_check) {
+    fw_image_t          image;
+    sonixflash_status_t status = sonixflash_image(ctx, offset, data, size, &image);
+
+    if (status != SONIXFLASH_OK) return status;
+    ctx->session.checksum_read = false;
+    if (!flash(&ctx->session, offset, &image, skip_offset_check, false)) status = sonixflash_failed(ctx, ctx->session.checksum_read ? SONIXFLASH_ERR_VERIFY : SONIXFLASH_ERR_PROGRAM);
+    sonixflash_image_free(&image);
+    return status;
+}
+
+sonixflash_status_t sonixflash_verify(sonixflash_t *ctx, long offset, const void *data, size_t size) {
+    fw_image_t          image;
+    sonixflash_status_t status = sonixflash_image(ctx, offset, data, size, &image);
+
+    if (status != SONIXFLASH_OK) return status;
+    if (!verify_image(&ctx->session, offset, &image)) status = sonixflash_failed(ctx, SONIXFLASH_ERR_VERIFY);
+    sonixflash_image_free(&image);
+    return status;
+}
+
+sonixflash_status_t sonixflash_reboot(sonixflash_t *ctx) {
+    session_t *s = &ctx->session;
+
+    if (!ctx->initialized) return SONIXFLASH_ERR_ARGS;
+    wait_settle(s, s->timing->reboot_ms);
+    uint64_t start = monotonic_ns();
+    bool     ok    = protocol_reboot_user(s);
+    stage_record(s, "reboot_user", 1, start, ok);
+    ctx->initialized = false;
+    return ok ? SONIXFLASH_OK : sonixflash_failed(ctx, SONIXFLASH_ERR_REBOOT);
+}
+
+void sonixflash_close(sonixflash_t *ctx) {
+    if (ctx == NULL) return;
+    if (ctx->session.handle) ctx->session.transport->close(ctx->session.handle);
+    session_free(&ctx->session);
+    free(ctx);
+}
+
+const char *sonixflash_strerror(sonixflash_status_t status) {
+    switch (status) {
+        case SONIXFLASH_OK:
+            return "success";
+        case SONIXFLASH_ERR_ARGS:
+            return "invalid argument";
+        case SONIXFLASH_ERR_OPEN:
+            return "could not open the device";
+        case SONIXFLASH_ERR_INIT:
+            return "bootloader did not initialize";
+        case SONIXFLASH_ERR_CODE_OPTION:
+            return "code option table update failed";
+        case SONIXFLASH_ERR_ERASE:
+            return "erase failed";
+        case SONIXFLASH_ERR_PROGRAM:
+            return "programming failed";
+        case SONIXFLASH_ERR_VERIFY:
+            return "device checksum mismatch";
+        case SONIXFLASH_ERR_REBOOT:
+            return "reboot failed";
+        case SONIXFLASH_ERR_NOMEM:
+            return "out of memory";
+        case SONIXFLASH_ERR_TIMEOUT:
+            return "device timed out";
+        case SONIXFLASH_ERR_UNSUPPORTED:
+            return "not supported by this chip";
+    }
+    return "unknown error";
+}
@@ -0,0 +1,114 @@
+#ifndef SONIXFLASH_H
+#define SONIXFLASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// libsonixflash: flashing SN32 keyboards through their ISP bootloader.
+//
+// Every call works on its own context, so several devices can be flashed from
+// different threads at once. Calls never exit or print; failures come back as a
+// status and the protocol output goes to the log callback. A typical run is
+//
+//   sonixflash_open(&ctx, NULL, path);
+//   sonixflash_init(ctx, NULL);
+//   sonixflash_erase(ctx, 0, info.rom_size);
+//   sonixflash_program(ctx, 0x200, data, size, false);
+//   sonixflash_reboot(ctx);
+//   sonixflash_close(ctx);
+//
+// Devices opened through hidapi need hid_exit() once the application is done.
+
+typedef struct sonixflash sonixflash_t;
+
+typedef enum {
+    SONIXFLASH_OK = 0,
+    SONIXFLASH_ERR_ARGS,        // Invalid argument, or a call out of order
+    SONIXFLASH_ERR_OPEN,        // Device, backend or emulated chip not found
+    SONIXFLASH_ERR_INIT,        // Bootloader didn't answer or reported an unknown chip
+    SONIXFLASH_ERR_CODE_OPTION, // Code option check or set failed
+    SONIXFLASH_ERR_ERASE,
+    SONIXFLASH_ERR_PROGRAM,
+    SONIXFLASH_ERR_VERIFY, // Device checksum doesn't match the data
+    SONIXFLASH_ERR_REBOOT,
+    SONIXFLASH_ERR_NOMEM,
+    SONIXFLASH_ERR_TIMEOUT,     // A deadline set by sonixflash_set_timeouts passed, the device is given up on
+    SONIXFLASH_ERR_UNSUPPORTED, // The chip has no such command, nothing was done
+} sonixflash_status_t;
+
+// What sonixflash_init learned about the device.
+typedef struct {
+    int      chip;        // Chip family, SN240 .. SN240C as in sonixflasher.h
+    long     rom_size;    // User ROM in bytes
+    long     page_size;   // Erase page in bytes
+    int      pages;
+    int      cs_level;    // Code security level, 0-3
+    uint16_t code_option; // Code Option Table read from the bootloader
+} sonixflash_info_t;
+
+// Called with every complete output line, error set for error output.
+typedef void (*sonixflash_log_fn)(void *user, bool error, const char *line);
+
+// Called while programming with the bytes written so far out of total.
+typedef void (*sonixflash_progress_fn)(void *user, long done, long total);
+
+// Open the device at path with backend ("hidapi", "hidraw"), NULL for hidapi.
+sonixflash_status_t sonixflash_open(sonixflash_t **ctx, const char *backend, const char *path);
+
+// Open the first device matching vid/pid.
+sonixflash_status_t sonixflash_open_vidpid(sonixflash_t **ctx, const char *backend, uint16_t vid, uint16_t pid);
+
+// Open an in-process emulated bootloader for chip ("240", "260", ...).
+sonixflash_status_t sonixflash_open_emulated(sonixflash_t **ctx, const char *chip);
+
+// Set the output and progress callbacks, both may be NULL. Output is dropped
+// without a log callback.
+void sonixflash_set_callbacks(sonixflash_t *ctx, sonixflash_log_fn log, sonixflash_progress_fn progress, void *user);
+
+// Allow the bootloader's range checksum command (CMD_GET_CHECKSUM), which
+// sonixflash_verify needs. Its request and reply layout is unverified on
+// hardware, so it is off by default.
+void sonixflash_set_range_checksum(sonixflash_t *ctx, bool enable);
+
+// Give up on the device when a feature report isn't answered within
+// io_timeout_ms, or once session_timeout_ms have passed from this call, either 0
+// for none. Calls then run on a watchdog thread. The call that runs into a
+// deadline returns SONIXFLASH_ERR_TIMEOUT, and only sonixflash_close is left to
+// do after it.
+sonixflash_status_t sonixflash_set_timeouts(sonixflash_t *ctx, uint32_t io_timeout_ms, uint32_t session_timeout_ms);
+
+// Identify the bootloader and prepare it for the calls below. oem_reboot names
+// the OEM reboot option ("sonix", "evision", ...) when the device still runs its
+// firmware, NULL when it is in the bootloader already.
+sonixflash_status_t sonixflash_init(sonixflash_t *ctx, const char *oem_reboot);
+
+sonixflash_status_t sonixflash_get_info(sonixflash_t *ctx, sonixflash_info_t *info);
+
+// Write the Code Option Table with code security level cs_level (0-3). Level 0
+// has to be set before a protected device can be erased.
+sonixflash_status_t sonixflash_set_code_option(sonixflash_t *ctx, uint16_t code_option, int cs_level);
+
+// Erase the flash bytes [start, end), both page aligned. Chips that erase while
+// programming (240B, 260) have no erase command; nothing is erased there and
+// SONIXFLASH_ERR_UNSUPPORTED is returned, which callers can treat as done.
+sonixflash_status_t sonixflash_erase(sonixflash_t *ctx, long start, long end);
+
+// Program size bytes at offset, which must be a multiple of 64. The data is
+// padded with zeros to whole 64-byte reports and checked against the device
+// checksum afterwards. On the 260 an image at offset 0 that isn't a jumploader
+// is moved to 0x200, as the flasher does, unless skip_offset_check is set.
+sonixflash_status_t sonixflash_program(sonixflash_t *ctx, long offset, const void *data, size_t size, bool skip_offset_check);
+
+// Compare size bytes at offset with the device checksum of that range. Needs
+// sonixflash_set_range_checksum.
+sonixflash_status_t sonixflash_verify(sonixflash_t *ctx, long offset, const void *data, size_t size);
+
+// Leave the bootloader and start the flashed firmware.
+sonixflash_status_t sonixflash_reboot(sonixflash_t *ctx);
+
+void sonixflash_close(sonixflash_t *ctx);
+
+const char *sonixflash_strerror(sonixflash_status_t status);
+
+#endif // SONIXFLASH_H
@@ -6,98 +6,111 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
 
 #ifdef _WIN32
 #include <windows.h>
+#include <malloc.h>
 #else
-#include <limits.h>
 #include <unistd.h>
+#include <poll.h>
+#endif
+
+#ifdef HAVE_LIBUDEV
+#include <libudev.h>
 #endif
 
 #include <hidapi.h>
 
-#define REPORT_SIZE 64
-#define USER_ROM_SIZE_SN32F260 30   // in KB
-#define USER_ROM_SIZE_SN32F220 16   // in KB
-#define USER_ROM_SIZE_SN32F230 32   // in KB
-#define USER_ROM_SIZE_SN32F240 64   // in KB
-#define USER_ROM_SIZE_SN32F240B 64  // in KB
-#define USER_ROM_SIZE_SN32F240C 128 // in KB
-#define USER_ROM_SIZE_SN32F280 128  // in KB
-#define USER_ROM_SIZE_SN32F290 256  // in KB
-#define USER_ROM_SIZE_KB(x) ((x) * 1024)
-
-#define USER_ROM_PAGES_SN32F260 480
-#define USER_ROM_PAGES_SN32F220 16
-#define USER_ROM_PAGES_SN32F230 32
-#define USER_ROM_PAGES_SN32F240 64
-#define USER_ROM_PAGES_SN32F240B 1024
-#define USER_ROM_PAGES_SN32F240C 128
-#define USER_ROM_PAGES_SN32F280 128
-#define USER_ROM_PAGES_SN32F290 256
-
-#define QMK_OFFSET_DEFAULT 0x200
-#define MIN_FIRMWARE 0x100
-
-#define CMD_BASE 0x55AA
-#define CMD_GET_FW_VERSION 0x1
-#define CMD_COMPARE_CODE_OPTION 0x2
-#define CMD_SET_ENCRYPTION_ALGO 0x3
-#define CMD_ENABLE_ERASE 0x4
-#define CMD_ENABLE_PROGRAM 0x5
-#define CMD_GET_CHECKSUM 0x6
-#define CMD_RETURN_USER_MODE 0x7
-#define CMD_SET_CS 0x8
-#define CMD_GET_CS 0x9
-#define CMD_VERIFY(x) ((CMD_BASE << 8) | (x))
-
-#define CMD_ACK 0xFAFAFAFA
-#define LAST_CHUNK_OFFSET (REPORT_SIZE - sizeof(uint32_t))
-
-#define SN240 1
-#define SN260 2
-#define SN240B 3
-#define SN280 4
-#define SN290 5
-#define SN240C 6
-
-#define CS0_0 0x0000
-#define CS0_1 0xFFFF
-
-#define CS1 0x5A5A
-#define CS2 0xA5A5
-#define CS3 0x55AA
-
-#define SONIX_VID 0x0c45
-#define SN229_PID 0x7900
-#define SN239_PID SN229_PID
-#define SN249_PID SN229_PID
-#define SN248B_PID 0x7040
-#define SN248C_PID 0x7160
-#define SN268_PID 0x7010
-#define SN289_PID 0x7120
-#define SN299_PID 0x7140
-
-#define EVISION_VID 0x320F
-#define APPLE_VID 0x05ac
-
-#define MAX_ATTEMPTS 5
-#define RETRY_DELAY_MS 100
+#include "sonixflasher.h"
+#include "sn32_emulator.h"
+#include "image_cache.h"
+#include "journal.h"
+#include "discovery.h"
+#include "image_formats.h"
+#include "trace.h"
+#include "watchdog.h"
+#ifdef HAVE_HIDRAW
+#include "hidraw_transport.h"
+#endif
+#ifndef _WIN32
+#include "daemon.h"
+#endif
+
+#ifndef DEFAULT_BACKEND
+#define DEFAULT_BACKEND "hidapi"
+#endif
 
 #define PROJECT_NAME "sonixflasher"
 #define PROJECT_VER "2.0.8"
 
-uint16_t           BLANK_CHECKSUM   = 0x0000;
-uint16_t           CS0              = CS0_0;
-uint16_t           USER_ROM_SIZE    = USER_ROM_SIZE_SN32F260;
-uint16_t           USER_ROM_PAGES   = USER_ROM_PAGES_SN32F260;
-long               MAX_FIRMWARE     = USER_ROM_SIZE_KB(USER_ROM_SIZE_SN32F260);
-bool               flash_jumploader = false;
-bool               debug            = false;
-static uint16_t    code_option      = 0x0000; // Initial Code Option Table
-int                chip;
-int                cs_level;
-const unsigned int known_isp_pids[] = {SN229_PID, SN239_PID, SN249_PID, SN248B_PID, SN248C_PID, SN268_PID, SN289_PID, SN299_PID};
+#define MAX_FLEET_DEVICES 32
+#define STATION_POLL_MS 250
+#define STATION_DEBOUNCE_MS 2000
+#define TRACE_GAP_MS 50
+#define MAX_MANIFEST_STEPS 32
+#define ABANDONED_DRAIN_MS 1000 // How long exit waits for calls abandoned after a timeout
+
+// Options of one flash run, shared by every session flashing the same image.
+typedef struct {
+    long       offset;
+    bool       offset_given; // --offset was passed, otherwise HEX/ELF/UF2 files set it
+    bool       jumploader;   // Flashing a jumploader
+    char      *file_name;
+    char      *reboot_opt;
+    bool       reboot_requested;
+    bool       no_offset_check;
+    bool       differential; // Only erase and program ranges that differ from the device
+    bool       trim;         // Skip trailing blank reports after a full erase
+    bool       verify_only;  // Compare device checksums with the image, no erase or program
+    fw_image_t image; // Loaded once, read-only while sessions run
+    struct manifest_step *steps; // --manifest/--step session, replaces the single image
+    int                   step_count;
+    pthread_t             prep_thread; // Prepares the images while the device is opened, see images_prepare_start
+    bool                  prep_started;
+    bool                  prep_ok;
+} flash_options_t;
+
+typedef enum {
+    STEP_OEM_REBOOT, // Only as the first step, done by the session init
+    STEP_CS_RESET,
+    STEP_ERASE,
+    STEP_PROGRAM,
+    STEP_VERIFY,
+    STEP_REBOOT, // Only as the last step
+} step_op_t;
+
+// One step of a manifest. Program and verify steps carry their own image options.
+typedef struct manifest_step {
+    step_op_t       op;
+    char            text[128];  // As written, for messages
+    char            option[16]; // STEP_OEM_REBOOT option
+    long            start;      // STEP_ERASE range, empty for the pages the images occupy
+    long            end;
+    flash_options_t image;
+} manifest_step_t;
+
+manifest_step_t manifest_steps[MAX_MANIFEST_STEPS];
+int             manifest_step_count = 0;
+
+bool     debug           = false;
+long     probe_interval  = 0;     // --probe-interval, see session_t.probe_interval
+bool     range_checksum  = false; // --range-checksum, see session_t.range_checksum
+uint32_t io_timeout_ms   = 0;     // --io-timeout, 0 for none
+uint32_t session_timeout = 0;     // --session-timeout in seconds, 0 for none
+char    *timing_file     = NULL;  // --timing output, NULL when disabled
+char    *image_cache_dir = NULL;  // --cache directory, NULL when disabled
+char    *journal_dir     = NULL;  // --resume journal directory, NULL when disabled
+FILE    *trace_out       = NULL;  // --trace output, NULL when disabled
+FILE    *json_out        = NULL;  // --json event stream, NULL when disabled
+bool     timing_enabled  = false;
+uint64_t timing_epoch_ns = 0;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t json_lock  = PTHREAD_MUTEX_INITIALIZER;
 
 static void print_vidpid_table() {
     printf("Supported VID/PID pairs:\n");
@@ -120,14 +133,37 @@ static void print_usage(char *m_name) {
             "Usage: \n"
             "  %s <cmd> [options]\n"
             "where <cmd> is one of:\n"
-            "  --vidpid -v      Set VID for device to flash \n"
-            "  --offset -o      Set flashing offset (default: 0)\n"
-            "  --file -f        Binary of the firmware to flash (*.bin extension) \n"
+            "  --vidpid -v      Set VID for device to flash (default: discover the connected bootloader or keyboard) \n"
+            "  --offset -o      Set flashing offset (default: 0, or the load address of HEX/ELF/UF2 files)\n"
+            "  --file -f        Firmware to flash: raw binary, Intel HEX, ELF or UF2 \n"
             "  --jumploader -j  Define if we are flashing a jumploader \n"
             "  --reboot -r      Request bootloader reboot in OEM firmware (options: sonix, evision, hfd) \n"
             "  --debug -d       Enable debug mode \n"
             "  --nooffset -k    Disable offset checks \n"
             "  --list-vidpid -l Display supported VID/PID pairs \n"
+            "  --fleet -F       Flash every connected device matching vid/pid concurrently \n"
+            "  --station -s     Keep running and flash every ISP bootloader (and vid/pid with --reboot) as it is plugged in \n"
+            "  --diff -D        Only erase and program the ranges that differ from the device \n"
+            "  --trim -t        Don't program trailing blank (0xFF) reports left erased by the erase \n"
+            "  --verify-only -y Compare the device flash with the firmware without erasing or programming \n"
+            "  --probe-interval -P  Check the bootloader is still in step every n reports while programming, or every 'page' \n"
+            "  --range-checksum -c  Allow the bootloader's range checksum command, UNVERIFIED on hardware \n"
+            "                   (needed by --diff, --verify-only and manifest verify steps) \n"
+            "  --io-timeout -I  Give up on a device that doesn't answer a feature report within n milliseconds \n"
+            "  --session-timeout -W  Give up on a device whose whole session takes longer than n seconds \n"
+            "  --emulate -E     Flash an emulated bootloader instead of a device and print benchmark figures\n"
+            "                   (options: 220, 230, 240, 240b, 240c, 260, 280, 290) \n"
+            "  --emulate-latency -L  Per-report latency of the emulated bootloader in microseconds (default: 0) \n"
+            "  --timing -T      Write per-stage and per-report timing as JSON to a file ('-' for stdout) \n"
+            "  --trace -x       Record every feature report in a binary trace file \n"
+            "  --json -J        Print JSON-lines stage, progress and result events on stdout, text on stderr \n"
+            "  --decode-trace -X  Print a trace file written by --trace and exit \n"
+            "  --cache -C       Reuse prepared images from the image cache (SONIXFLASHER_CACHE_DIR to relocate it) \n"
+            "  --resume -R      Journal interrupted flashes per device and continue them on the next run \n"
+            "  --manifest -M    Run the steps listed in a file in one bootloader session instead of --file \n"
+            "  --step -m        Add one manifest step, e.g. -m 'program fw.bin 0x200' (repeatable) \n"
+            "  --backend -B     Device transport (options: hidapi, hidraw on Linux; default: " DEFAULT_BACKEND ") \n"
+            "  --daemon -S      Serve flash jobs on a local Unix socket instead of flashing once \n"
             "  --version -V     Print version information \n"
             "\n"
             "Examples: \n"
@@ -135,6 +171,10 @@ static void print_usage(char *m_name) {
             "   sonixflasher --vidpid 0c45/7040 --file fw.bin -j\n"
             ". Flash fw to device w/ vid/pid 0x0c45/0x7040 and offset 0x200\n"
             "   sonixflasher --vidpid 0c45/7040 --file fw.bin -o 0x200\n"
+            ". Flash fw to every connected device w/ vid/pid 0x0c45/0x7040\n"
+            "   sonixflasher --vidpid 0c45/7040 --file fw.bin -o 0x200 --fleet\n"
+            ". Serve flash jobs on /tmp/sonixflasher.sock\n"
+            "   sonixflasher --daemon /tmp/sonixflasher.sock\n"
             "\n"
             ""
             "",
@@ -146,748 +186,1327 @@ static void display_version(char *m_name) {
     fprintf(stderr, "%s " PROJECT_VER "\n", m_name);
 }
 
-void cleanup(hid_device *handle) {
-    if (handle) hid_close(handle);
-    if (hid_exit() != 0) {
+// Transport selected with --backend
+const sn32_transport_t *device_transport = &hidapi_transport;
+
+bool select_backend(const char *name) {
+    const sn32_transport_t *transport = sn32_transport_find(name);
+    if (transport) {
+        device_transport = transport;
+        return true;
+    }
+    fprintf(stderr, "ERROR: unsupported backend '%s', expected one of:", name);
+    for (size_t i = 0; i < sn32_transport_count; i++)
+        fprintf(stderr, " %s", sn32_transports[i]->name);
+    fprintf(stderr, "\n");
+    return false;
+}
+
+void cleanup(void *handle) {
+    if (handle) device_transport->close(handle);
+    // A call abandoned after a timeout may still be inside hidapi, which must not
+    // be shut down under it. The process exit reclaims everything then.
+    if (!watchdog_drain(ABANDONED_DRAIN_MS)) {
+        fprintf(stderr, "Warning: a timed out device call is still blocked, HID left open.\n");
+    } else if (hid_exit() != 0) {
         fprintf(stderr, "ERROR: Could not close the device.\n");
     }
+    if (trace_out) fclose(trace_out);
+    trace_out = NULL;
 }
 
-void error(hid_device *handle) {
+void error(void *handle) {
     cleanup(handle);
     exit(1);
 }
 
-void clear_buffer(unsigned char *data, size_t length) {
-    for (int i = 0; i < length; i++)
-        data[i] = 0;
+// Name of the session's device in traces and events.
+static const char *session_label(const session_t *s) {
+    return s->path ? s->path : s->transport->name;
 }
 
-void print_buffer(unsigned char *data, size_t length) {
-    printf("Sending Report...\n");
-    for (int i = 0; i < length; i++)
-        printf("%02x", data[i]);
-    printf("\n");
+static void json_write_string(FILE *f, const char *str) {
+    fputc('"', f);
+    for (const char *c = str; c && *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(f, "\\%c", *c);
+        else if ((unsigned char)*c < 0x20)
+            fprintf(f, "\\u%04x", *c);
+        else
+            fputc(*c, f);
+    }
+    fputc('"', f);
 }
 
-bool read_response_16(unsigned char *data, uint32_t offset, uint16_t expected_result, uint16_t *resp) {
-    uint16_t r = *resp;
-
-    memcpy(&r, data + offset, sizeof(uint16_t));
-
-    *resp = r;
-    return r == expected_result;
+// Emit one --json event line, {"t_ms": .., "device": .., "event": event, fields}.
+// fields is a printf format for the remaining members, or NULL.
+static void json_event(session_t *s, const char *event, const char *fmt, ...) {
+    va_list ap;
+
+    if (json_out == NULL) return;
+    pthread_mutex_lock(&json_lock);
+    fprintf(json_out, "{\"t_ms\": %.3f, \"device\": ", (monotonic_ns() - timing_epoch_ns) / 1e6);
+    json_write_string(json_out, session_label(s));
+    fprintf(json_out, ", \"event\": \"%s\"", event);
+    if (fmt) {
+        fputs(", ", json_out);
+        va_start(ap, fmt);
+        vfprintf(json_out, fmt, ap);
+        va_end(ap);
+    }
+    fputs("}\n", json_out);
+    fflush(json_out);
+    pthread_mutex_unlock(&json_lock);
 }
 
-bool read_response_32(unsigned char *data, uint32_t offset, uint32_t expected_result, uint32_t *resp) {
-    uint32_t r = *resp;
+// Report how far programming got, with throughput and the estimated time left.
+static void json_progress(session_t *s, long done, long total, uint64_t start_ns) {
+    double elapsed_ms = (monotonic_ns() - start_ns) / 1e6;
+    double rate       = elapsed_ms > 0 ? done / elapsed_ms : 0; // bytes per ms
+    json_event(s, "progress", "\"reports\": %ld, \"total_reports\": %ld, \"bytes\": %ld, \"total_bytes\": %ld, \"kib_per_s\": %.1f, \"eta_ms\": %.0f", done / REPORT_SIZE, total / REPORT_SIZE, done, total, rate * 1000 / 1024, rate > 0 ? (total - done) / rate : 0.0);
+}
 
-    memcpy(&r, data + offset, sizeof(uint32_t));
+static void json_stage(session_t *s, const char *stage, int attempt, uint64_t start_ns, bool ok) {
+    json_event(s, "stage", "\"stage\": \"%s\", \"attempt\": %d, \"duration_ms\": %.3f, \"ok\": %s", stage, attempt, (monotonic_ns() - start_ns) / 1e6, ok ? "true" : "false");
+}
 
-    *resp = r;
-    return r == expected_result;
+// Set up a session with the debug, timing, trace and JSON options of the command line.
+void cli_session_init(session_t *s, const sn32_transport_t *transport, void *handle, const char *path, const char *prefix) {
+    session_init(s, transport, handle, path, prefix);
+    s->debug          = debug;
+    s->probe_interval = probe_interval;
+    s->range_checksum = range_checksum;
+    s->warning_pauses = true;
+    if (io_timeout_ms || session_timeout) session_set_deadlines(s, io_timeout_ms, session_timeout * 1000);
+    if (timing_enabled) s->stats = calloc(1, sizeof(session_stats_t));
+    if (trace_out) s->trace = trace_alloc();
+    if (json_out) {
+        s->stage_hook    = json_stage;
+        s->progress_hook = json_progress;
+    }
 }
 
-void write_buffer_32(unsigned char *data, uint32_t cmd) {
-    memcpy(data, &cmd, 4);
+// Every session ends here, successful or not, so the trace is written here.
+void cli_session_free(session_t *s) {
+    if (s->trace) {
+        pthread_mutex_lock(&trace_lock);
+        trace_write(trace_out, s->trace, session_label(s));
+        pthread_mutex_unlock(&trace_lock);
+    }
+    session_free(s);
 }
 
-void write_buffer_16(unsigned char *data, uint16_t cmd) {
-    memcpy(data, &cmd, 2);
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
 }
 
-uint16_t checksum16(const unsigned char *data, size_t size) {
-    uint16_t sum = 0;
-    size_t   i;
+static void rtt_write_json(FILE *f, const char *name, rtt_samples_t *rtt) {
+    uint64_t min = 0, sum = 0, p99 = 0;
 
-    for (i = 0; i + 1 < size; i += 2) {
-        uint16_t value = data[i] | (data[i + 1] << 8);
-        sum += value;
+    if (rtt->count > 0) {
+        qsort(rtt->samples, rtt->count, sizeof(uint64_t), compare_u64);
+        min = rtt->samples[0];
+        p99 = rtt->samples[(rtt->count * 99 + 99) / 100 - 1];
+        for (size_t i = 0; i < rtt->count; i++)
+            sum += rtt->samples[i];
     }
+    fprintf(f, "\"%s\": {\"count\": %zu, \"min_us\": %.1f, \"avg_us\": %.1f, \"p99_us\": %.1f}", name, rtt->count, min / 1e3, rtt->count ? sum / 1e3 / rtt->count : 0.0, p99 / 1e3);
+}
 
-    if (i < size) {
-        sum += data[i];
+// Write the --timing summary for the given sessions as JSON. Times are in ms
+// relative to program start.
+void timing_write_json(const char *file_name, session_t **sessions, int count) {
+    FILE *f = strcmp(file_name, "-") == 0 ? stdout : fopen(file_name, "w");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open timing output '%s'.\n", file_name);
+        return;
     }
 
-    return sum;
+    fprintf(f, "{\"version\": \"" PROJECT_VER "\", \"total_ms\": %.3f, \"devices\": [", (monotonic_ns() - timing_epoch_ns) / 1e6);
+    for (int i = 0; i < count; i++) {
+        session_t *s = sessions[i];
+        if (s->stats == NULL) continue;
+        fprintf(f, "%s\n  {\"device\": ", i ? "," : "");
+        json_write_string(f, s->path ? s->path : "default");
+        fprintf(f, ", \"chip\": %d, \"ok\": %s, \"reports\": %ld, \"events_dropped\": %d,\n   \"stages\": [", s->chip, s->ok ? "true" : "false", s->reports, s->stats->events_dropped);
+        for (int e = 0; e < s->stats->event_count; e++) {
+            stage_event_t *ev = &s->stats->events[e];
+            fprintf(f, "%s\n    {\"stage\": \"%s\", \"attempt\": %d, \"start_ms\": %.3f, \"duration_ms\": %.3f, \"ok\": %s}", e ? "," : "", ev->stage, ev->attempt, (ev->start_ns - timing_epoch_ns) / 1e6, (ev->end_ns - ev->start_ns) / 1e6, ev->ok ? "true" : "false");
+        }
+        fprintf(f, "],\n   \"report_rtt\": {");
+        rtt_write_json(f, "set", &s->stats->set_rtt);
+        fprintf(f, ", ");
+        rtt_write_json(f, "get", &s->stats->get_rtt);
+        fprintf(f, "}}");
+    }
+    fprintf(f, "\n]}\n");
+    if (f != stdout) fclose(f);
 }
 
-void print_data(const unsigned char *data, int length) {
-    for (int i = 0; i < length; i++) {
-        if (i % 16 == 0) {
-            if (i > 0) {
-                printf("\n");
-            }
-            printf("%04x: ", i); // Print address offset
+
+int str2buf(void *buffer, char *delim_str, char *string, int buflen, int bufelem_size) {
+    char *s;
+    int   pos = 0;
+    if (string == NULL) return -1;
+    memset(buffer, 0, buflen); // bzero() not defined on Win32?
+    while ((s = strtok(string, delim_str)) != NULL && pos < buflen) {
+        string = NULL;
+        switch (bufelem_size) {
+            case 1:
+                ((uint8_t *)buffer)[pos++] = (uint8_t)strtol(s, NULL, 0);
+                break;
+            case 2:
+                ((int *)buffer)[pos++] = (int)strtol(s, NULL, 0);
+                break;
         }
-        printf("%02x ", data[i]);
     }
-    printf("\n");
+    return pos;
 }
 
-bool is_known_isp_pid(unsigned int pid) {
-    size_t num_known_pids = sizeof(known_isp_pids) / sizeof(known_isp_pids[0]);
-    for (size_t i = 0; i < num_known_pids; ++i) {
-        if (pid == known_isp_pids[i]) {
-            return true;
-        }
+
+// Messages of the image preparation. While the worker started by
+// images_prepare_start runs, they are held in prep_output and printed after the
+// join, so they neither interleave with the session output nor get past the
+// --json redirection of stdout.
+static bool   prep_deferred   = false;
+static char  *prep_output     = NULL; // Each message is a stream number byte, the text and a NUL
+static size_t prep_output_len = 0;
+
+static void image_vprint(int stream_no, const char *fmt, va_list ap) {
+    char text[1024];
+    int  len = vsnprintf(text, sizeof(text), fmt, ap);
+
+    if (!prep_deferred) {
+        fputs(text, stream_no ? stderr : stdout);
+        return;
     }
-    return false;
+    if (len < 0) return;
+    if (len >= (int)sizeof(text)) len = sizeof(text) - 1;
+    char *grown = realloc(prep_output, prep_output_len + len + 2);
+    if (grown == NULL) return;
+    prep_output                  = grown;
+    prep_output[prep_output_len] = (char)stream_no;
+    memcpy(prep_output + prep_output_len + 1, text, len + 1);
+    prep_output_len += len + 2;
 }
 
-bool hid_set_feature(hid_device *dev, unsigned char *data, size_t length) {
-    if (length > REPORT_SIZE) {
-        fprintf(stderr, "ERROR: Report can't be more than %d bytes!! (Attempted: %zu bytes)\n", REPORT_SIZE, length);
-        return false;
+void image_log(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    image_vprint(0, fmt, ap);
+    va_end(ap);
+}
+
+void image_err(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    image_vprint(1, fmt, ap);
+    va_end(ap);
+}
+
+// Print the messages held back while the worker prepared the images.
+static void prep_output_flush(void) {
+    for (size_t pos = 0; pos < prep_output_len; pos += strlen(prep_output + pos + 1) + 2) {
+        FILE *stream = prep_output[pos] ? stderr : stdout;
+        fputs(prep_output + pos + 1, stream);
+        fflush(stream);
     }
+    free(prep_output);
+    prep_output     = NULL;
+    prep_output_len = 0;
+}
 
-    if (debug) {
-        printf("\n");
-        printf("Sending payload...\n");
-        print_data(data, length);
+long get_file_size(FILE *fp) {
+    if (fseek(fp, 0, SEEK_END) != 0) {
+        image_err("ERROR: Could not read EOF.\n");
+        return -1;
     }
 
-    // Set Report ID to 0 before passing to hidapi.
-    // Allocate a send buffer with an extra byte
-    unsigned char send_buf[REPORT_SIZE + 1];
+    long file_size = ftell(fp);
+    if (file_size == -1L) {
+        image_err("ERROR: File size calculation failed.\n");
+        return -1;
+    }
 
-    // Set the Report ID byte (0x00) at the start of the buffer
-    send_buf[0] = 0x00;
+    // Reset file position to the beginning
+    if (fseek(fp, 0, SEEK_SET) != 0) {
+        image_err("ERROR: File size cleanup failed.\n");
+        return -1;
+    }
 
-    // Copy the data into the buffer, starting from the second byte
-    memcpy(send_buf + 1, data, length);
+    return file_size;
+}
 
-    // Send the feature report using the send buffer
-    if (hid_send_feature_report(dev, send_buf, length + 1) < 0) {
-        fprintf(stderr, "ERROR: Error while writing command 0x%02x! Reason: %ls\n", data[0], hid_error(dev));
-        return false;
+
+void free_firmware_image(fw_image_t *image) {
+    if (image->mapping) {
+        image_cache_release(image);
+        return;
     }
+    image_alloc_free(image->data);
+    free(image->report_checksums);
+    image->data             = NULL;
+    image->report_checksums = NULL;
+    image->size             = 0;
+}
 
-    return true;
+void print_image_digest(const fw_image_t *image) {
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    sha256_hex(image->digest, hex);
+    image_log("Image SHA-256: %s\n", hex);
 }
-int sn32_decode_chip(unsigned char *data) {
-    // data[8-11] holds the bootloader version
-    if (data[8] == 32) {
-        printf("Sonix SN32 Detected.\n");
-        printf("\n");
-        printf("Checking variant... ");
-
-        int sn32_family;
-        switch (data[9]) {
-            case SN240:
-                switch (data[11]) {
-                    case 1:
-                        printf("220 Detected!\n");
-                        USER_ROM_SIZE  = USER_ROM_SIZE_SN32F220;
-                        USER_ROM_PAGES = USER_ROM_PAGES_SN32F220;
-                        MAX_FIRMWARE   = USER_ROM_SIZE_KB(USER_ROM_SIZE);
-                        CS0            = CS0_1;
-                        BLANK_CHECKSUM = 0xe000;
-                        sn32_family    = SN240;
-                        break;
-                    case 2:
-                        printf("230 Detected!\n");
-                        USER_ROM_SIZE  = USER_ROM_SIZE_SN32F230;
-                        USER_ROM_PAGES = USER_ROM_PAGES_SN32F230;
-                        MAX_FIRMWARE   = USER_ROM_SIZE_KB(USER_ROM_SIZE);
-                        CS0            = CS0_1;
-                        BLANK_CHECKSUM = 0xc000;
-                        sn32_family    = SN240;
-                        break;
-                    case 3:
-                        printf("240 Detected!\n");
-                        USER_ROM_SIZE  = USER_ROM_SIZE_SN32F240;
-                        USER_ROM_PAGES = USER_ROM_PAGES_SN32F240;
-                        MAX_FIRMWARE   = USER_ROM_SIZE_KB(USER_ROM_SIZE);
-                        CS0            = CS0_1;
-                        BLANK_CHECKSUM = 0x8000;
-                        sn32_family    = SN240;
-                        break;
-                    default:
-                        printf("\n");
-                        fprintf(stderr, "ERROR: Unsupported 2xx variant: %d.%d.%d, we don't support this chip.\n", data[9], data[10], data[11]);
-                        sn32_family = 0;
-                        break;
-                }
-                break;
-            case SN260:
-                printf("260 Detected!\n");
-                USER_ROM_SIZE  = USER_ROM_SIZE_SN32F260;
-                USER_ROM_PAGES = USER_ROM_PAGES_SN32F260;
-                MAX_FIRMWARE   = USER_ROM_SIZE_KB(USER_ROM_SIZE);
-                CS0            = CS0_0;
-                BLANK_CHECKSUM = 0x8000;
-                sn32_family    = SN260;
-                break;
-            case SN240B:
-                printf("240B Detected!\n");
-                USER_ROM_SIZE  = USER_ROM_SIZE_SN32F240B;
-                USER_ROM_PAGES = USER_ROM_PAGES_SN32F240B;
-                MAX_FIRMWARE   = USER_ROM_SIZE_KB(USER_ROM_SIZE);
-                CS0            = CS0_0;
-                BLANK_CHECKSUM = 0x8000;
-                sn32_family    = SN240B;
-                break;
-            case SN280:
-                printf("280 Detected!\n");
-                USER_ROM_SIZE  = USER_ROM_SIZE_SN32F280;
-                USER_ROM_PAGES = USER_ROM_PAGES_SN32F280;
-                MAX_FIRMWARE   = USER_ROM_SIZE_KB(USER_ROM_SIZE);
-                CS0            = CS0_1;
-                BLANK_CHECKSUM = 0x0000;
-                sn32_family    = SN280;
-                break;
-            case SN290:
-                printf("290 Detected!\n");
-                USER_ROM_SIZE  = USER_ROM_SIZE_SN32F290;
-                USER_ROM_PAGES = USER_ROM_PAGES_SN32F290;
-                MAX_FIRMWARE   = USER_ROM_SIZE_KB(USER_ROM_SIZE);
-                CS0            = CS0_1;
-                BLANK_CHECKSUM = 0x0000;
-                sn32_family    = SN290;
-                break;
-            case SN240C:
-                printf("240C Detected!\n");
-                USER_ROM_SIZE  = USER_ROM_SIZE_SN32F240C;
-                USER_ROM_PAGES = USER_ROM_PAGES_SN32F240C;
-                MAX_FIRMWARE   = USER_ROM_SIZE_KB(USER_ROM_SIZE);
-                CS0            = CS0_1;
-                BLANK_CHECKSUM = 0x0000;
-                sn32_family    = SN240C;
-                break;
-            default:
-                printf("\n");
-                fprintf(stderr, "ERROR: Unsupported bootloader version: %d.%d.%d, we don't support this chip.\n", data[9], data[10], data[11]);
-                sn32_family = 0;
-                break;
-        }
 
-        return sn32_family;
-    } else {
-        fprintf(stderr, "ERROR: Unsupported family version: %d, we don't support this chip.\n", data[8]);
-        return 0;
+// Write the records of a HEX, ELF or UF2 file into a blank flash sized for the
+// largest chip and cut out the part they cover, from the report containing the
+// lowest address. Returns the image, with room for padding behind it, or NULL.
+unsigned char *flatten_image(image_format_t format, const unsigned char *raw, long raw_size, long *size, uint32_t *load_address) {
+    long           flash_size = USER_ROM_SIZE_KB(USER_ROM_SIZE_SN32F290);
+    unsigned char *flash      = image_alloc(flash_size + QMK_OFFSET_DEFAULT + REPORT_SIZE);
+    uint32_t       start      = 0;
+    uint32_t       end        = 0;
+
+    if (flash == NULL) {
+        image_err("ERROR: Could not allocate %ld bytes for the firmware image.\n", flash_size);
+        return NULL;
+    }
+    memset(flash, 0xFF, flash_size);
+    if (!image_format_load(format, raw, raw_size, flash, flash_size, &start, &end)) {
+        image_alloc_free(flash);
+        return NULL;
     }
+    start -= start % REPORT_SIZE;
+    memmove(flash, flash + start, end - start);
+    *size         = end - start;
+    *load_address = start;
+    image_log("%s image: %ld bytes at 0x%05x\n", image_format_name(format), *size, start);
+    return flash;
 }
 
-bool sn32_check_isp_code_option(unsigned char *data) {
-    uint16_t received_code_option = (data[12] << 8) | data[13];
-    printf("Checking Code Option Table... Expected: 0x%04X Received: 0x%04X.\n", code_option, received_code_option);
-    if (received_code_option != code_option) {
-        printf("Updating Code Option Table from 0x%04X to 0x%04X\n", code_option, received_code_option);
-        code_option = received_code_option;
-        return false;
+// Load the firmware file into memory with a single read and apply the jumploader
+// and report size padding there. HEX, ELF and UF2 files are flattened first.
+// With the image cache enabled a previously prepared image is mapped instead.
+// Returns the prepared size, or -1 on failure.
+long prepare_file_to_flash(const char *file_name, bool flash_jumploader, fw_image_t *image) {
+    if (image_cache_dir && image_cache_load(image_cache_dir, file_name, flash_jumploader ? IMAGE_JUMPLOADER : 0, image)) {
+        image_log("\n");
+        image_log("Firmware size: %ld bytes, prepared image loaded from cache: %ld bytes\n", image->file_size, image->size);
+        print_image_digest(image);
+        return image->size;
     }
-    return true;
-}
 
-int sn32_get_code_security(unsigned char *data) {
-    cs_level          = -1;
-    uint16_t cs_value = (data[14] << 8) | data[15];
+    FILE *fp = fopen(file_name, "rb");
+    if (fp == NULL) {
+        image_err("ERROR: Could not open file (Does the file exist?).\n");
+        return -1;
+    }
 
-    switch (cs_value) {
-        case CS0_0:
-        case CS0_1:
-            cs_level = 0;
-            break;
-        case CS1:
-            cs_level = 1;
-            break;
-        case CS2:
-            cs_level = 2;
-            break;
-        case CS3:
-            cs_level = 3;
-            break;
-        default:
-            fprintf(stderr, "ERROR: Unsupported Code Security value: 0x%04X, we don't support this chip.\n", cs_value);
-            return cs_level;
+    long file_size = get_file_size(fp);
+    if (file_size == -1L) {
+        fclose(fp);
+        return -1;
     }
 
-    printf("Current Security level: CS%d. Code Security value: 0x%04X.\n", cs_level, cs_value);
-    return cs_level;
-}
+    if (file_size == 0) {
+        image_err("ERROR: File is empty.\n");
+        fclose(fp);
+        return -1;
+    }
+    image_log("\n");
+    image_log("File size: %ld bytes\n", file_size);
+
+    // Leave room behind the contents for the jumploader and report padding
+    long           capacity = (file_size > QMK_OFFSET_DEFAULT ? file_size : QMK_OFFSET_DEFAULT) + REPORT_SIZE;
+    unsigned char *data     = image_alloc(capacity);
+    if (data == NULL) {
+        image_err("ERROR: Could not allocate %ld bytes for the firmware image.\n", capacity);
+        fclose(fp);
+        return -1;
+    }
+    if (fread(data, 1, file_size, fp) != (size_t)file_size) {
+        image_err("ERROR: Could not read firmware file.\n");
+        fclose(fp);
+        image_alloc_free(data);
+        return -1;
+    }
+    fclose(fp);
 
-bool hid_get_feature(hid_device *dev, unsigned char *data, size_t data_size, uint32_t command) {
-    clear_buffer(data, data_size);
+    long fw_size        = file_size;
+    image->flags        = 0;
+    image->load_address = 0;
+    image_format_t format = image_format_detect(data, file_size);
+    if (format != IMAGE_FORMAT_BIN) {
+        // The digest is of the file, which flattening replaces
+        sha256(data, file_size, image->digest);
+        unsigned char *flat = flatten_image(format, data, file_size, &fw_size, &image->load_address);
+        image_alloc_free(data);
+        if (flat == NULL) return -1;
+        data = flat;
+        image->flags |= IMAGE_LOAD_ADDRESS;
+    }
 
-    uint8_t attempt_no = 1;
-    while (attempt_no <= MAX_ATTEMPTS) {
-        clear_buffer(data, data_size);
+    long padded_file_size = fw_size;
 
-        // Attempt to get the feature report
-        int res = hid_get_feature_report(dev, data, data_size + 1);
+    // If jumploader is not 0x200 in length, pad it with zeroes
+    if (flash_jumploader && padded_file_size < QMK_OFFSET_DEFAULT) {
+        image_log("Warning: jumploader binary doesn't have a size of: 0x%04x bytes.\n", QMK_OFFSET_DEFAULT);
+        image_log("Padding jumploader image to: 0x%04x.\n", QMK_OFFSET_DEFAULT);
+        padded_file_size = QMK_OFFSET_DEFAULT;
+    }
 
-        if (res == (data_size + 1)) {
-            // Shift the data buffer to remove the Report ID
-            memmove(data, data + 1, res - 1);
+    // Adjust image size to fit in the HID report
+    if (padded_file_size % REPORT_SIZE != 0) {
+        image_log("File size must be adjusted to fit in the HID report.\n");
+        image_log("File size before padding: %ld bytes\n", padded_file_size);
+        padded_file_size += REPORT_SIZE - (padded_file_size % REPORT_SIZE);
+        image_log("File size after padding: %ld bytes\n", padded_file_size);
+    }
 
-            if (debug) {
-                printf("\n");
-                printf("Received payload...\n");
-                print_data(data, res - 1);
-            }
+    memset(data + fw_size, 0, padded_file_size - fw_size);
 
-            // Check the status directly in the data buffer
-            unsigned int cmdreply = *((unsigned int *)(data));
-            unsigned int status   = *((unsigned int *)(data + 4));
-            if (cmdreply == CMD_VERIFY(command)) {
-                if (status != CMD_ACK) {
-                    fprintf(stderr, "ERROR: Invalid response status: 0x%08x, expected 0x%08x for command 0x%02x.\n", status, CMD_ACK, command & 0xFF);
-                    return false;
-                }
+    image->data      = data;
+    image->size      = padded_file_size;
+    image->file_size = fw_size;
+    // A binary's digest comes out of the same pass as the checksums
+    if (!image_finalize(image, flash_jumploader, format == IMAGE_FORMAT_BIN ? file_size : 0)) {
+        image_err("ERROR: Could not allocate the report checksum table.\n");
+        free_firmware_image(image);
+        return -1;
+    }
+    print_image_digest(image);
+    if (image_cache_dir) image_cache_store(image_cache_dir, file_name, image);
+    return padded_file_size;
+}
 
-                // Success
-                return true;
-            } else {
-                fprintf(stderr, "ERROR: Invalid response command: 0x%08x, expected command 0x%02x.\n", cmdreply, command & 0xFF);
-                if ((cmdreply == CMD_VERIFY(CMD_ENABLE_PROGRAM)) && (status == CMD_ACK)) {
-                    printf("Device progam pending. Please power cycle the device.\n");
-                }
-                return false;
-            }
-        } else if (res < 0) {
-            // Error condition, such as abort pipe
-            fprintf(stderr, "ERROR: Device busy or failed to get feature report, retrying...\n");
-            attempt_no++;
-            usleep(RETRY_DELAY_MS * 1000); // Delay before retrying
-        } else {
-            // Incorrect response length
-            fprintf(stderr, "ERROR: Invalid response length for command 0x%02x: got %d, expected %zu.\n", command & 0xFF, res, data_size + 1);
-            return false;
-        }
+char *get_full_path(const char *file_name) {
+    char *full_path = NULL;
+
+#ifdef _WIN32
+    char buffer[MAX_PATH];
+    if (GetFullPathName(file_name, MAX_PATH, buffer, NULL) != 0) {
+        full_path = strdup(buffer);
+    } else {
+        fprintf(stderr, "ERROR: Could not resolve full path for file: '%s'\n", file_name);
+    }
+#else
+    char buffer[PATH_MAX];
+    if (realpath(file_name, buffer) != NULL) {
+        full_path = strdup(buffer);
+    } else {
+        fprintf(stderr, "ERROR: Could not resolve full path for file: '%s'\n", file_name);
     }
+#endif
 
-    // After retries failed
-    fprintf(stderr, "ERROR: Failed to get feature report for command 0x%02x after %d retries.\n", command & 0xFF, attempt_no);
-    return false;
+    return full_path;
 }
 
-bool send_magic_command(hid_device *dev, const uint32_t *command) {
-    unsigned char buf[REPORT_SIZE];
+bool manifest_load_images(flash_options_t *opts);
 
-    clear_buffer(buf, sizeof(buf));
-    write_buffer_32(buf, command[0]);
-    write_buffer_32(buf + sizeof(uint32_t), command[1]);
-    uint8_t attempt_no = 1;
-    while (!hid_set_feature(dev, buf, REPORT_SIZE) && attempt_no <= MAX_ATTEMPTS) // Try {MAX ATTEMPTS} to init flash.
-    {
-        printf("Failed to greet device, re-trying in 1 second. Attempt %d of %d...\n", attempt_no, MAX_ATTEMPTS);
-        sleep(1);
-        attempt_no++;
+// Prepare the firmware image and take the flash offset from it when the file
+// carries its load address.
+bool load_firmware_image(flash_options_t *opts) {
+    if (opts->steps) return manifest_load_images(opts);
+    if (prepare_file_to_flash(opts->file_name, opts->jumploader, &opts->image) < 0) return false;
+    if (!(opts->image.flags & IMAGE_LOAD_ADDRESS)) return true;
+    if (opts->offset_given && opts->offset != (long)opts->image.load_address) {
+        image_err("ERROR: offset 0x%04lx doesn't match the image load address 0x%04x.\n", opts->offset, opts->image.load_address);
+        return false;
     }
-    if (attempt_no > MAX_ATTEMPTS) return false;
-    clear_buffer(buf, sizeof(buf));
+    opts->offset = opts->image.load_address;
+    image_log("Flashing at the image load address 0x%04lx.\n", opts->offset);
     return true;
 }
 
-bool reboot_to_bootloader(hid_device *dev, char *oem_option) {
-    uint32_t sonix_reboot[2] = {0x5AA555AA, 0xCC3300FF};
-    uint32_t hfd_reboot[2]   = {0x5A8942AA, 0xCC6271FF};
+static bool parse_address(const char *text, long *value) {
+    char *endptr;
+
+    errno  = 0;
+    *value = strtol(text, &endptr, 0);
+    return errno == 0 && *endptr == '\0' && *value >= 0;
+}
+
+// Parse one manifest step, "oem-reboot <option>", "cs-reset", "erase [start end]",
+// "program <file> [offset] [jumploader]", "verify <file> [offset]" or "reboot",
+// and append it. where names its source in errors.
+bool manifest_add_step(const char *text, const char *where) {
+    char  line[1024];
+    char *args[5];
+    int   argn = 0;
 
-    if (oem_option == NULL) {
-        printf("ERROR: reboot option cannot be null.\n");
+    if (snprintf(line, sizeof(line), "%s", text) >= (int)sizeof(line)) {
+        fprintf(stderr, "ERROR: %s: step is too long.\n", where);
         return false;
     }
-    if (strcmp(oem_option, "sonix") == 0 || strcmp(oem_option, "evision") == 0) {
-        return send_magic_command(dev, sonix_reboot);
-    } else if (strcmp(oem_option, "hfd") == 0) {
-        return send_magic_command(dev, hfd_reboot);
+    for (char *tok = strtok(line, " \t\r\n"); tok && argn < 5; tok = strtok(NULL, " \t\r\n"))
+        args[argn++] = tok;
+    if (argn == 0) return true;
+    if (manifest_step_count == MAX_MANIFEST_STEPS) {
+        fprintf(stderr, "ERROR: %s: more than %d manifest steps.\n", where, MAX_MANIFEST_STEPS);
+        return false;
     }
-    printf("ERROR: unsupported reboot option selected.\n");
-    return false;
-}
 
-bool protocol_init(hid_device *dev, bool oem_reboot, char *oem_option) {
-    unsigned char buf[REPORT_SIZE];
-    uint32_t      resp = 0;
-    chip               = 0;
-    // 0) Request bootloader reboot
-    if (oem_reboot) {
-        printf("Requesting bootloader reboot...\n");
-        if (reboot_to_bootloader(dev, oem_option))
-            printf("Bootloader reboot request success.\n");
-        else {
-            printf("ERROR: Bootloader reboot request failed.\n");
+    manifest_step_t *step = &manifest_steps[manifest_step_count];
+    bool             ok   = true;
+    memset(step, 0, sizeof(*step));
+    snprintf(step->text, sizeof(step->text), "%s", args[0]);
+    for (int i = 1; i < argn; i++) {
+        size_t len = strlen(step->text);
+        snprintf(step->text + len, sizeof(step->text) - len, " %s", args[i]);
+    }
+
+    if (strcmp(args[0], "oem-reboot") == 0 && argn == 2) {
+        step->op = STEP_OEM_REBOOT;
+        snprintf(step->option, sizeof(step->option), "%s", args[1]);
+        if (manifest_step_count != 0) {
+            fprintf(stderr, "ERROR: %s: oem-reboot has to be the first step.\n", where);
             return false;
         }
+    } else if (strcmp(args[0], "cs-reset") == 0 && argn == 1) {
+        step->op = STEP_CS_RESET;
+    } else if (strcmp(args[0], "erase") == 0 && (argn == 1 || argn == 3)) {
+        step->op = STEP_ERASE;
+        ok       = argn == 1 || (parse_address(args[1], &step->start) && parse_address(args[2], &step->end) && step->start < step->end);
+    } else if ((strcmp(args[0], "program") == 0 && argn >= 2 && argn <= 4) || (strcmp(args[0], "verify") == 0 && argn >= 2 && argn <= 3)) {
+        step->op               = args[0][0] == 'p' ? STEP_PROGRAM : STEP_VERIFY;
+        step->image.jumploader = strcmp(args[argn - 1], "jumploader") == 0 && argn > 2;
+        int offset_at          = step->image.jumploader ? argn - 2 : argn - 1;
+        if (offset_at >= 2) {
+            ok                       = parse_address(args[offset_at], &step->image.offset);
+            step->image.offset_given = true;
+        }
+        if ((argn == 4 && !step->image.jumploader) || (step->image.jumploader && step->op == STEP_VERIFY)) ok = false;
+        if (ok) {
+            step->image.file_name = get_full_path(args[1]);
+            if (step->image.file_name == NULL) return false;
+        }
+    } else if (strcmp(args[0], "reboot") == 0 && argn == 1) {
+        step->op = STEP_REBOOT;
+    } else {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "ERROR: %s: invalid step '%s'.\n", where, step->text);
+        return false;
     }
+    manifest_step_count++;
+    return true;
+}
 
-    // 01) Initialize
-    printf("\n");
-    printf("Fetching flash version...\n");
+// Read manifest steps from a file, one per line. '#' starts a comment.
+bool manifest_load(const char *file_name) {
+    char  line[1024];
+    char  where[1024 + 16];
+    int   line_no = 0;
+    FILE *fp      = fopen(file_name, "r");
 
-    clear_buffer(buf, REPORT_SIZE);
-    buf[0] = CMD_GET_FW_VERSION;
-    write_buffer_16(buf + 1, CMD_BASE);
-    write_buffer_16(buf + 4, code_option);
-    uint8_t attempt_no = 1;
-    while (!hid_set_feature(dev, buf, REPORT_SIZE) && attempt_no <= MAX_ATTEMPTS) // Try {MAX ATTEMPTS} to init flash.
-    {
-        printf("Flash failed to fetch flash version, re-trying in 3 seconds. Attempt %d of %d...\n", attempt_no, MAX_ATTEMPTS);
-        sleep(3);
-        attempt_no++;
-    }
-    if (attempt_no > MAX_ATTEMPTS) return false;
-
-    if (!hid_get_feature(dev, buf, REPORT_SIZE, CMD_GET_FW_VERSION)) return false;
-    chip = sn32_decode_chip(buf);
-    if (chip == 0) return false;
-    cs_level = sn32_get_code_security(buf);
-    if (cs_level < 0) return false;
-    if (!sn32_check_isp_code_option(buf)) return false;
-
-    bool reboot_fail = !read_response_32(buf, 0, 0, &resp);
-    bool init_fail   = !read_response_32(buf, 0, CMD_VERIFY(CMD_GET_FW_VERSION), &resp);
-    if (init_fail) {
-        if (oem_reboot && reboot_fail) {
-            fprintf(stderr, "ERROR: Failed to initialize: response cmd is 0x%08x, expected 0x%08x.\n", resp, 0);
-        } else
-            fprintf(stderr, "ERROR: Failed to initialize: response cmd is 0x%08x, expected 0x%08x.\n", resp, CMD_VERIFY(CMD_GET_FW_VERSION));
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: Could not open manifest '%s'.\n", file_name);
         return false;
     }
+    while (fgets(line, sizeof(line), fp)) {
+        line_no++;
+        line[strcspn(line, "#")] = '\0';
+        snprintf(where, sizeof(where), "%s:%d", file_name, line_no);
+        if (!manifest_add_step(line, where)) {
+            fclose(fp);
+            return false;
+        }
+    }
+    fclose(fp);
     return true;
 }
 
-bool protocol_code_option_check(hid_device *dev) {
-    unsigned char buf[REPORT_SIZE];
-    // 02) Prepare for Code Option Table check
-    printf("\n");
-    printf("Checking Code Option Table...\n");
-    clear_buffer(buf, REPORT_SIZE);
-    buf[0] = CMD_COMPARE_CODE_OPTION;
-    write_buffer_16(buf + 1, CMD_BASE);
-    write_buffer_16(buf + 4, code_option);
-    if (!hid_set_feature(dev, buf, REPORT_SIZE)) return false;
-    clear_buffer(buf, REPORT_SIZE);
+// Prepare the images of every program and verify step.
+bool manifest_load_images(flash_options_t *opts) {
+    for (int i = 0; i < opts->step_count; i++) {
+        flash_options_t *image = &opts->steps[i].image;
+        if (image->file_name == NULL || image->image.data != NULL) continue;
+        if (!load_firmware_image(image)) return false;
+    }
     return true;
 }
 
-bool protocol_code_option_set(hid_device *dev, uint16_t code_option, uint16_t cs_value) {
-    unsigned char buf[REPORT_SIZE];
-    // 03) Set Code Option Table
-    printf("\n");
-    printf("Setting Code Option Table 0x%04x with Code Security value 0x%04X...\n", code_option, cs_value);
-    clear_buffer(buf, REPORT_SIZE);
-    buf[0] = CMD_SET_ENCRYPTION_ALGO;
-    write_buffer_16(buf + 1, CMD_BASE);
-    write_buffer_16(buf + 4, code_option);
-    write_buffer_16(buf + 6, cs_value);
-    if (!hid_set_feature(dev, buf, REPORT_SIZE)) return false;
-    if (!hid_get_feature(dev, buf, REPORT_SIZE, CMD_SET_ENCRYPTION_ALGO)) return false;
-    clear_buffer(buf, REPORT_SIZE);
-    return true;
+// Wait for the worker started by images_prepare_start and print what it held back.
+static void images_prepare_join(flash_options_t *opts) {
+    if (!opts->prep_started) return;
+    pthread_join(opts->prep_thread, NULL);
+    opts->prep_started = false;
+    prep_deferred      = false;
+    prep_output_flush();
 }
 
-bool erase_flash(hid_device *dev, uint16_t page_start, uint16_t page_end, uint16_t blank_checksum) {
-    unsigned char buf[REPORT_SIZE];
-    uint16_t      resp = 0;
-    // 04) Erase flash
-    printf("\n");
-    printf("Erasing flash from page %u to page %u...\n", page_start, page_end);
-    clear_buffer(buf, REPORT_SIZE);
-    buf[0] = CMD_ENABLE_ERASE;
-    write_buffer_16(buf + 1, CMD_BASE);
-    write_buffer_16(buf + 4, page_start);
-    write_buffer_16(buf + 8, page_end);
-    if (!hid_set_feature(dev, buf, REPORT_SIZE)) return false;
-    if (!hid_get_feature(dev, buf, REPORT_SIZE, CMD_ENABLE_ERASE)) return false;
-    if (read_response_16(buf, 8, blank_checksum, &resp)) {
-        printf("Flash erase verified. \n");
-        return true;
-    } else {
-        fprintf(stderr, "ERROR: Failed to verify flash erase: response is 0x%04x, expected 0x%04x.\n", resp, blank_checksum);
-        return false;
+void free_flash_images(flash_options_t *opts) {
+    images_prepare_join(opts);
+    free_firmware_image(&opts->image);
+    for (int i = 0; i < opts->step_count; i++) {
+        free_firmware_image(&opts->steps[i].image.image);
+        free(opts->steps[i].image.file_name);
+        opts->steps[i].image.file_name = NULL;
     }
-    clear_buffer(buf, REPORT_SIZE);
-    return false;
 }
 
-bool protocol_reboot_user(hid_device *dev) {
-    unsigned char buf[REPORT_SIZE];
-    // 08) Reboot to User Mode
-    printf("\n");
-    printf("Flashing done. Rebooting.\n");
-    clear_buffer(buf, REPORT_SIZE);
-    buf[0] = CMD_RETURN_USER_MODE;
-    write_buffer_16(buf + 1, CMD_BASE);
-    if (!hid_set_feature(dev, buf, REPORT_SIZE)) return false;
-    clear_buffer(buf, REPORT_SIZE);
-    return true;
+static void *images_prepare_worker(void *arg) {
+    flash_options_t *opts = arg;
+    opts->prep_ok         = load_firmware_image(opts);
+    return NULL;
 }
 
-bool flash(hid_device *dev, long offset, const char *file_name, long fw_size, bool skip_offset_check) {
-    FILE *firmware = fopen(file_name, "rb");
-    if (firmware == NULL) {
-        fprintf(stderr, "ERROR: Could not open firmware file (Does the file exist?).\n");
-        return false;
+// Read, pad, checksum and check the images on a worker thread, in parallel with
+// opening the device, the OEM reboot and the bootloader init. Its messages are
+// printed once it has been joined.
+void images_prepare_start(flash_options_t *opts) {
+    prep_deferred      = true;
+    opts->prep_started = pthread_create(&opts->prep_thread, NULL, images_prepare_worker, opts) == 0;
+    prep_deferred      = opts->prep_started;
+}
+
+// Make sure the images are prepared: wait for the worker when one was started,
+// otherwise prepare them now.
+bool images_ready(flash_options_t *opts) {
+    if (opts->prep_started) {
+        images_prepare_join(opts);
+        if (!opts->prep_ok) return false;
     }
+    if (opts->image.data != NULL) return true;
+    return load_firmware_image(opts);
+}
 
-    unsigned char buf[REPORT_SIZE];
-    uint32_t      resp = 0;
+// Load the firmware images shared by the sessions unless that already happened.
+// With a worker preparing them, the stage only covers the time spent waiting.
+bool session_prepare_image(session_t *s, flash_options_t *opts) {
+    if (!opts->prep_started && opts->image.data != NULL) return true;
 
-    if (chip == SN260 && !flash_jumploader && offset == 0) // Failsafe when flashing a 268 w/o jumploader and offset
-    {
-        printf("Warning: 26X flashing without offset.\n");
-        printf("Warning: POTENTIALLY DANGEROUS OPERATION.\n");
-        sleep(3);
-        if (skip_offset_check) {
-            printf("Warning: Flashing 26X without offset. Operation will continue after 10s...\n");
-            sleep(10);
-        } else {
-            printf("Fail safing to offset 0x%04x\n", QMK_OFFSET_DEFAULT);
-            offset = QMK_OFFSET_DEFAULT;
+    uint64_t start = monotonic_ns();
+    bool     ok    = images_ready(opts);
+    stage_record(s, "prepare_image", 1, start, ok);
+    if (!ok) session_err(s, "ERROR: File preparation failed.\n");
+    return ok;
+}
+
+bool sanity_check_image(session_t *s, flash_options_t *opts) {
+    if (opts->jumploader) return sanity_check_jumploader_firmware(s, &opts->image);
+    return sanity_check_firmware(s, &opts->image, opts->offset);
+}
+
+// Wait for the images and check every one of them against the chip, those of all
+// manifest steps included, so a bad image is refused before the first command
+// that changes the device.
+static bool check_images(session_t *s, flash_options_t *opts) {
+    if (!session_prepare_image(s, opts)) return false;
+    if (opts->steps == NULL) return sanity_check_image(s, opts);
+    for (int i = 0; i < opts->step_count; i++) {
+        manifest_step_t *step = &opts->steps[i];
+        if ((step->op == STEP_PROGRAM || step->op == STEP_VERIFY) && !sanity_check_image(s, &step->image)) {
+            session_err(s, "ERROR: Step %d (%s) has an invalid image.\n", i + 1, step->text);
+            return false;
         }
     }
+    return true;
+}
 
-    // 05) Enable program
-    printf("\n");
-    printf("Enabling Program mode...\n");
-
-    clear_buffer(buf, REPORT_SIZE);
-    buf[0] = CMD_ENABLE_PROGRAM;
-    write_buffer_16(buf + 1, CMD_BASE);
-    write_buffer_32(buf + 4, (uint32_t)offset);
-    write_buffer_32(buf + 8, (uint32_t)(fw_size / REPORT_SIZE));
-    if (!hid_set_feature(dev, buf, REPORT_SIZE)) return false;
-
-    if (!hid_get_feature(dev, buf, REPORT_SIZE, CMD_ENABLE_PROGRAM)) return false;
-    clear_buffer(buf, REPORT_SIZE);
-
-    // 06) Flash
-    printf("Flashing device, please wait...\n");
-
-    size_t   bytes_read = 0;
-    uint16_t checksum   = 0;
-    uint32_t last_chunk = 0;
-    clear_buffer(buf, REPORT_SIZE);
-    while ((bytes_read = fread(buf, 1, REPORT_SIZE, firmware)) > 0) {
-        if (bytes_read < REPORT_SIZE) {
-            fprintf(stderr, "WARNING: Read %zu bytes, expected %d bytes.\n", bytes_read, REPORT_SIZE);
-        }
-        checksum += checksum16(buf, bytes_read);
+// Compare the device with the image over the range a flash would write, then
+// return the device to user mode. Nothing is erased or programmed.
+bool audit_session(session_t *s, flash_options_t *opts) {
+    if (!session_prepare_image(s, opts) || !sanity_check_image(s, opts)) return false;
+
+    long offset = opts->offset;
+    if (s->chip == SN260 && !opts->jumploader && offset == 0 && !opts->no_offset_check) offset = QMK_OFFSET_DEFAULT;
+    if (s->cs_level != 0) session_log(s, "Warning: Code Security is CS%d, the device may not report checksums.\n", s->cs_level);
+
+    uint64_t start = monotonic_ns();
+    bool     ok    = verify_image(s, offset, &opts->image);
+    stage_record(s, "verify", 1, start, ok);
+    session_log(s, ok ? "Device matches the firmware.\n" : "Device does not match the firmware.\n");
+    start = monotonic_ns();
+    stage_record(s, "reboot_user", 1, start, protocol_reboot_user(s));
+    return ok;
+}
 
-        // Capture the last 4 bytes of this buffer for last_chunk
-        if (bytes_read >= sizeof(uint32_t)) {
-            memcpy(&last_chunk, buf + (bytes_read - sizeof(uint32_t)), sizeof(uint32_t));
-        } else {
-            memcpy(&last_chunk, buf, bytes_read);
-        }
+// Name of the session's device in the --resume journal, false when there is no
+// journal or the device has no path.
+static bool journal_device(session_t *s, char *device, size_t size) {
+    if (journal_dir == NULL || s->path == NULL) return false;
+    device_topology(s->path, device, size);
+    return true;
+}
 
-        if (!hid_set_feature(dev, buf, bytes_read)) return false;
+// Image bytes the device accepted in an earlier run of the same flash that broke
+// off, 0 when there is nothing to resume.
+static long journal_resume_point(session_t *s, flash_options_t *opts) {
+    char            device[TOPOLOGY_SIZE];
+    journal_entry_t entry;
 
-        clear_buffer(buf, REPORT_SIZE);
+    if (!journal_device(s, device, sizeof(device)) || !journal_load(journal_dir, device, &entry)) return 0;
+    if (memcmp(entry.digest, opts->image.digest, SHA256_DIGEST_SIZE) != 0 || entry.offset != opts->offset || entry.size != opts->image.size) {
+        session_log(s, "Journal entry is for another image, flashing from the start.\n");
+        return 0;
     }
-    printf("Flashed File Checksum: 0x%04x\n", checksum);
-    clear_buffer(buf, REPORT_SIZE);
-    fclose(firmware);
+    session_log(s, "Journal: %ld of %ld bytes were written by an interrupted run.\n", entry.done, entry.size);
+    return entry.done;
+}
 
-    // 07) Verify flash complete
-    printf("\n");
-    printf("Verifying flash completion...\n");
-    if (!hid_get_feature(dev, buf, REPORT_SIZE, CMD_ENABLE_PROGRAM)) return false;
-    if (read_response_32(buf, LAST_CHUNK_OFFSET, last_chunk, &resp)) {
-        printf("Flash completion verified. \n");
-        uint16_t resp_16 = (uint16_t)resp;
-        if (read_response_16(buf, 8, checksum, &resp_16)) {
-            printf("Flash Verification Checksum: OK!\n");
-            return true;
-        } else {
-            if (offset != 0) {
-                printf("Warning: offset 0x%04lx requested. Flash Verification Checksum disabled.\n", offset);
-                return true;
-            }
-            fprintf(stderr, "ERROR:Flash Verification Checksum: FAILED! response is 0x%04x, expected 0x%04x.\n", resp_16, checksum);
+// Record how far a failed flash got, or forget the device once it is flashed.
+static void journal_update(session_t *s, flash_options_t *opts, bool flashed) {
+    char device[TOPOLOGY_SIZE];
+
+    if (!journal_device(s, device, sizeof(device))) return;
+    if (flashed || s->programmed <= 0) {
+        journal_clear(journal_dir, device);
+        return;
+    }
+    journal_entry_t entry = {.offset = opts->offset, .size = opts->image.size, .done = s->programmed};
+    memcpy(entry.digest, opts->image.digest, SHA256_DIGEST_SIZE);
+    if (journal_store(journal_dir, device, &entry)) session_log(s, "Journal: recorded %ld of %ld bytes written, run again with --resume to continue.\n", entry.done, entry.size);
+}
+
+// Bring a protected chip down to CS0 so it can be erased and programmed.
+static bool reset_code_security(session_t *s) {
+    if (s->cs_level == 0) return true;
+    session_log(s, "Resetting Code Security from CS%d to CS%d...\n", s->cs_level, 0);
+    uint64_t start = monotonic_ns();
+    bool     ok    = protocol_code_option_set(s, s->code_option, s->cs0);
+    stage_record(s, "cs_reset", 1, start, ok);
+    if (!ok) return false;
+    wait_settle(s, s->timing->cs_reset_ms);
+    return true;
+}
+
+// Erase step of a manifest: the given range, or the pages every program step
+// occupies when none was given.
+static bool manifest_erase(session_t *s, flash_options_t *opts, manifest_step_t *step) {
+    long start = step->start, end = step->end;
+    bool ok;
+
+    if (s->chip == SN240B || s->chip == SN260) {
+        session_log(s, "Nothing to erase, this chip erases while programming.\n");
+        return true;
+    }
+    if (end == 0) {
+        start = LONG_MAX;
+        for (int i = 0; i < opts->step_count; i++) {
+            const flash_options_t *image = &opts->steps[i].image;
+            if (opts->steps[i].op != STEP_PROGRAM) continue;
+            if (image->offset < start) start = image->offset;
+            if (image->offset + image->image.size > end) end = image->offset + image->image.size;
+        }
+        if (end == 0) {
+            session_err(s, "ERROR: erase without a range needs a program step.\n");
             return false;
         }
-        return false;
+        ok = erase_image_range(s, start, end - start);
     } else {
-        fprintf(stderr, "ERROR: Failed to verify flash completion: response is 0x%08x, expected 0x%08x.\n", resp, last_chunk);
-        return false;
+        if (start % s->page_size != 0 || end % s->page_size != 0 || end > s->max_firmware) {
+            session_err(s, "ERROR: erase range 0x%05lx-0x%05lx has to be aligned to %ld byte pages within the 0x%05lx bytes of flash.\n", start, end, s->page_size, s->max_firmware);
+            return false;
+        }
+        ok = erase_flash(s, start / s->page_size, end / s->page_size, blank_checksum_range(end - start));
     }
-    return false;
+    if (ok) wait_settle(s, s->timing->erase_ms);
+    return ok;
 }
 
-int str2buf(void *buffer, char *delim_str, char *string, int buflen, int bufelem_size) {
-    char *s;
-    int   pos = 0;
-    if (string == NULL) return -1;
-    memset(buffer, 0, buflen); // bzero() not defined on Win32?
-    while ((s = strtok(string, delim_str)) != NULL && pos < buflen) {
-        string = NULL;
-        switch (bufelem_size) {
-            case 1:
-                ((uint8_t *)buffer)[pos++] = (uint8_t)strtol(s, NULL, 0);
+// Run the steps of a manifest, all within the session's single init. The images
+// have been checked by check_images already.
+static bool run_manifest(session_t *s, flash_options_t *opts) {
+    for (int i = 0; i < opts->step_count; i++) {
+        manifest_step_t *step  = &opts->steps[i];
+        flash_options_t *image = &step->image;
+        uint64_t         start = monotonic_ns();
+        bool             ok    = true;
+
+        session_log(s, "\n");
+        session_log(s, "Step %d of %d: %s\n", i + 1, opts->step_count, step->text);
+        switch (step->op) {
+            case STEP_OEM_REBOOT: // Done by protocol_init
                 break;
-            case 2:
-                ((int *)buffer)[pos++] = (int)strtol(s, NULL, 0);
+            case STEP_CS_RESET:
+                ok = reset_code_security(s);
+                break;
+            case STEP_ERASE:
+                ok = manifest_erase(s, opts, step);
+                break;
+            case STEP_PROGRAM:
+                ok = flash(s, image->offset, &image->image, image->no_offset_check, false);
                 break;
+            case STEP_VERIFY:
+                ok = verify_image(s, image->offset, &image->image);
+                break;
+            case STEP_REBOOT:
+                wait_settle(s, s->timing->reboot_ms);
+                ok = protocol_reboot_user(s);
+                stage_record(s, "reboot_user", 1, start, ok);
+                break;
+        }
+        if (!ok) {
+            session_err(s, "ERROR: Step %d (%s) failed.\n", i + 1, step->text);
+            return false;
         }
     }
-    return pos;
+    session_log(s, "Manifest done.\n");
+    return true;
 }
 
-bool sanity_check_firmware(long fw_size, long offset) {
-    if (fw_size + offset > MAX_FIRMWARE) {
-        fprintf(stderr, "ERROR: Firmware is too large too flash: 0x%08lx max allowed is 0x%08lx.\n", fw_size, MAX_FIRMWARE - offset);
-        return false;
+static bool run_session_stages(session_t *s, flash_options_t *opts);
+
+// Run a full flash sequence on an already opened device. Failures are reported
+// through the session and returned; the caller owns the handle.
+bool run_session(session_t *s, flash_options_t *opts) {
+    uint64_t start = monotonic_ns();
+    bool     ok    = run_session_stages(s, opts);
+
+    if (json_out) {
+        char checksums[64] = "\"image_checksum\": null, \"device_checksum\": null";
+        char timeout[48]   = "null";
+        if (s->checksum_read) snprintf(checksums, sizeof(checksums), "\"image_checksum\": \"0x%04x\", \"device_checksum\": \"0x%04x\"", s->image_checksum, s->device_checksum);
+        if (s->timeout_stage) snprintf(timeout, sizeof(timeout), "\"%s\"", s->timeout_stage);
+        json_event(s, "result", "\"ok\": %s, \"chip\": %d, \"rom_kb\": %u, \"cs_level\": %d, \"code_option\": \"0x%04x\", %s, \"reports\": %ld, \"timeout\": %s, \"duration_ms\": %.3f", ok ? "true" : "false", s->chip, s->user_rom_size, s->cs_level, s->code_option, checksums, s->reports, timeout, (monotonic_ns() - start) / 1e6);
     }
-    if (fw_size < MIN_FIRMWARE) {
-        fprintf(stderr, "ERROR: Firmware is too small.");
-        return false;
+    return ok;
+}
+
+static bool run_session_stages(session_t *s, flash_options_t *opts) {
+    uint8_t  attempt_no = 1;
+    uint64_t start      = monotonic_ns();
+    bool     ok         = protocol_init(s, opts->reboot_requested, opts->reboot_opt);
+    stage_record(s, "init", attempt_no, start, ok);
+    while (!ok && !s->timeout_stage && attempt_no <= MAX_ATTEMPTS) {
+        session_log(s, "Device failed to init, re-trying in 3 seconds. Attempt %d of %d...\n", attempt_no, MAX_ATTEMPTS);
+        if (!session_sleep(s, 3000, "init")) return false;
+        attempt_no++;
+        start = monotonic_ns();
+        ok    = protocol_init(s, opts->reboot_requested, opts->reboot_opt);
+        stage_record(s, "init", attempt_no, start, ok);
+    }
+    if (!ok) return false;
+    wait_settle(s, s->timing->init_ms);
+    if (opts->verify_only) return audit_session(s, opts);
+    if (s->chip != SN240B && s->chip != SN260) {
+        start = monotonic_ns();
+        ok    = protocol_code_option_check(s);
+        stage_record(s, "code_option_check", 1, start, ok);
+        if (!ok) return false;
+        wait_settle(s, s->timing->code_option_ms);
+    }
+    // Nothing is changed on the device unless every image is good
+    if (!check_images(s, opts)) return false;
+    if (opts->steps) {
+        if (opts->trim) session_log(s, "Trimming skipped, it doesn't apply to manifest steps.\n");
+        return run_manifest(s, opts);
+    }
+    if (!reset_code_security(s)) return false;
+
+    bool full_flash = true;
+    if (opts->differential) {
+        bool needs_full_flash = false;
+        if (flash_differential(s, opts->offset, &opts->image, opts->no_offset_check, &needs_full_flash)) {
+            full_flash = false;
+        } else if (needs_full_flash) {
+            session_log(s, "Falling back to a full flash.\n");
+        } else {
+            session_err(s, "ERROR: Could not flash the device. Try again.\n");
+            return false;
+        }
     }
 
-    return true;
+    // Continue where an interrupted run left off
+    long done = full_flash ? journal_resume_point(s, opts) : 0;
+    if (done > 0) {
+        bool needs_full_flash = false;
+        if (flash_resume(s, opts->offset, &opts->image, opts->no_offset_check, done, &needs_full_flash)) {
+            full_flash = false;
+        } else if (needs_full_flash) {
+            session_log(s, "Falling back to a full flash.\n");
+        } else {
+            journal_update(s, opts, false);
+            session_err(s, "ERROR: Could not flash the device. Try again.\n");
+            return false;
+        }
+    }
 
-    // TODO check pointer validity
-}
+    // Trailing blank reports can only be skipped where this erase leaves them blank
+    bool erased = full_flash && s->chip != SN240B && s->chip != SN260;
+    if (opts->trim && !full_flash)
+        session_log(s, "Trimming skipped, it only applies to a full flash.\n");
+    else if (opts->trim && !erased)
+        session_log(s, "Trimming skipped, this chip erases while programming.\n");
+    if (erased) {
+        ok = erase_image_range(s, opts->offset, opts->image.size);
+        if (!ok) return false;
+        wait_settle(s, s->timing->erase_ms);
+    }
 
-bool sanity_check_jumploader_firmware(long fw_size) {
-    if (fw_size > QMK_OFFSET_DEFAULT) {
-        fprintf(stderr, "ERROR: Jumper loader is too large: 0x%08lx max allowed is 0x%08lx.\n", fw_size, MAX_FIRMWARE - QMK_OFFSET_DEFAULT);
-        return false;
+    bool flashed = !full_flash || flash(s, opts->offset, &opts->image, opts->no_offset_check, opts->trim && erased);
+    journal_update(s, opts, flashed);
+    if (flashed) {
+        session_log(s, "Device succesfully flashed!\n");
+        wait_settle(s, s->timing->reboot_ms);
+        start = monotonic_ns();
+        stage_record(s, "reboot_user", 1, start, protocol_reboot_user(s));
+        return true;
     }
+    session_err(s, "ERROR: Could not flash the device. Try again.\n");
+    return false;
+}
 
-    return true;
+typedef struct {
+    session_t        session;
+    flash_options_t *opts;
+    pthread_t        thread;
+    bool             started;
+} fleet_worker_t;
+
+// Summary status of a finished session
+static const char *session_status(const session_t *s) {
+    if (s->ok) return "OK";
+    return s->timeout_stage ? "TIMEOUT" : "FAILED";
 }
 
-long get_file_size(FILE *fp) {
-    if (fseek(fp, 0, SEEK_END) != 0) {
-        fprintf(stderr, "ERROR: Could not read EOF.\n");
-        return -1;
+static void *fleet_worker(void *arg) {
+    fleet_worker_t *w = arg;
+    w->session.ok     = run_session(&w->session, w->opts);
+    return NULL;
+}
+
+// Flash every device matching vid/pid concurrently, one worker per device.
+// Returns the number of devices that failed.
+int flash_fleet(uint16_t vid, uint16_t pid, flash_options_t *opts) {
+    static fleet_worker_t workers[MAX_FLEET_DEVICES];
+    char                  topologies[MAX_FLEET_DEVICES][TOPOLOGY_SIZE];
+    int                   count = 0;
+
+    printf("Enumerating devices 0x%04x/0x%04x...\n", vid, pid);
+    struct hid_device_info *devs = device_transport->enumerate(vid, pid);
+    for (struct hid_device_info *cur = devs; cur != NULL; cur = cur->next) {
+        char topology[TOPOLOGY_SIZE];
+        device_topology(cur->path, topology, sizeof(topology));
+
+        // Devices with several interfaces show up once per interface
+        bool seen = false;
+        for (int i = 0; i < count && !seen; i++)
+            seen = strcmp(topologies[i], topology) == 0;
+        if (seen) continue;
+        if (count == MAX_FLEET_DEVICES) {
+            fprintf(stderr, "Warning: more than %d devices found, ignoring the rest.\n", MAX_FLEET_DEVICES);
+            break;
+        }
+
+        char prefix[16];
+        snprintf(prefix, sizeof(prefix), "[%d]", count + 1);
+        uint64_t    open_start = monotonic_ns();
+        void       *handle     = device_transport->open_path(cur->path);
+        if (handle == NULL) {
+            fprintf(stderr, "ERROR: Could not open device %s %s.\n", prefix, cur->path);
+            continue;
+        }
+        printf("Device %s: %s\n", prefix, cur->path);
+        snprintf(topologies[count], sizeof(topologies[count]), "%s", topology);
+        cli_session_init(&workers[count].session, device_transport, handle, cur->path, prefix);
+        stage_record(&workers[count].session, "open", 1, open_start, true);
+        workers[count].opts = opts;
+        count++;
     }
+    device_transport->free_enumeration(devs);
 
-    long file_size = ftell(fp);
-    if (file_size == -1L) {
-        fprintf(stderr, "ERROR: File size calculation failed.\n");
-        return -1;
+    if (count == 0) {
+        fprintf(stderr, "ERROR: No devices found (Are the devices connected?).\n");
+        return 1;
     }
 
-    // Reset file position to the beginning
-    if (fseek(fp, 0, SEEK_SET) != 0) {
-        fprintf(stderr, "ERROR: File size cleanup failed.\n");
-        return -1;
+    // The firmware image is shared by all sessions, prepare it once up front
+    if (!images_ready(opts)) {
+        fprintf(stderr, "ERROR: File preparation failed.\n");
+        for (int i = 0; i < count; i++) {
+            workers[i].session.transport->close(workers[i].session.handle);
+            cli_session_free(&workers[i].session);
+        }
+        return count;
     }
 
-    return file_size;
+    printf("\n");
+    printf("Flashing %d device(s)...\n", count);
+    for (int i = 0; i < count; i++) {
+        workers[i].started = pthread_create(&workers[i].thread, NULL, fleet_worker, &workers[i]) == 0;
+        if (!workers[i].started) fprintf(stderr, "ERROR: Could not start worker for device [%d].\n", i + 1);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        if (workers[i].started) pthread_join(workers[i].thread, NULL);
+        if (!workers[i].session.ok) failed++;
+    }
+
+    printf("\n");
+    printf("Fleet summary: %d of %d device(s) flashed.\n", count - failed, count);
+    if (timing_file) {
+        session_t *sessions[MAX_FLEET_DEVICES];
+        for (int i = 0; i < count; i++)
+            sessions[i] = &workers[i].session;
+        timing_write_json(timing_file, sessions, count);
+    }
+    for (int i = 0; i < count; i++) {
+        session_t *s = &workers[i].session;
+        printf("%s %-7s chip %d, CS%d, %s\n", s->prefix, session_status(s), s->chip, s->cs_level, s->path);
+        s->transport->close(s->handle);
+        cli_session_free(s);
+    }
+    return failed;
 }
 
-bool truncate_and_reopen(const char *file_name, FILE **fp, long new_size) {
-    fclose(*fp); // Close the file before truncating
-    if (truncate(file_name, new_size) != 0) {
-        fprintf(stderr, "ERROR: Could not truncate file to size %ld.\n", new_size);
-        return false;
+// Open the first device matching vid/pid, as hid_open() would, and report its
+// path so the session can follow it through an OEM reboot.
+void *open_device(uint16_t vid, uint16_t pid, char **path) {
+    struct hid_device_info *devs   = device_transport->enumerate(vid, pid);
+    void                   *handle = NULL;
+
+    free(*path);
+    *path = NULL;
+    if (devs) {
+        handle = device_transport->open_path(devs->path);
+        if (handle) *path = strdup(devs->path);
     }
+    device_transport->free_enumeration(devs);
+    return handle;
+}
 
-    *fp = fopen(file_name, "rb"); // Reopen the file in read mode
-    if (*fp == NULL) {
-        fprintf(stderr, "ERROR: Could not reopen file after truncation.\n");
+// Pick the device to flash when no --vidpid was given. A keyboard still running
+// its OEM firmware is rebooted with the option its VID or the discovery cache
+// implies, unless --reboot was passed.
+static bool discover_device(const char *cache_file, flash_options_t *opts, discovery_candidate_t *found) {
+    discovery_candidate_t candidates[DISCOVERY_MAX_CANDIDATES];
+    int                   count = discovery_scan(device_transport, cache_file, candidates, DISCOVERY_MAX_CANDIDATES);
+    int                   pick  = discovery_pick(candidates, count);
+
+    if (count == 0) {
+        fprintf(stderr, "ERROR: No ISP bootloader or keyboard with a known VID found (Is the device connected?).\n");
+        return false;
+    }
+    if (pick < 0) {
+        fprintf(stderr, "ERROR: Found %d devices, pass the --vidpid of the one to flash:\n", count);
+        discovery_print(stderr, candidates, count);
         return false;
     }
+    *found = candidates[pick];
+    printf("Discovered device:\n");
+    discovery_print(stdout, found, 1);
+    if (found->rank == DISCOVERY_ISP) return true;
+
+    if (opts->reboot_requested) {
+        // Remembered for the port if the flash succeeds
+        snprintf(found->reboot, sizeof(found->reboot), "%s", opts->reboot_opt);
+    } else if (found->reboot[0] == '\0') {
+        fprintf(stderr, "ERROR: 0x%04x/0x%04x runs its OEM firmware, pass its --reboot option.\n", found->vid, found->pid);
+        return false;
+    } else {
+        opts->reboot_opt       = found->reboot;
+        opts->reboot_requested = true;
+    }
+    return true;
+}
+
+// When a --vidpid device still can't be opened after the retries, list the other
+// Sonix or OEM devices that are connected, which usually means the wrong PID
+// variant was given. Returns false when there are none.
+static bool report_other_devices(uint16_t vid, uint16_t pid) {
+    discovery_candidate_t candidates[DISCOVERY_MAX_CANDIDATES];
+    int                   count = discovery_scan(device_transport, NULL, candidates, DISCOVERY_MAX_CANDIDATES);
 
+    if (count == 0) return false;
+    fprintf(stderr, "ERROR: No device 0x%04x/0x%04x found, but these are connected:\n", vid, pid);
+    discovery_print(stderr, candidates, count);
     return true;
 }
 
-long prepare_file_to_flash(const char *file_name, bool flash_jumploader) {
-    FILE *fp = fopen(file_name, "rb");
-    if (fp == NULL) {
-        fprintf(stderr, "ERROR: Could not open file (Does the file exist?).\n");
-        return -1;
-    }
+// One USB port seen by station mode. A port stays claimed while its session runs
+// and until nothing has been plugged into it for STATION_DEBOUNCE_MS, so a unit
+// re-enumerating after its reboot to user mode is never flashed again.
+typedef struct {
+    char           topology[TOPOLOGY_SIZE];
+    uint64_t       last_seen_ns;
+    bool           used;
+    bool           busy; // Session running
+    bool           done; // Session finished, thread not joined yet
+    fleet_worker_t worker;
+} station_port_t;
+
+static pthread_mutex_t station_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *station_worker(void *arg) {
+    station_port_t *port = arg;
+    port->worker.session.ok = run_session(&port->worker.session, port->worker.opts);
+    pthread_mutex_lock(&station_lock);
+    port->done = true;
+    pthread_mutex_unlock(&station_lock);
+    return NULL;
+}
 
-    long file_size = get_file_size(fp);
-    if (file_size == -1L) {
-        fclose(fp);
-        return -1;
+static station_port_t *station_find_port(station_port_t *ports, const char *topology) {
+    for (int i = 0; i < MAX_FLEET_DEVICES; i++) {
+        if (ports[i].used && strcmp(ports[i].topology, topology) == 0) return &ports[i];
     }
+    return NULL;
+}
 
-    if (file_size == 0) {
-        fprintf(stderr, "ERROR: File is empty.\n");
-        fclose(fp);
-        return -1;
+// Claim the port of a device that just arrived and flash it in a session of its
+// own. A device that can't be opened keeps its port claimed until it is unplugged.
+static bool station_start(station_port_t *port, const char *path, const char *topology, flash_options_t *opts) {
+    char prefix[sizeof(port->worker.session.prefix)];
+    snprintf(prefix, sizeof(prefix), "[%s]", topology);
+    memset(port, 0, sizeof(*port));
+    snprintf(port->topology, sizeof(port->topology), "%s", topology);
+    port->used         = true;
+    port->last_seen_ns = monotonic_ns();
+
+    void *handle = device_transport->open_path(path);
+    if (handle == NULL) {
+        fprintf(stderr, "ERROR: Could not open device %s %s.\n", prefix, path);
+        return false;
     }
-    printf("\n");
-    printf("File size: %ld bytes\n", file_size);
+    cli_session_init(&port->worker.session, device_transport, handle, path, prefix);
+    port->worker.opts = opts;
+    printf("Device %s arrived: %s%s\n", prefix, path, opts->reboot_requested ? ", requesting bootloader reboot" : "");
+
+    port->busy = port->worker.started = pthread_create(&port->worker.thread, NULL, station_worker, port) == 0;
+    if (!port->busy) {
+        fprintf(stderr, "ERROR: Could not start worker for device %s.\n", prefix);
+        device_transport->close(handle);
+        cli_session_free(&port->worker.session);
+    }
+    return port->busy;
+}
+
+// Unattended flashing: wait for devices to be plugged in and flash each one as
+// it arrives. ISP bootloaders (Sonix VID, known ISP PID) are flashed directly;
+// when --reboot is given, devices matching vid/pid are rebooted into their
+// bootloader first. Runs until the process is stopped.
+void flash_station(uint16_t vid, uint16_t pid, flash_options_t *opts) {
+    static station_port_t ports[MAX_FLEET_DEVICES];
+    flash_options_t       isp_opts = *opts;
+    isp_watch_t           watch;
+    int                   flashed = 0, failed = 0;
+
+    // Bootloaders that are already in ISP mode must not get the OEM reboot request
+    isp_opts.reboot_requested = false;
+    isp_opts.reboot_opt       = NULL;
+
+    printf("Station ready, waiting for devices (ISP bootloaders");
+    if (opts->reboot_requested) printf(", 0x%04x/0x%04x with reboot option '%s'", vid, pid, opts->reboot_opt);
+    printf(")...\n");
+    isp_watch_start(&watch);
+    while (true) {
+        uint64_t now = monotonic_ns();
+
+        // Collect finished sessions
+        for (int i = 0; i < MAX_FLEET_DEVICES; i++) {
+            station_port_t *port = &ports[i];
+            pthread_mutex_lock(&station_lock);
+            bool done = port->busy && port->done;
+            pthread_mutex_unlock(&station_lock);
+            if (!done) continue;
+
+            pthread_join(port->worker.thread, NULL);
+            session_t *s = &port->worker.session;
+            if (s->ok)
+                flashed++;
+            else
+                failed++;
+            printf("%s %-7s chip %d, CS%d. Station total: %d flashed, %d failed.\n", s->prefix, session_status(s), s->chip, s->cs_level, flashed, failed);
+            fflush(stdout);
+            s->transport->close(s->handle);
+            cli_session_free(s);
+            port->busy         = false;
+            port->last_seen_ns = now;
+        }
 
-    // If jumploader is not 0x200 in length, add padded zeroes to file
-    if (flash_jumploader && file_size < QMK_OFFSET_DEFAULT) {
-        printf("Warning: jumploader binary doesn't have a size of: 0x%04x bytes.\n", QMK_OFFSET_DEFAULT);
-        printf("Truncating jumploader binary to: 0x%04x.\n", QMK_OFFSET_DEFAULT);
+        // Any device on a claimed port keeps it claimed, whatever it enumerates as
+        struct hid_device_info *devs = device_transport->enumerate(0, 0);
+        for (struct hid_device_info *cur = devs; cur != NULL; cur = cur->next) {
+            char topology[TOPOLOGY_SIZE];
+            device_topology(cur->path, topology, sizeof(topology));
+            station_port_t *port = station_find_port(ports, topology);
+            if (port) {
+                port->last_seen_ns = now;
+                continue;
+            }
 
-        if (!truncate_and_reopen(file_name, &fp, QMK_OFFSET_DEFAULT)) {
-            return -1;
+            flash_options_t *match = NULL;
+            if (cur->vendor_id == SONIX_VID && is_known_isp_pid(cur->product_id)) match = &isp_opts;
+            else if (opts->reboot_requested && cur->vendor_id == vid && cur->product_id == pid) match = opts;
+            if (match == NULL) continue;
+
+            for (int i = 0; i < MAX_FLEET_DEVICES && port == NULL; i++) {
+                if (!ports[i].used) port = &ports[i];
+            }
+            if (port == NULL) {
+                fprintf(stderr, "Warning: more than %d ports in use, ignoring %s.\n", MAX_FLEET_DEVICES, cur->path);
+                continue;
+            }
+            if (!station_start(port, cur->path, topology, match)) failed++;
         }
+        device_transport->free_enumeration(devs);
 
-        // Recalculate file size
-        file_size = get_file_size(fp);
-        if (file_size == -1L) {
-            fprintf(stderr, "ERROR: Truncated file size calculation failed.\n");
-            fclose(fp);
-            return -1;
+        // Release ports that have been empty long enough
+        for (int i = 0; i < MAX_FLEET_DEVICES; i++) {
+            station_port_t *port = &ports[i];
+            if (port->used && !port->busy && now - port->last_seen_ns > (uint64_t)STATION_DEBOUNCE_MS * 1000000) port->used = false;
         }
+        fflush(stdout);
+        isp_watch_wait(&watch, STATION_POLL_MS);
     }
+}
 
-    // Adjust file size to fit in the HID report
-    if (file_size % REPORT_SIZE != 0) {
-        printf("File size must be adjusted to fit in the HID report.\n");
-        long padded_file_size = file_size;
-        printf("File size before padding: %ld bytes\n", padded_file_size);
-        while (padded_file_size % REPORT_SIZE != 0) {
-            padded_file_size++;
-        }
-        printf("File size after padding: %ld bytes\n", padded_file_size);
+// Run one session against the emulated bootloader and report host-side cost:
+// feature reports per second, end-to-end session time and host CPU time.
+bool run_emulated_session(const char *chip, unsigned int latency_us, flash_options_t *opts) {
+    sn32_emulator_t *emu = sn32_emulator_open(chip, latency_us);
+    if (emu == NULL) {
+        fprintf(stderr, "ERROR: unknown emulated chip '%s', expected one of: ", chip);
+        sn32_emulator_list_chips();
+        return false;
+    }
 
-        if (!truncate_and_reopen(file_name, &fp, padded_file_size)) {
-            return -1;
-        }
+    session_t session;
+    cli_session_init(&session, &sn32_emulator_transport, emu, NULL, NULL);
 
-        // Recalculate file size
-        file_size = get_file_size(fp);
-        if (file_size == -1L) {
-            fprintf(stderr, "ERROR: Truncated file size calculation failed.\n");
-            fclose(fp);
-            return -1;
-        }
+    uint64_t start     = monotonic_ns();
+    clock_t  cpu_start = clock();
+    bool     ok        = run_session(&session, opts);
+    session.ok         = ok;
+    double   wall_ms   = (monotonic_ns() - start) / 1e6;
+    double   cpu_ms    = (double)(clock() - cpu_start) * 1000.0 / CLOCKS_PER_SEC;
+
+    printf("\n");
+    printf("Benchmark: chip %s, %s, %ld reports, %.0f reports/s, session %.1f ms, host CPU %.1f ms, latency %u us/report\n", chip, ok ? "OK" : "FAILED", session.reports, wall_ms > 0 ? session.reports * 1000.0 / wall_ms : 0.0, wall_ms, cpu_ms, latency_us);
+    if (timing_file) {
+        session_t *sessions[] = {&session};
+        timing_write_json(timing_file, sessions, 1);
     }
 
-    fclose(fp);
-    return file_size;
+    session.transport->close(session.handle);
+    cli_session_free(&session);
+    return ok;
 }
 
-char *get_full_path(const char *file_name) {
-    char *full_path = NULL;
+#ifndef _WIN32
+typedef struct {
+    daemon_client_t *client;
+    const char      *id;
+} daemon_sink_t;
 
-#ifdef _WIN32
-    char buffer[MAX_PATH];
-    if (GetFullPathName(file_name, MAX_PATH, buffer, NULL) != 0) {
-        full_path = strdup(buffer);
-    } else {
-        fprintf(stderr, "ERROR: Could not resolve full path for file: '%s'\n", file_name);
+static void daemon_sink(void *ctx, int stream_no, const char *line) {
+    daemon_sink_t *sink = ctx;
+    daemon_send_line(sink->client, sink->id, stream_no, line);
+}
+
+static bool parse_vidpid(const char *str, uint16_t *vid, uint16_t *pid) {
+    return (sscanf(str, "%4hx/%4hx", vid, pid) == 2 || sscanf(str, "%4hx:%4hx", vid, pid) == 2) && *vid != 0 && *pid != 0;
+}
+
+// Jobs for the same physical device are serialised. A vidpid job is keyed by the
+// device it would open; emulated jobs share nothing.
+static void daemon_job_key(const daemon_job_t *job, char *key, size_t key_size) {
+    uint16_t vid, pid;
+
+    key[0] = '\0';
+    if (job->path[0] != '\0') {
+        device_topology(job->path, key, key_size);
+    } else if (job->vidpid[0] != '\0' && parse_vidpid(job->vidpid, &vid, &pid)) {
+        struct hid_device_info *devs = device_transport->enumerate(vid, pid);
+        if (devs) device_topology(devs->path, key, key_size);
+        device_transport->free_enumeration(devs);
     }
-#else
-    char buffer[PATH_MAX];
-    if (realpath(file_name, buffer) != NULL) {
-        full_path = strdup(buffer);
-    } else {
-        fprintf(stderr, "ERROR: Could not resolve full path for file: '%s'\n", file_name);
+}
+
+// Run one daemon job like a single device flash from the command line, with the
+// session output streamed to the client.
+static bool daemon_run_job(const daemon_job_t *job, daemon_client_t *client, char *err, size_t err_size) {
+    const sn32_transport_t *transport = device_transport;
+    daemon_sink_t           sink      = {client, job->id};
+    char                    reboot_opt[sizeof(job->reboot)];
+    char                   *path   = NULL;
+    void                   *handle = NULL;
+    uint16_t                vid, pid;
+
+    snprintf(reboot_opt, sizeof(reboot_opt), "%s", job->reboot);
+    if ((job->differential || job->verify_only) && !range_checksum) {
+        snprintf(err, err_size, "diff and verify_only need the daemon to run with --range-checksum");
+        return false;
+    }
+    flash_options_t opts = {
+        .offset           = job->offset,
+        .offset_given     = job->offset_given,
+        .jumploader       = job->jumploader,
+        .file_name        = get_full_path(job->file),
+        .reboot_opt       = reboot_opt,
+        .reboot_requested = reboot_opt[0] != '\0',
+        .no_offset_check  = job->no_offset_check,
+        .differential     = job->differential,
+        .trim             = job->trim,
+        .verify_only      = job->verify_only,
+    };
+    if (opts.file_name == NULL) {
+        snprintf(err, err_size, "could not resolve file '%s'", job->file);
+        return false;
     }
-#endif
 
-    return full_path;
+    if (job->emulate[0] != '\0') {
+        transport = &sn32_emulator_transport;
+        handle    = sn32_emulator_open(job->emulate, 0);
+    } else if (job->path[0] != '\0') {
+        handle = device_transport->open_path(job->path);
+        if (handle) path = strdup(job->path);
+    } else if (parse_vidpid(job->vidpid, &vid, &pid)) {
+        handle = open_device(vid, pid, &path);
+    }
+    if (handle == NULL) {
+        snprintf(err, err_size, "could not open the device");
+        free(opts.file_name);
+        return false;
+    }
+
+    session_t session;
+    cli_session_init(&session, transport, handle, path, NULL);
+    session.sink     = daemon_sink;
+    session.sink_ctx = &sink;
+    session.ok       = run_session(&session, &opts);
+    if (session.timeout_stage) snprintf(err, err_size, "device timed out during %s", session.timeout_stage);
+    // The handle may have moved to the ISP device during an OEM reboot
+    session.transport->close(session.handle);
+    cli_session_free(&session);
+    free_flash_images(&opts);
+    free(opts.file_name);
+    free(path);
+    return session.ok;
 }
+#endif
 
 int main(int argc, char *argv[]) {
-    int         opt, opt_index;
-    hid_device *handle;
+    int   opt, opt_index;
+    void *handle;
 
     uint16_t vid              = 0;
     uint16_t pid              = 0;
     long     offset           = 0;
+    bool     offset_given     = false;
+    bool     jumploader       = false;
     char    *file_name        = NULL;
     char    *endptr           = NULL;
     char    *reboot_opt       = NULL;
     bool     reboot_requested = false;
     debug                     = false;
     bool no_offset_check      = false;
+    bool fleet                = false;
+    bool station              = false;
+    bool differential         = false;
+    bool trim                 = false;
+    bool verify_only          = false;
+    char        *emulate_chip    = NULL;
+    unsigned int emulate_latency = 0;
+    char        *daemon_socket   = NULL;
+
+    timing_epoch_ns = monotonic_ns();
+    if (!select_backend(DEFAULT_BACKEND)) exit(1);
 
     if (argc < 2) {
         print_usage(PROJECT_NAME);
@@ -904,10 +1523,31 @@ int main(int argc, char *argv[]) {
                                  {"debug", no_argument, NULL, 'd'},
                                  {"nooffset", no_argument, NULL, 'k'},
                                  {"list-vidpid", no_argument, NULL, 'l'},
+                                 {"fleet", no_argument, NULL, 'F'},
+                                 {"station", no_argument, NULL, 's'},
+                                 {"diff", no_argument, NULL, 'D'},
+                                 {"trim", no_argument, NULL, 't'},
+                                 {"verify-only", no_argument, NULL, 'y'},
+                                 {"probe-interval", required_argument, NULL, 'P'},
+                                 {"range-checksum", no_argument, NULL, 'c'},
+                                 {"io-timeout", required_argument, NULL, 'I'},
+                                 {"session-timeout", required_argument, NULL, 'W'},
+                                 {"emulate", required_argument, NULL, 'E'},
+                                 {"emulate-latency", required_argument, NULL, 'L'},
+                                 {"timing", required_argument, NULL, 'T'},
+                                 {"trace", required_argument, NULL, 'x'},
+                                 {"json", no_argument, NULL, 'J'},
+                                 {"decode-trace", required_argument, NULL, 'X'},
+                                 {"cache", no_argument, NULL, 'C'},
+                                 {"resume", no_argument, NULL, 'R'},
+                                 {"manifest", required_argument, NULL, 'M'},
+                                 {"step", required_argument, NULL, 'm'},
+                                 {"backend", required_argument, NULL, 'B'},
+                                 {"daemon", required_argument, NULL, 'S'},
                                  {NULL, 0, 0, 0}};
     // clang-format on
 
-    while ((opt = getopt_long(argc, argv, "hlVv:o:r:f:jdk", longoptions, &opt_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hlVv:o:r:f:jdkFsDtyP:cI:W:E:L:T:x:X:JCRM:m:B:S:", longoptions, &opt_index)) != -1) {
         switch (opt) {
             case 'h': // Show help
                 print_usage(PROJECT_NAME);
@@ -944,13 +1584,14 @@ int main(int argc, char *argv[]) {
                     fprintf(stderr, "ERROR: invalid offset value -'%s'.\n", optarg);
                     exit(1);
                 }
+                offset_given = true;
                 break;
             case 'r': // reboot
                 reboot_opt       = optarg;
                 reboot_requested = true;
                 break;
             case 'j': // Jumploader
-                flash_jumploader = true;
+                jumploader = true;
                 break;
             case 'd': // debug
                 debug = true;
@@ -958,6 +1599,111 @@ int main(int argc, char *argv[]) {
             case 'k': // skip offset check
                 no_offset_check = true;
                 break;
+            case 'F': // flash every matching device
+                fleet = true;
+                break;
+            case 's': // flash devices as they are plugged in
+                station = true;
+                break;
+            case 'D': // differential flash
+                differential = true;
+                break;
+            case 't': // trim trailing blank reports
+                trim = true;
+                break;
+            case 'y': // audit without flashing
+                verify_only = true;
+                break;
+            case 'P': // mid-stream status probes
+                if (strcmp(optarg, "page") == 0) {
+                    probe_interval = PROBE_PAGE;
+                    break;
+                }
+                probe_interval = strtol(optarg, &endptr, 0);
+                if (*endptr != '\0' || endptr == optarg || probe_interval < 0) {
+                    fprintf(stderr, "ERROR: invalid probe interval -'%s'.\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'c': // unverified range checksum command
+                range_checksum = true;
+                break;
+            case 'I': // per-call deadline
+                io_timeout_ms = (uint32_t)strtoul(optarg, &endptr, 0);
+                if (*endptr != '\0' || endptr == optarg || io_timeout_ms == 0) {
+                    fprintf(stderr, "ERROR: invalid I/O timeout value -'%s'.\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'W': // session budget
+                session_timeout = (uint32_t)strtoul(optarg, &endptr, 0);
+                if (*endptr != '\0' || endptr == optarg || session_timeout == 0 || session_timeout > UINT32_MAX / 1000) {
+                    fprintf(stderr, "ERROR: invalid session timeout value -'%s'.\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'E': // emulated bootloader
+                emulate_chip = optarg;
+                break;
+            case 'T': // stage timing summary
+                timing_file    = optarg;
+                timing_enabled = true;
+                break;
+            case 'x': // feature report trace
+                if (trace_out) fclose(trace_out);
+                trace_out = fopen(optarg, "wb");
+                if (trace_out == NULL) {
+                    fprintf(stderr, "ERROR: Could not create trace file '%s'.\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'J': { // JSON events
+                // Events get stdout to themselves, everything else moves to stderr
+                int fd = json_out ? -1 : dup(STDOUT_FILENO);
+                fflush(stdout);
+                if (fd >= 0) json_out = fdopen(fd, "w");
+                if (json_out == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+                    fprintf(stderr, "ERROR: Could not set up the JSON event stream.\n");
+                    exit(1);
+                }
+                break;
+            }
+            case 'X': // decode a trace
+                exit(trace_decode(optarg, TRACE_GAP_MS) ? 0 : 1);
+            case 'C': // prepared image cache
+                free(image_cache_dir);
+                image_cache_dir = image_cache_default_dir();
+                if (image_cache_dir == NULL) fprintf(stderr, "Warning: no cache directory found, image cache disabled.\n");
+                break;
+            case 'R': // resume journal
+                free(journal_dir);
+                journal_dir = journal_default_dir();
+                if (journal_dir == NULL) fprintf(stderr, "Warning: no cache directory found, resume journal disabled.\n");
+                break;
+            case 'M': // manifest file
+                if (!manifest_load(optarg)) exit(1);
+                break;
+            case 'm': // manifest step
+                if (!manifest_add_step(optarg, "--step")) exit(1);
+                break;
+            case 'B': // device transport
+                if (!select_backend(optarg)) exit(1);
+                break;
+            case 'S': // job daemon
+#ifdef _WIN32
+                fprintf(stderr, "ERROR: --daemon is not supported on Windows.\n");
+                exit(1);
+#else
+                daemon_socket = optarg;
+                break;
+#endif
+            case 'L': // emulated per-report latency
+                emulate_latency = (unsigned int)strtoul(optarg, &endptr, 0);
+                if (*endptr != '\0') {
+                    fprintf(stderr, "ERROR: invalid latency value -'%s'.\n", optarg);
+                    exit(1);
+                }
+                break;
             case '?':
             default:
                 switch (optopt) {
@@ -965,6 +1711,18 @@ int main(int argc, char *argv[]) {
                     case 'v':
                     case 'o':
                     case 'r':
+                    case 'P':
+                    case 'I':
+                    case 'W':
+                    case 'E':
+                    case 'L':
+                    case 'T':
+                    case 'x':
+                    case 'X':
+                    case 'M':
+                    case 'm':
+                    case 'B':
+                    case 'S':
                         fprintf(stderr, "ERROR: option '-%c' requires a parameter.\n", optopt);
                         break;
                     case 0:
@@ -980,29 +1738,149 @@ int main(int argc, char *argv[]) {
         if (opt == 'h' || opt == 'V') exit(1);
     }
 
-    if (file_name == NULL) {
+    if ((differential || verify_only) && !range_checksum) {
+        fprintf(stderr, "ERROR: --diff and --verify-only need --range-checksum, which relies on a checksum command unverified on hardware.\n");
+        exit(1);
+    }
+
+#ifndef _WIN32
+    if (daemon_socket) {
+        // hidapi stays initialised for every job the daemon runs
+        if (hid_init() < 0) {
+            fprintf(stderr, "ERROR: Could not initialize HID.\n");
+            exit(1);
+        }
+        bool ok = daemon_run(daemon_socket, daemon_run_job, daemon_job_key);
+        free(file_name);
+        cleanup(NULL);
+        exit(ok ? 0 : 1);
+    }
+#endif
+
+    if (manifest_step_count > 0) {
+        if (file_name || differential || verify_only) {
+            fprintf(stderr, "ERROR: --manifest and --step can't be combined with --file, --diff or --verify-only.\n");
+            exit(1);
+        }
+        for (int i = 0; i < manifest_step_count; i++) {
+            if (manifest_steps[i].op == STEP_REBOOT && i != manifest_step_count - 1) {
+                fprintf(stderr, "ERROR: reboot has to be the last manifest step.\n");
+                exit(1);
+            }
+            if (manifest_steps[i].op == STEP_VERIFY && !range_checksum) {
+                fprintf(stderr, "ERROR: verify steps need --range-checksum, which relies on a checksum command unverified on hardware.\n");
+                exit(1);
+            }
+            manifest_steps[i].image.no_offset_check = no_offset_check;
+        }
+        if (manifest_steps[0].op == STEP_OEM_REBOOT) {
+            reboot_opt       = manifest_steps[0].option;
+            reboot_requested = true;
+        }
+        printf("Manifest of %d steps, device: 0x%04x/0x%04x.\n", manifest_step_count, vid, pid);
+    } else if (file_name == NULL) {
         fprintf(stderr, "ERROR: filename cannot be null.\n");
         exit(1);
+    } else if (emulate_chip) {
+        // No device is opened, run_emulated_session names the emulated chip
+    } else if (vid == 0 && pid == 0) {
+        printf("Firmware to flash: %s with offset 0x%04lx, device: discovered.\n", file_name, offset);
+    } else {
+        printf("Firmware to flash: %s with offset 0x%04lx, device: 0x%04x/0x%04x.\n", file_name, offset, vid, pid);
     }
 
-    printf("Firmware to flash: %s with offset 0x%04lx, device: 0x%04x/0x%04x.\n", file_name, offset, vid, pid);
+    flash_options_t opts = {
+        .offset           = offset,
+        .offset_given     = offset_given,
+        .jumploader       = jumploader,
+        .file_name        = file_name,
+        .reboot_opt       = reboot_opt,
+        .reboot_requested = reboot_requested,
+        .no_offset_check  = no_offset_check,
+        .differential     = differential,
+        .trim             = trim,
+        .verify_only      = verify_only,
+        .steps            = manifest_step_count > 0 ? manifest_steps : NULL,
+        .step_count       = manifest_step_count,
+    };
+
+    images_prepare_start(&opts);
 
     // Try to open the device
     if (hid_init() < 0) {
         fprintf(stderr, "ERROR: Could not initialize HID.\n");
         exit(1);
     }
+
+    if (emulate_chip) {
+        bool ok = run_emulated_session(emulate_chip, emulate_latency, &opts);
+        free_flash_images(&opts);
+        free(file_name);
+        cleanup(NULL);
+        exit(ok ? 0 : 1);
+    }
+
+    if (station) {
+        if (reboot_requested && (vid == 0 || pid == 0)) {
+            fprintf(stderr, "ERROR: --station with --reboot needs the --vidpid of the devices to reboot.\n");
+            exit(1);
+        }
+        // Prepared once, every arriving device is flashed with the same image
+        if (!images_ready(&opts)) {
+            fprintf(stderr, "ERROR: File preparation failed.\n");
+            free(file_name);
+            cleanup(NULL);
+            exit(1);
+        }
+        flash_station(vid, pid, &opts);
+    }
+
+    if (fleet) {
+        int failed = flash_fleet(vid, pid, &opts);
+        free_flash_images(&opts);
+        free(file_name);
+        cleanup(NULL);
+        exit(failed ? 1 : 0);
+    }
+
     printf("\n");
     printf("\n");
     printf("Opening device...\n");
-    handle = hid_open(vid, pid, NULL);
+    uint64_t              open_start     = monotonic_ns();
+    char                 *device_path    = NULL;
+    char                 *discovery_file = NULL;
+    discovery_candidate_t discovered;
+    if (vid == 0 && pid == 0) {
+        // No --vidpid: one enumeration pass decides, nothing to retry
+        discovery_file = discovery_default_file();
+        if (!discover_device(discovery_file, &opts, &discovered)) {
+            free(discovery_file);
+            free_flash_images(&opts);
+            free(file_name);
+            error(NULL);
+        }
+        vid              = discovered.vid;
+        pid              = discovered.pid;
+        reboot_requested = opts.reboot_requested;
+        handle           = device_transport->open_path(discovered.path);
+        if (handle == NULL) {
+            fprintf(stderr, "ERROR: Could not open the discovered device %s.\n", discovered.path);
+            free(discovery_file);
+            free_flash_images(&opts);
+            free(file_name);
+            error(NULL);
+        }
+        device_path = strdup(discovered.path);
+    } else {
+        handle = open_device(vid, pid, &device_path);
+    }
 
     uint8_t attempt_no = 1;
     while (handle == NULL && attempt_no <= MAX_ATTEMPTS) // Try {MAX ATTEMPTS} to connect to device.
     {
         printf("Device failed to open, re-trying in 3 seconds. Attempt %d of %d...\n", attempt_no, MAX_ATTEMPTS);
         sleep(3);
-        handle = hid_open(vid, pid, NULL);
+        handle = open_device(vid, pid, &device_path);
         attempt_no++;
     }
 
@@ -1017,49 +1895,36 @@ int main(int argc, char *argv[]) {
             printf("Warning: Flashing a non-sonix bootloader device, you are now on your own.\n");
             sleep(3);
         }
-        attempt_no = 1;
-        bool ok    = protocol_init(handle, reboot_requested, reboot_opt);
-        while (!ok && attempt_no <= MAX_ATTEMPTS) {
-            printf("Device failed to init, re-trying in 3 seconds. Attempt %d of %d...\n", attempt_no, MAX_ATTEMPTS);
-            sleep(3);
-            ok = protocol_init(handle, reboot_requested, reboot_opt);
-            attempt_no++;
-        }
-        if (!ok) error(handle);
-        sleep(1);
-        if (chip != SN240B && chip != SN260) ok = protocol_code_option_check(handle);
-        if (!ok) error(handle);
-        sleep(1);
-        if (cs_level != 0) {
-            printf("Resetting Code Security from CS%d to CS%d...\n", cs_level, 0);
-            ok = protocol_code_option_set(handle, code_option, CS0);
-        }
-        if (!ok) error(handle);
-        sleep(1);
-        if (chip != SN240B && chip != SN260) ok = erase_flash(handle, 0, USER_ROM_PAGES, BLANK_CHECKSUM);
-        if (!ok) error(handle);
-        sleep(1);
-
-        long prepared_file_size = prepare_file_to_flash(file_name, flash_jumploader);
-        if (prepared_file_size < 0) {
-            fprintf(stderr, "ERROR: File preparation failed.\n");
-            free(file_name);
-            error(handle);
+
+        session_t session;
+        cli_session_init(&session, device_transport, handle, device_path, NULL);
+        free(device_path);
+        stage_record(&session, "open", attempt_no, open_start, true);
+        bool ok    = run_session(&session, &opts);
+        session.ok = ok;
+        if (timing_file) {
+            session_t *sessions[] = {&session};
+            timing_write_json(timing_file, sessions, 1);
         }
-        if (((flash_jumploader && sanity_check_jumploader_firmware(prepared_file_size)) || (!flash_jumploader && sanity_check_firmware(prepared_file_size, offset))) && (flash(handle, offset, file_name, prepared_file_size, no_offset_check))) {
-            printf("Device succesfully flashed!\n");
-            sleep(2);
-            protocol_reboot_user(handle);
-        } else {
-            fprintf(stderr, "ERROR: Could not flash the device. Try again.\n");
+        // The handle may have moved to the ISP device, or been abandoned after a timeout
+        session.transport->close(session.handle);
+        handle = NULL;
+        cli_session_free(&session);
+        if (ok && discovery_file && discovered.rank != DISCOVERY_ISP) discovery_remember(discovery_file, &discovered);
+        free(discovery_file);
+        if (!ok) {
+            free_flash_images(&opts);
             free(file_name);
             error(handle);
         }
     } else {
-        fprintf(stderr, "ERROR: Could not open the device (Is the device connected?).\n");
+        // Only once the retries are exhausted, a bootloader may still be enumerating
+        if (!report_other_devices(vid, pid)) fprintf(stderr, "ERROR: Could not open the device (Is the device connected?).\n");
+        free_flash_images(&opts);
         free(file_name);
         error(handle);
     }
+    free_flash_images(&opts);
     free(file_name);
     cleanup(handle);
     exit(0);
@@ -0,0 +1,279 @@
+#ifndef SONIXFLASHER_H
+#define SONIXFLASHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#include "checksum.h"
+#include "sha256.h"
+#include "trace.h"
+
+// Internal interface shared by the modules of libsonixflash and the command line
+// front end. Applications use the public API in sonixflash.h instead.
+
+#define REPORT_SIZE 64
+#define USER_ROM_SIZE_SN32F260 30   // in KB
+#define USER_ROM_SIZE_SN32F220 16   // in KB
+#define USER_ROM_SIZE_SN32F230 32   // in KB
+#define USER_ROM_SIZE_SN32F240 64   // in KB
+#define USER_ROM_SIZE_SN32F240B 64  // in KB
+#define USER_ROM_SIZE_SN32F240C 128 // in KB
+#define USER_ROM_SIZE_SN32F280 128  // in KB
+#define USER_ROM_SIZE_SN32F290 256  // in KB
+#define USER_ROM_SIZE_KB(x) ((x) * 1024)
+
+#define USER_ROM_PAGES_SN32F260 480
+#define USER_ROM_PAGES_SN32F220 16
+#define USER_ROM_PAGES_SN32F230 32
+#define USER_ROM_PAGES_SN32F240 64
+#define USER_ROM_PAGES_SN32F240B 1024
+#define USER_ROM_PAGES_SN32F240C 128
+#define USER_ROM_PAGES_SN32F280 128
+#define USER_ROM_PAGES_SN32F290 256
+
+#define CMD_BASE 0x55AA
+#define CMD_GET_FW_VERSION 0x1
+#define CMD_COMPARE_CODE_OPTION 0x2
+#define CMD_SET_ENCRYPTION_ALGO 0x3
+#define CMD_ENABLE_ERASE 0x4
+#define CMD_ENABLE_PROGRAM 0x5
+#define CMD_GET_CHECKSUM 0x6 // Layout unverified on hardware, see protocol_get_checksum
+#define CMD_RETURN_USER_MODE 0x7
+#define CMD_SET_CS 0x8
+#define CMD_GET_CS 0x9
+#define CMD_VERIFY(x) ((CMD_BASE << 8) | (x))
+
+#define CMD_ACK 0xFAFAFAFA
+#define LAST_CHUNK_OFFSET (REPORT_SIZE - sizeof(uint32_t))
+#define PROBE_PAGE -1 // session_t.probe_interval: probe at every erase page boundary
+
+#define SN240 1
+#define SN260 2
+#define SN240B 3
+#define SN280 4
+#define SN290 5
+#define SN240C 6
+
+#define CS0_0 0x0000
+#define CS0_1 0xFFFF
+
+#define CS1 0x5A5A
+#define CS2 0xA5A5
+#define CS3 0x55AA
+
+#define SONIX_VID 0x0c45
+#define SN229_PID 0x7900
+#define SN239_PID SN229_PID
+#define SN249_PID SN229_PID
+#define SN248B_PID 0x7040
+#define SN248C_PID 0x7160
+#define SN268_PID 0x7010
+#define SN289_PID 0x7120
+#define SN299_PID 0x7140
+
+#define EVISION_VID 0x320F
+#define APPLE_VID 0x05ac
+
+#define QMK_OFFSET_DEFAULT 0x200
+#define MIN_FIRMWARE 0x100
+#define DIFF_BLOCK_SIZE 1024
+
+#define MAX_ATTEMPTS 5
+#define RETRY_DELAY_MS 100
+#define REENUM_TIMEOUT_MS 10000
+#define REENUM_POLL_MS 50
+#define REENUM_SETTLE_MS 1000
+
+#define TOPOLOGY_SIZE 256
+
+#define IMAGE_ALIGNMENT 64
+
+// fw_image_t flags, results of preparing the image that don't depend on the chip
+#define IMAGE_JUMPLOADER 0x1         // Padded as a jumploader
+#define IMAGE_MIN_SIZE_OK 0x2        // At least MIN_FIRMWARE bytes
+#define IMAGE_JUMPLOADER_SIZE_OK 0x4 // Fits below the QMK offset
+#define IMAGE_LOAD_ADDRESS 0x8       // The file gave the flash address, see load_address
+
+struct hid_device_info;
+
+// Feature report transport under hid_set_feature/hid_get_feature. Buffers carry
+// the Report ID in the first byte, exactly as hidapi expects them. Transports
+// for real devices also enumerate and open them, with hidapi's semantics.
+typedef struct {
+    const char *name;
+    int (*send_feature_report)(void *dev, const unsigned char *data, size_t length);
+    int (*get_feature_report)(void *dev, unsigned char *data, size_t length);
+    const wchar_t *(*error)(void *dev);
+    void (*close)(void *dev);
+    struct hid_device_info *(*enumerate)(unsigned short vid, unsigned short pid); // NULL when emulated
+    void (*free_enumeration)(struct hid_device_info *devs);
+    void *(*open_path)(const char *path);
+} sn32_transport_t;
+
+// Firmware image prepared for flashing. Padding is applied in memory only, the
+// file on disk is never modified.
+typedef struct {
+    unsigned char *data;                       // IMAGE_ALIGNMENT aligned, size bytes
+    long           size;                       // Padded size, a multiple of REPORT_SIZE
+    long           file_size;                  // Firmware bytes before padding
+    uint32_t       load_address;               // Flash address, with IMAGE_LOAD_ADDRESS
+    uint16_t       checksum;                   // checksum16 of the padded image
+    uint32_t       last_chunk;                 // Last 4 bytes, echoed back after programming
+    uint16_t      *report_checksums;           // checksum16 of every REPORT_SIZE block
+    uint32_t       flags;                      // IMAGE_* flags
+    uint8_t        digest[SHA256_DIGEST_SIZE]; // SHA-256 of the file on disk
+    void          *mapping;                    // Cache entry holding data, NULL if allocated
+    size_t         mapping_size;
+} fw_image_t;
+
+// Time in ms the bootloader is given after each stage before it takes the next
+// command, see timing_default in sonixflash.c.
+typedef struct {
+    uint16_t init_ms;
+    uint16_t code_option_ms;
+    uint16_t cs_reset_ms;
+    uint16_t erase_ms;
+    uint16_t reboot_ms;
+} sn32_timing_t;
+
+#define MAX_STAGE_EVENTS 256
+
+// One timed stage, or one attempt of a retried stage.
+typedef struct {
+    const char *stage;
+    int         attempt;
+    uint64_t    start_ns;
+    uint64_t    end_ns;
+    bool        ok;
+} stage_event_t;
+
+// Round-trip samples for one direction of feature report traffic, in ns.
+typedef struct {
+    uint64_t *samples;
+    size_t    count;
+    size_t    capacity;
+} rtt_samples_t;
+
+// Timing data collected for --timing.
+typedef struct {
+    stage_event_t events[MAX_STAGE_EVENTS];
+    int           event_count;
+    int           events_dropped;
+    rtt_samples_t set_rtt;
+    rtt_samples_t get_rtt;
+} session_stats_t;
+
+// Per-device session state. Everything learned from the bootloader lives here so
+// that several devices can be flashed concurrently, one worker per session.
+typedef struct session {
+    const sn32_transport_t *transport;
+    void                   *handle;
+    char                   *path;             // hidapi path, NULL when opened by VID/PID
+    char                    prefix[40];       // Output prefix, empty for single-device runs
+    int                     chip;
+    int                     cs_level;
+    uint16_t                code_option;      // Initial Code Option Table
+    uint16_t                user_rom_size;    // in KB
+    uint16_t                user_rom_pages;
+    long                    max_firmware;
+    uint16_t                blank_checksum;
+    uint16_t                cs0;
+    long                    page_size;        // Erase page size in bytes
+    long                    reports;          // Feature reports exchanged so far
+    long                    programmed;       // Image bytes of the last flash confirmed by a probe or the completion
+    long                    probe_interval;   // Reports between status probes while programming, 0 for none, PROBE_PAGE per page
+    bool                    range_checksum;   // CMD_GET_CHECKSUM may be sent, off by default as its layout is unverified
+    bool                    warning_pauses;   // Pause before dangerous operations so an operator can abort, off in the library
+    uint32_t                io_timeout_ms;    // Deadline of each transport call, 0 for none
+    uint64_t                deadline_ns;      // End of the session's time budget, 0 for none
+    struct watchdog        *watchdog;         // Runs transport calls under a deadline, NULL without deadlines
+    const char             *timeout_stage;    // Stage a deadline ran out in, NULL while none has
+    bool                    reacquired;       // Handle moved to the ISP device after an OEM reboot
+    const sn32_timing_t    *timing;           // Per-stage settle times
+    session_stats_t        *stats;            // Stage and round-trip timing, NULL when not collected
+    trace_t                *trace;            // Feature report trace, NULL when not recorded
+    uint16_t                image_checksum;   // Checksums of the last verified range
+    uint16_t                device_checksum;
+    bool                    checksum_read;
+    bool                    debug;            // Dump every report
+    bool                    ok;               // Outcome of the session
+    char                    out_line[2][512]; // Pending partial line per stream (stdout, stderr)
+    size_t                  out_len[2];
+    void (*sink)(void *ctx, int stream_no, const char *line); // Takes complete lines instead of stdout/stderr
+    void *sink_ctx;
+    void (*stage_hook)(struct session *s, const char *stage, int attempt, uint64_t start_ns, bool ok); // Called by stage_record
+    void (*progress_hook)(struct session *s, long done, long total, uint64_t start_ns);               // Programming progress in bytes
+    void *hook_ctx;
+} session_t;
+
+// Watches for USB devices arriving while the keyboard reboots into its bootloader.
+// Created before the reboot request is sent so no arrival is missed.
+typedef struct {
+#ifdef HAVE_LIBUDEV
+    struct udev         *udev;
+    struct udev_monitor *monitor;
+#endif
+    int unused;
+} isp_watch_t;
+
+extern const sn32_transport_t        hidapi_transport;
+extern const sn32_transport_t *const sn32_transports[];
+extern const size_t                  sn32_transport_count;
+
+// Transport of real devices called name, NULL when there is none.
+const sn32_transport_t *sn32_transport_find(const char *name);
+
+void     session_init(session_t *s, const sn32_transport_t *transport, void *handle, const char *path, const char *prefix);
+void     session_free(session_t *s);
+bool     session_set_deadlines(session_t *s, uint32_t io_timeout_ms, uint32_t budget_ms);
+bool     session_sleep(session_t *s, uint32_t ms, const char *stage);
+void     session_log(session_t *s, const char *fmt, ...);
+void     session_err(session_t *s, const char *fmt, ...);
+uint64_t monotonic_ns(void);
+void     stage_record(session_t *s, const char *stage, int attempt, uint64_t start_ns, bool ok);
+
+bool is_known_isp_pid(unsigned int pid);
+bool device_topology(const char *path, char *out, size_t out_size);
+void isp_watch_start(isp_watch_t *w);
+void isp_watch_stop(isp_watch_t *w);
+bool isp_watch_wait(isp_watch_t *w, int timeout_ms);
+
+bool     wait_settle(session_t *s, uint16_t ms);
+bool     protocol_init(session_t *s, bool oem_reboot, char *oem_option);
+bool     protocol_code_option_check(session_t *s);
+bool     protocol_code_option_set(session_t *s, uint16_t code_option, uint16_t cs_value);
+bool     erase_flash(session_t *s, uint16_t page_start, uint16_t page_end, uint16_t blank_checksum);
+// Range checksum through CMD_GET_CHECKSUM. The request and reply layout is a
+// guess that hasn't been confirmed on a device, and the emulator implements the
+// same guess, so it fails unless s->range_checksum opts in. Nothing on the
+// default flash path uses it.
+bool     protocol_get_checksum(session_t *s, uint32_t addr, uint32_t size, uint16_t *checksum);
+bool     protocol_reboot_user(session_t *s);
+uint16_t blank_checksum_range(long size);
+bool     verify_image(session_t *s, long offset, const fw_image_t *image);
+bool     flash(session_t *s, long offset, const fw_image_t *image, bool skip_offset_check, bool trim);
+bool     erase_tail(session_t *s, long end);
+bool     erase_image_range(session_t *s, long offset, long size);
+bool     flash_resume(session_t *s, long offset, const fw_image_t *image, bool skip_offset_check, long done, bool *needs_full_flash);
+bool     flash_differential(session_t *s, long offset, const fw_image_t *image, bool skip_offset_check, bool *needs_full_flash);
+bool     sanity_check_firmware(session_t *s, const fw_image_t *image, long offset);
+bool     sanity_check_jumploader_firmware(session_t *s, const fw_image_t *image);
+bool     image_finalize(fw_image_t *image, bool flash_jumploader, long digest_size);
+
+// Output of the command line image preparation, held back while it runs on the
+// worker thread. Defined by the front end in sonixflasher.c.
+void image_log(const char *fmt, ...);
+void image_err(const char *fmt, ...);
+
+void *image_alloc(size_t size);
+void  image_alloc_free(void *p);
+
+// checksum16 of size bytes of the image from start.
+uint16_t image_range_checksum(const fw_image_t *image, long start, long size);
+
+// Size of the image without its trailing blank (0xFF) reports, at least one report.
+long image_trimmed_size(const fw_image_t *image);
+
+#endif // SONIXFLASHER_H
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sonixflasher.h"
+#include "trace.h"
+
+struct trace {
+    trace_record_t records[TRACE_CAPACITY];
+    uint64_t       total; // Records added, including overwritten ones
+};
+
+static const char *const trace_command_names[] = {
+    [CMD_GET_FW_VERSION]      = "GET_FW_VERSION",
+    [CMD_COMPARE_CODE_OPTION] = "COMPARE_CODE_OPTION",
+    [CMD_SET_ENCRYPTION_ALGO] = "SET_ENCRYPTION_ALGO",
+    [CMD_ENABLE_ERASE]        = "ENABLE_ERASE",
+    [CMD_ENABLE_PROGRAM]      = "ENABLE_PROGRAM",
+    [CMD_GET_CHECKSUM]        = "GET_CHECKSUM",
+    [CMD_RETURN_USER_MODE]    = "RETURN_USER_MODE",
+    [CMD_SET_CS]              = "SET_CS",
+    [CMD_GET_CS]              = "GET_CS",
+};
+
+static const char *const trace_status_names[] = {
+    [TRACE_OK]       = "ok",
+    [TRACE_IO_ERROR] = "FAIL io-error",
+    [TRACE_SHORT]    = "FAIL short",
+    [TRACE_BAD_CMD]  = "FAIL bad-cmd",
+    [TRACE_NAK]      = "FAIL nak",
+};
+
+trace_t *trace_alloc(void) {
+    return calloc(1, sizeof(trace_t));
+}
+
+void trace_free(trace_t *trace) {
+    free(trace);
+}
+
+static uint32_t read_u32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static trace_record_t *trace_next(trace_t *trace, uint64_t start_ns, uint64_t end_ns, int result) {
+    trace_record_t *r = &trace->records[trace->total++ % TRACE_CAPACITY];
+    uint64_t        rtt = end_ns - start_ns;
+
+    memset(r, 0, sizeof(*r));
+    r->time_ns = start_ns;
+    r->rtt_ns  = rtt > UINT32_MAX ? UINT32_MAX : (uint32_t)rtt;
+    r->result  = result;
+    return r;
+}
+
+void trace_set(trace_t *trace, const unsigned char *report, size_t length, int result, uint64_t start_ns, uint64_t end_ns) {
+    trace_record_t *r = trace_next(trace, start_ns, end_ns, result);
+
+    r->type    = length >= 3 && (report[1] | report[2] << 8) == CMD_BASE ? TRACE_SET_CMD : TRACE_SET_DATA;
+    r->command = report[0];
+    r->status  = result < 0 ? TRACE_IO_ERROR : TRACE_OK;
+    if (length >= 12) {
+        r->arg0 = read_u32(report + 4);
+        r->arg1 = read_u32(report + 8);
+    }
+}
+
+void trace_get(trace_t *trace, uint8_t command, const unsigned char *report, int result, uint8_t status, uint64_t start_ns, uint64_t end_ns) {
+    trace_record_t *r = trace_next(trace, start_ns, end_ns, result);
+
+    r->type    = TRACE_GET;
+    r->command = command;
+    r->status  = status;
+    if (report) {
+        r->arg0 = read_u32(report + 4);
+        r->arg1 = read_u32(report + 8);
+    }
+}
+
+bool trace_write(FILE *f, const trace_t *trace, const char *label) {
+    trace_header_t h     = {.version = TRACE_VERSION, .record_size = sizeof(trace_record_t)};
+    uint64_t       first = trace->total > TRACE_CAPACITY ? trace->total - TRACE_CAPACITY : 0;
+
+    memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+    h.count   = (uint32_t)(trace->total - first);
+    h.dropped = (uint32_t)first;
+    snprintf(h.label, sizeof(h.label), "%s", label ? label : "");
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    // The ring wraps at most once: [first % capacity, end) then [0, rest)
+    size_t start = first % TRACE_CAPACITY;
+    size_t head  = h.count < TRACE_CAPACITY - start ? h.count : TRACE_CAPACITY - start;
+    ok           = ok && fwrite(trace->records + start, sizeof(trace_record_t), head, f) == head;
+    ok           = ok && fwrite(trace->records, sizeof(trace_record_t), h.count - head, f) == h.count - head;
+    ok           = ok && fflush(f) == 0;
+    if (!ok) fprintf(stderr, "ERROR: Could not write the trace.\n");
+    return ok;
+}
+
+static void trace_print_record(const trace_record_t *r, uint64_t t0, uint64_t prev_ns, unsigned int gap_ms) {
+    const char *name = r->command < sizeof(trace_command_names) / sizeof(trace_command_names[0]) ? trace_command_names[r->command] : NULL;
+    const char *dir  = r->type == TRACE_GET ? "GET" : "SET";
+    const char *st   = r->status < sizeof(trace_status_names) / sizeof(trace_status_names[0]) ? trace_status_names[r->status] : "FAIL ?";
+    char        command[32];
+
+    if (r->type == TRACE_SET_DATA)
+        snprintf(command, sizeof(command), "data");
+    else if (name)
+        snprintf(command, sizeof(command), "%s", name);
+    else
+        snprintf(command, sizeof(command), "0x%02x", r->command);
+
+    if (prev_ns && r->time_ns - prev_ns > (uint64_t)gap_ms * 1000000) printf("  ---- gap of %.3f ms ----\n", (r->time_ns - prev_ns) / 1e6);
+    printf("  %12.3f  %s  %-20s %-14s %4d  0x%08x 0x%08x  %8.1f\n", (r->time_ns - t0) / 1e6, dir, command, st, r->result, r->arg0, r->arg1, r->rtt_ns / 1e3);
+}
+
+bool trace_decode(const char *file_name, unsigned int gap_ms) {
+    FILE *fp = fopen(file_name, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: Could not open trace '%s'.\n", file_name);
+        return false;
+    }
+
+    trace_header_t h;
+    bool           ok       = true;
+    int            sections = 0;
+    while (fread(&h, sizeof(h), 1, fp) == 1) {
+        if (memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0 || h.version != TRACE_VERSION || h.record_size != sizeof(trace_record_t)) {
+            fprintf(stderr, "ERROR: '%s' is not a trace written by this version.\n", file_name);
+            ok = false;
+            break;
+        }
+        h.label[sizeof(h.label) - 1] = '\0';
+        sections++;
+        printf("Session %s: %u reports", h.label[0] ? h.label : "(unnamed)", h.count);
+        if (h.dropped) printf(", %u older reports overwritten", h.dropped);
+        printf("\n");
+        printf("  %12s  %-3s  %-20s %-14s %4s  %-10s %-10s  %8s\n", "time (ms)", "dir", "command", "result", "res", "arg0", "arg1", "rtt (us)");
+
+        uint64_t t0 = 0, prev_ns = 0;
+        uint32_t failures = 0, gaps = 0;
+        for (uint32_t i = 0; i < h.count; i++) {
+            trace_record_t r;
+            if (fread(&r, sizeof(r), 1, fp) != 1) {
+                fprintf(stderr, "ERROR: Trace is truncated after %u reports.\n", i);
+                ok = false;
+                break;
+            }
+            if (i == 0) t0 = r.time_ns;
+            if (prev_ns && r.time_ns - prev_ns > (uint64_t)gap_ms * 1000000) gaps++;
+            if (r.status != TRACE_OK) failures++;
+            trace_print_record(&r, t0, prev_ns, gap_ms);
+            prev_ns = r.time_ns;
+        }
+        printf("  %u failed, %u gaps over %u ms\n\n", failures, gaps, gap_ms);
+        if (!ok) break;
+    }
+    if (ok && !feof(fp)) ok = false;
+    if (ok && sections == 0) {
+        fprintf(stderr, "ERROR: '%s' holds no trace.\n", file_name);
+        ok = false;
+    }
+    fclose(fp);
+    return ok;
+}
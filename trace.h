@@ -0,0 +1,73 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Binary trace of the feature reports a session exchanges, for --trace. Every
+// report is one fixed-size record appended to a preallocated ring buffer, so
+// tracing costs a clock read and a few stores per report and never does I/O
+// while flashing. The ring is written out when the session ends.
+//
+// File layout: one section per session, each a trace_header_t followed by its
+// records, oldest first. Fields are in host byte order.
+
+#define TRACE_MAGIC "SXTR"
+#define TRACE_VERSION 1
+#define TRACE_CAPACITY 32768 // Records kept per session, older ones are overwritten
+
+// Record types
+#define TRACE_SET_CMD 0  // Command report (CMD_BASE in bytes 1-2)
+#define TRACE_SET_DATA 1 // Firmware data report
+#define TRACE_GET 2
+
+// Result codes
+#define TRACE_OK 0
+#define TRACE_IO_ERROR 1  // Transport call failed
+#define TRACE_SHORT 2     // Response of the wrong length
+#define TRACE_BAD_CMD 3   // Response to another command
+#define TRACE_NAK 4       // Status isn't CMD_ACK
+
+typedef struct {
+    uint64_t time_ns; // Monotonic time the call started
+    uint32_t rtt_ns;  // Duration of the transport call
+    int32_t  result;  // Transport return value
+    uint32_t arg0;    // Report bytes 4-7: argument, or status of a response
+    uint32_t arg1;    // Report bytes 8-11
+    uint8_t  type;
+    uint8_t  command; // Command byte sent, or expected for a response
+    uint8_t  status;  // TRACE_OK, TRACE_NAK, ...
+    uint8_t  reserved;
+} trace_record_t;
+
+typedef struct {
+    char     magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t count;   // Records in this section
+    uint32_t dropped; // Older records overwritten in the ring
+    char     label[64];
+} trace_header_t;
+
+typedef struct trace trace_t;
+
+trace_t *trace_alloc(void);
+void     trace_free(trace_t *trace);
+
+// Record a report sent with a set feature request.
+void trace_set(trace_t *trace, const unsigned char *report, size_t length, int result, uint64_t start_ns, uint64_t end_ns);
+
+// Record a get feature request for command and how its response checked out.
+// report is NULL when nothing was received.
+void trace_get(trace_t *trace, uint8_t command, const unsigned char *report, int result, uint8_t status, uint64_t start_ns, uint64_t end_ns);
+
+// Append the records of trace to f as one section labelled label.
+bool trace_write(FILE *f, const trace_t *trace, const char *label);
+
+// Print a trace file in readable form, flagging failed transactions and gaps
+// between reports longer than gap_ms.
+bool trace_decode(const char *file_name, unsigned int gap_ms);
+
+#endif // TRACE_H
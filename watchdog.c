@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "sonixflasher.h"
+#include "watchdog.h"
+
+#define WATCHDOG_MAX_WAIT_MS 100 // Longest single wait, bounds the effect of wall clock steps
+
+// Threads of abandoned calls that haven't returned yet, see watchdog_drain
+static pthread_mutex_t released_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  released_cond  = PTHREAD_COND_INITIALIZER;
+static int             released_count = 0;
+
+struct watchdog {
+    pthread_t               thread;
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    const sn32_transport_t *transport;
+    void                   *handle;
+    bool                    get;
+    unsigned char           buf[REPORT_SIZE + 1]; // The call's own copy, outlives the session's buffer
+    size_t                  length;
+    int                     result;
+    bool                    pending;  // Call handed to the thread and not returned yet
+    bool                    released; // Abandoned and closed, the thread cleans up after the call
+    bool                    quit;
+};
+
+static void watchdog_free(watchdog_t *w) {
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    free(w);
+}
+
+// Wait on cond until deadline_ns (monotonic_ns() time) at the longest.
+// Condition variables wait on the wall clock, the deadline is monotonic, so the
+// wait is split up to keep clock steps from stretching it.
+static void cond_wait_until(pthread_cond_t *cond, pthread_mutex_t *lock, uint64_t deadline_ns) {
+    uint64_t now = monotonic_ns();
+    if (now >= deadline_ns) return;
+
+    uint64_t        wait_ns = deadline_ns - now;
+    struct timespec ts;
+    if (wait_ns > WATCHDOG_MAX_WAIT_MS * 1000000ull) wait_ns = WATCHDOG_MAX_WAIT_MS * 1000000ull;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    wait_ns += ts.tv_nsec;
+    ts.tv_sec += wait_ns / 1000000000ull;
+    ts.tv_nsec = wait_ns % 1000000000ull;
+    pthread_cond_timedwait(cond, lock, &ts);
+}
+
+static void *watchdog_thread(void *arg) {
+    watchdog_t *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (true) {
+        while (!w->pending && !w->quit)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->quit) break;
+
+        const sn32_transport_t *transport = w->transport;
+        void                   *handle    = w->handle;
+        bool                    get       = w->get;
+        size_t                  length    = w->length;
+        pthread_mutex_unlock(&w->lock);
+        int result = get ? transport->get_feature_report(handle, w->buf, length) : transport->send_feature_report(handle, w->buf, length);
+        pthread_mutex_lock(&w->lock);
+
+        w->result  = result;
+        w->pending = false;
+        pthread_cond_broadcast(&w->cond);
+        if (w->released) {
+            // The session is gone, the handle was left for this thread to close
+            pthread_mutex_unlock(&w->lock);
+            w->transport->close(w->handle);
+            watchdog_free(w);
+            pthread_mutex_lock(&released_lock);
+            released_count--;
+            pthread_cond_broadcast(&released_cond);
+            pthread_mutex_unlock(&released_lock);
+            return NULL;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+watchdog_t *watchdog_start(void) {
+    watchdog_t *w = calloc(1, sizeof(watchdog_t));
+    if (w == NULL) return NULL;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, watchdog_thread, w) != 0) {
+        watchdog_free(w);
+        return NULL;
+    }
+    return w;
+}
+
+int watchdog_call(watchdog_t *w, const sn32_transport_t *transport, void *handle, bool get, unsigned char *data, size_t length, uint64_t deadline_ns) {
+    if (length > sizeof(w->buf)) return -1;
+
+    pthread_mutex_lock(&w->lock);
+    w->transport = transport;
+    w->handle    = handle;
+    w->get       = get;
+    w->length    = length;
+    memcpy(w->buf, data, length);
+    w->pending = true;
+    pthread_cond_broadcast(&w->cond);
+
+    while (w->pending && monotonic_ns() < deadline_ns)
+        cond_wait_until(&w->cond, &w->lock, deadline_ns);
+
+    int result = w->pending ? WATCHDOG_TIMEOUT : w->result;
+    if (result != WATCHDOG_TIMEOUT && get) memcpy(data, w->buf, length);
+    pthread_mutex_unlock(&w->lock);
+    return result;
+}
+
+void watchdog_stop(watchdog_t *w) {
+    pthread_mutex_lock(&w->lock);
+    w->quit = true;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    watchdog_free(w);
+}
+
+static int abandoned_send_feature_report(void *dev, const unsigned char *data, size_t length) {
+    return -1;
+}
+
+static int abandoned_get_feature_report(void *dev, unsigned char *data, size_t length) {
+    return -1;
+}
+
+static const wchar_t *abandoned_error(void *dev) {
+    return L"Device timed out";
+}
+
+// Close the real handle now if the blocked call has returned, else leave it and
+// the watchdog to the thread.
+static void abandoned_close(void *dev) {
+    watchdog_t *w      = dev;
+    pthread_t   thread = w->thread; // w may be freed as soon as the lock is dropped
+
+    pthread_mutex_lock(&w->lock);
+    if (w->pending) {
+        w->released = true;
+        pthread_mutex_lock(&released_lock);
+        released_count++;
+        pthread_mutex_unlock(&released_lock);
+        pthread_mutex_unlock(&w->lock);
+        pthread_detach(thread);
+        return;
+    }
+    pthread_mutex_unlock(&w->lock);
+    w->transport->close(w->handle);
+    watchdog_stop(w);
+}
+
+bool watchdog_drain(uint32_t timeout_ms) {
+    uint64_t deadline = monotonic_ns() + timeout_ms * 1000000ull;
+
+    pthread_mutex_lock(&released_lock);
+    while (released_count > 0 && monotonic_ns() < deadline)
+        cond_wait_until(&released_cond, &released_lock, deadline);
+    bool drained = released_count == 0;
+    pthread_mutex_unlock(&released_lock);
+    return drained;
+}
+
+const sn32_transport_t watchdog_abandoned_transport = {
+    .name                = "timed-out",
+    .send_feature_report = abandoned_send_feature_report,
+    .get_feature_report  = abandoned_get_feature_report,
+    .error               = abandoned_error,
+    .close               = abandoned_close,
+};
@@ -0,0 +1,43 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sonixflasher.h"
+
+// Deadlines for transport calls. hidapi and hidraw feature report calls have no
+// timeout of their own and can block for good on a wedged device or hub, so a
+// session with deadlines makes its calls on a watchdog thread and only waits for
+// them until the deadline. A call that overruns it is abandoned: the session
+// moves its handle over to watchdog_abandoned_transport, whose calls fail at
+// once, and the real handle is closed when the blocked call finally returns.
+// Nothing the blocked call may still touch is freed before then.
+
+#define WATCHDOG_TIMEOUT -2 // watchdog_call result when the deadline passed
+
+typedef struct watchdog watchdog_t;
+
+// Start the watchdog thread. NULL when it can't be created.
+watchdog_t *watchdog_start(void);
+
+// Run a send (get false) or get feature report call of transport on handle and
+// wait for it until deadline_ns (monotonic_ns() time). Returns the call's result,
+// or WATCHDOG_TIMEOUT: the watchdog then owns handle and has to be used as the
+// handle of watchdog_abandoned_transport from there on.
+int watchdog_call(watchdog_t *w, const sn32_transport_t *transport, void *handle, bool get, unsigned char *data, size_t length, uint64_t deadline_ns);
+
+// Stop and free a watchdog that has no call outstanding.
+void watchdog_stop(watchdog_t *w);
+
+// Stands in for the transport of a session whose call timed out. close releases
+// the real handle and the watchdog once the blocked call returns.
+extern const sn32_transport_t watchdog_abandoned_transport;
+
+// Wait up to timeout_ms for the calls of closed abandoned sessions to return and
+// their threads to finish. Until they have, the transport library must not be
+// shut down (hid_exit) under them. Returns false when some are still blocked.
+bool watchdog_drain(uint32_t timeout_ms);
+
+#endif // WATCHDOG_H